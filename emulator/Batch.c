@@ -0,0 +1,229 @@
+/* Batch.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Runs many Space Invaders machines in one process on a pool of threads.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "Batch.h"
+#include "State8080.h"
+
+#define BATCH_MAX_THREADS 256
+#define CACHE_LINE 64
+
+/* The jobs of one thread: the sessions whose next frame it is to run. The
+ * thread takes its own from the bottom, newest first, so that a session
+ * keeps running where its memory is already cached; a thread out of work
+ * steals from the top of another, oldest first. top and bottom only grow,
+ * and index the ring modulo its capacity. */
+typedef struct Deque {
+	pthread_mutex_t lock;
+	int *jobs;
+	int capacity;
+	unsigned top;
+	unsigned bottom;
+} Deque;
+
+typedef struct Worker {
+	struct Deque deque;
+	struct Pool *pool;
+	pthread_t thread;
+	int id;
+	uint64_t frames;
+	uint64_t steals;
+	char pad[CACHE_LINE];	// keeps workers off each other's cache lines
+} Worker;
+
+typedef struct Pool {
+	struct Session *sessions;
+	struct Worker *workers;
+	int threads;
+	atomic_int running;	// sessions with frames left
+} Pool;
+
+static void DequePush(struct Deque *deque, int job)
+{
+	pthread_mutex_lock(&deque->lock);
+	deque->jobs[deque->bottom++ % deque->capacity] = job;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+/* Takes the newest job; returns -1 when there is none */
+static int DequePop(struct Deque *deque)
+{
+	int job = -1;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom != deque->top) {
+		job = deque->jobs[--deque->bottom % deque->capacity];
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return job;
+}
+
+/* Takes the oldest job; returns -1 when there is none */
+static int DequeSteal(struct Deque *deque)
+{
+	int job = -1;
+
+	if (pthread_mutex_trylock(&deque->lock) != 0) {
+		return -1;
+	}
+	if (deque->bottom != deque->top) {
+		job = deque->jobs[deque->top++ % deque->capacity];
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return job;
+}
+
+/* Sets up session to run frames frames of state, whose machine has just
+ * been reset */
+void SessionInit(struct Session *session, struct State8080 *state,
+	int frames, SessionInput input, void *data)
+{
+	session->state = state;
+	session->frame = 0;
+	session->frames = frames;
+	session->input = input;
+	session->data = data;
+	MachineInit(state, &session->scheduler);
+}
+
+/* Runs the next frame of session; returns 1 if it has frames left */
+static int SessionRunFrame(struct Session *session)
+{
+	if (session->input != NULL) {
+		session->input(session, session->frame);
+	}
+	session->frame++;
+	MachineRun(session->state, &session->scheduler,
+		(uint64_t)session->frame * CYCLES_PER_FRAME);
+	return session->frame < session->frames;
+}
+
+/* Runs frames of sessions, its own first and then stolen ones, until no
+ * session has frames left */
+static void *WorkerRun(void *data)
+{
+	struct Worker *worker = data;
+	struct Pool *pool = worker->pool;
+
+	while (atomic_load(&pool->running) > 0) {
+		int job = DequePop(&worker->deque);
+		int i;
+
+		for (i = 1; job < 0 && i < pool->threads; i++) {
+			job = DequeSteal(&pool->workers[(worker->id + i) %
+				pool->threads].deque);
+			worker->steals += job >= 0;
+		}
+		if (job < 0) {
+			sched_yield();
+			continue;
+		}
+
+		worker->frames++;
+		if (SessionRunFrame(&pool->sessions[job])) {
+			DequePush(&worker->deque, job);
+		} else {
+			atomic_fetch_sub(&pool->running, 1);
+		}
+	}
+	return NULL;
+}
+
+/* Runs every session to its last frame on threads threads, or one per
+ * online core if threads is 0, and fills in stats if it is not NULL; the
+ * sessions are dealt out to the threads in turn and a thread that runs out
+ * steals from the others. Returns 0 on success and -1 otherwise. */
+int BatchRun(struct Session *sessions, int count, int threads,
+	struct BatchStats *stats)
+{
+	struct Pool pool;
+	struct timespec start;
+	struct timespec end;
+	int started;
+	int i;
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > BATCH_MAX_THREADS) {
+		threads = BATCH_MAX_THREADS;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	pool.sessions = sessions;
+	pool.threads = threads;
+	pool.workers = calloc(threads, sizeof(struct Worker));
+	if (pool.workers == NULL) {
+		fprintf(stderr, "BatchRun: malloc failed for workers\n");
+		return -1;
+	}
+	atomic_init(&pool.running, 0);
+	for (i = 0; i < threads; i++) {
+		struct Worker *worker = &pool.workers[i];
+
+		worker->pool = &pool;
+		worker->id = i;
+		worker->deque.capacity = count > 0 ? count : 1;
+		worker->deque.jobs = malloc(worker->deque.capacity * sizeof(int));
+		if (worker->deque.jobs == NULL) {
+			fprintf(stderr, "BatchRun: malloc failed for jobs\n");
+			while (i-- > 0) {
+				free(pool.workers[i].deque.jobs);
+			}
+			free(pool.workers);
+			return -1;
+		}
+		pthread_mutex_init(&worker->deque.lock, NULL);
+	}
+	for (i = 0; i < count; i++) {
+		if (sessions[i].frame < sessions[i].frames) {
+			DequePush(&pool.workers[i % threads].deque, i);
+			atomic_fetch_add(&pool.running, 1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&pool.workers[started].thread, NULL, WorkerRun,
+			&pool.workers[started]) != 0) {
+			fprintf(stderr, "BatchRun: cannot start thread %d\n", started);
+			break;
+		}
+	}
+	if (started == 0) {
+		WorkerRun(&pool.workers[0]);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(pool.workers[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (stats != NULL) {
+		stats->threads = started > 0 ? started : 1;
+		stats->frames = 0;
+		stats->steals = 0;
+		stats->seconds = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+	for (i = 0; i < threads; i++) {
+		if (stats != NULL) {
+			stats->frames += pool.workers[i].frames;
+			stats->steals += pool.workers[i].steals;
+		}
+		pthread_mutex_destroy(&pool.workers[i].deque.lock);
+		free(pool.workers[i].deque.jobs);
+	}
+	free(pool.workers);
+	return 0;
+}
@@ -0,0 +1,43 @@
+/* Batch.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Runs many Space Invaders machines in one process on a pool of threads.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "Scheduler.h"
+
+struct State8080;
+struct Session;
+
+/* Sets the inputs of session as frame begins */
+typedef void (*SessionInput)(struct Session *session, int frame);
+
+/* One machine of a batch and the frames it has left to run; a session runs
+ * on one thread at a time, one frame per job */
+typedef struct Session {
+	struct State8080 *state;
+	struct Scheduler scheduler;
+	int frame;		// frames run so far
+	int frames;		// frames to run in all
+	SessionInput input;	// NULL to leave the inputs alone
+	void *data;		// for input
+} Session;
+
+/* What a batch run did */
+typedef struct BatchStats {
+	int threads;
+	uint64_t frames;	// frames run by all sessions
+	uint64_t steals;	// jobs a thread took from another
+	double seconds;
+} BatchStats;
+
+void SessionInit(struct Session *session, struct State8080 *state,
+	int frames, SessionInput input, void *data);
+int BatchRun(struct Session *sessions, int count, int threads,
+	struct BatchStats *stats);
+
+#endif
@@ -0,0 +1,151 @@
+/* BlockCache.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Caches basic blocks of predecoded instructions keyed by the address of
+ * their first instruction.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "BlockCache.h"
+
+/* the table of the pages without blocks; it is never written */
+static struct Block *empty_table[MEMORY_PAGE_SIZE];
+
+/* Invalidates the blocks decoded from the page written at address, and from
+ * every page that maps the same host memory, and stops watching them until
+ * code is decoded from them again */
+static void BlockCacheWrite(struct Memory *memory, uint16_t address,
+	void *data)
+{
+	struct BlockCache *cache = data;
+	const uint8_t *host = memory->read[address >> 8];
+	int page;
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		if (memory->read[page] == host) {
+			cache->generation[page]++;
+			MemoryWatchPage(memory, page, MEMORY_WATCH_CODE, 0);
+		}
+	}
+	cache->stale = 1;
+}
+
+/* Empties the cache and makes it the watch of memory; returns 0 on success
+ * and -1 when the cache cannot be allocated */
+int BlockCacheInit(struct BlockCache *cache, struct Memory *memory)
+{
+	int i;
+
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		cache->table[i] = empty_table;
+		cache->shared[i] = 1;
+		cache->generation[i] = 0;
+	}
+	for (i = 0; i < BLOCK_MAX_FUSED; i++) {
+		cache->fused_hits[i] = 0;
+	}
+	cache->memory = memory;
+	cache->stale = 0;
+	memory->watch = BlockCacheWrite;
+	memory->watch_data = cache;
+	return 0;
+}
+
+/* Frees every block in the cache, leaving the shared ones to their owner */
+void BlockCacheFree(struct BlockCache *cache)
+{
+	int page;
+	int i;
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		if (!cache->shared[page]) {
+			for (i = 0; i < MEMORY_PAGE_SIZE; i++) {
+				free(cache->table[page][i]);
+			}
+			free(cache->table[page]);
+		}
+		cache->table[page] = empty_table;
+		cache->shared[page] = 1;
+	}
+	if (cache->memory->watch_data == cache) {
+		cache->memory->watch = NULL;
+		cache->memory->watch_data = NULL;
+	}
+}
+
+/* Returns the block starting at pc for it to be decoded into, reusing the
+ * stale one if there is one; returns NULL when it cannot be allocated. The
+ * page of pc gets a table of its own first; the blocks of a shared table are
+ * not carried over, as they belong to the cache it was shared from. */
+struct Block *BlockCacheAlloc(struct BlockCache *cache, uint16_t pc)
+{
+	struct Block **table = cache->table[pc >> 8];
+
+	if (cache->shared[pc >> 8]) {
+		table = calloc(MEMORY_PAGE_SIZE, sizeof(struct Block *));
+		if (table == NULL) {
+			fprintf(stderr, "BlockCacheAlloc: malloc failed\n");
+			return NULL;
+		}
+		cache->table[pc >> 8] = table;
+		cache->shared[pc >> 8] = 0;
+	}
+	if (table[pc & 0xFF] == NULL) {
+		table[pc & 0xFF] = malloc(sizeof(struct Block));
+		if (table[pc & 0xFF] == NULL) {
+			fprintf(stderr, "BlockCacheAlloc: malloc failed\n");
+		}
+	}
+	return table[pc & 0xFF];
+}
+
+/* Frees the block starting at pc, if the cache has one of its own */
+void BlockCacheRemove(struct BlockCache *cache, uint16_t pc)
+{
+	if (!cache->shared[pc >> 8]) {
+		free(cache->table[pc >> 8][pc & 0xFF]);
+		cache->table[pc >> 8][pc & 0xFF] = NULL;
+	}
+}
+
+/* Shares the blocks decoded on the ROM pages of from, which must map the
+ * same ROM image, with cache; from must outlive cache and decode no more
+ * blocks on those pages */
+void BlockCacheShare(struct BlockCache *cache, const struct BlockCache *from)
+{
+	int page;
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		if (cache->memory->type[page] == PAGE_ROM && !from->shared[page] &&
+			cache->shared[page]) {
+			cache->table[page] = from->table[page];
+		}
+	}
+}
+
+/* Validates a freshly decoded block whose bytes run from first to last and
+ * watches the pages they are on, unless writes to them are discarded */
+void BlockCacheAdd(struct BlockCache *cache, struct Block *block,
+	uint16_t first, uint16_t last)
+{
+	struct Memory *memory = cache->memory;
+	int i;
+
+	block->pages[0] = first >> 8;
+	block->pages[1] = last >> 8;
+	for (i = 0; i < 2; i++) {
+		const uint8_t *host = memory->read[block->pages[i]];
+		int page;
+
+		block->generation[i] = cache->generation[block->pages[i]];
+		if (memory->type[block->pages[i]] == PAGE_ROM) {
+			continue;
+		}
+		for (page = 0; page < MEMORY_PAGES; page++) {
+			if (memory->read[page] == host) {
+				MemoryWatchPage(memory, page, MEMORY_WATCH_CODE, 1);
+			}
+		}
+	}
+}
@@ -0,0 +1,72 @@
+/* BlockCache.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Caches basic blocks of predecoded instructions keyed by the address of
+ * their first instruction.
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include "Memory.h"
+
+#define BLOCK_MAX_OPS 32
+#define BLOCK_MAX_FUSED 32	// superinstructions the decoder may fuse
+
+/* An instruction with its operands as they were in memory; the first of a
+ * sequence fused into a superinstruction dispatches to it and spans the
+ * rest, which keep their own bytes */
+typedef struct DecodedOp {
+	uint8_t bytes[4];	// the opcode and up to two operands, padded
+	uint16_t dispatch;	// the opcode, or 256 + the superinstruction
+	uint8_t span;		// instructions run by the dispatch
+} DecodedOp;
+
+/* A run of instructions that ends with the first one that can jump, call,
+ * return, halt or enable interrupts; it stays valid while the generations
+ * of the pages it was decoded from do not change */
+typedef struct Block {
+	uint8_t count;
+	uint8_t pages[2];	// pages of its first and last byte
+	uint32_t generation[2];	// generations of those pages when decoded
+	int cycles;		// cycles of the whole block, branches not taken
+	struct DecodedOp ops[BLOCK_MAX_OPS];
+} Block;
+
+/* The blocks are kept in a table per page, so that machines running the same
+ * ROM can share the tables of its pages; a page of the cache that is shared,
+ * or has no blocks yet, is given a table of its own before a block on it is
+ * decoded */
+typedef struct BlockCache {
+	struct Block **table[MEMORY_PAGES];	// the block at each address
+	uint8_t shared[MEMORY_PAGES];	// the table is not the cache's own
+	uint32_t generation[MEMORY_PAGES];	// bumped when a page is written
+	struct Memory *memory;
+	int stale;		// a write has invalidated blocks since it was cleared
+	uint64_t fused_hits[BLOCK_MAX_FUSED];	// runs of each superinstruction
+} BlockCache;
+
+int BlockCacheInit(struct BlockCache *cache, struct Memory *memory);
+void BlockCacheFree(struct BlockCache *cache);
+struct Block *BlockCacheAlloc(struct BlockCache *cache, uint16_t pc);
+void BlockCacheAdd(struct BlockCache *cache, struct Block *block,
+	uint16_t first, uint16_t last);
+void BlockCacheRemove(struct BlockCache *cache, uint16_t pc);
+void BlockCacheShare(struct BlockCache *cache, const struct BlockCache *from);
+
+/* Returns the valid block starting at pc, or NULL when it must be decoded */
+static inline struct Block *BlockCacheFind(const struct BlockCache *cache,
+	uint16_t pc)
+{
+	struct Block *block = cache->table[pc >> 8][pc & 0xFF];
+
+	if (block != NULL &&
+		block->generation[0] == cache->generation[block->pages[0]] &&
+		block->generation[1] == cache->generation[block->pages[1]]) {
+		return block;
+	}
+	return NULL;
+}
+
+#endif
@@ -6,7 +6,23 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
+#include "Batch.h"
+#include "BlockCache.h"
+#include "Memory.h"
+#include "Jit.h"
+#include "Lockstep.h"
+#include "Movie.h"
+#include "Opcodes.h"
+#include "Rewind.h"
+#include "RunAhead.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+#include "State8080.h"
+#include "Video.h"
 
 #define INSTRUCTION_LENGTH 20
 #define NUMBER_OF_INSTRUCTIONS (0xff - 0x00 + 1)
@@ -15,36 +31,10 @@
 #define MAX_INSTRUCTION_SIZE 3
 #define MAX_NUM_DATA (MAX_INSTRUCTION_SIZE - 1)
 
-#define SPACE_INVADERS_ROM_SIZE 4000 /* TODO: Put in right number */
-
-typedef struct Flags {
-	uint8_t s:1; 	// sign flag
-	uint8_t z:1; 	// zero flag
-	uint8_t p:1; 	// parity flag
-	uint8_t c:1; 	// carry flag
-	uint8_t ac:1; 	// auxiliary carry flag
-	uint8_t pad:3;	// padding; three flags are always one or zero
-} Flags;
-
-typedef struct State8080 {
-	/* a to l are the 8 bit working registers; the instruction set refers to
-	register pairs in the following way:
-	AF - PSW
-	BC - B
-	DE - D
-	HL - H */
-	uint8_t a;
-	uint8_t b;
-	uint8_t c;
-	uint8_t d;
-	uint8_t e;
-	uint8_t h;
-	uint8_t l;
-	uint16_t sp;
-	uint16_t pc;
-	struct Flags flags;
-	uint8_t *memory;
-} State8080;
+#define SPACE_INVADERS_ROM_SIZE ROM_SIZE
+
+/* cycles taken to push the program counter and jump to an RST vector */
+#define INTERRUPT_CYCLES 11
 
 /* Returns 1 if 8-bit num is zero; otherwise, return 0. */
 uint8_t isZero_8(uint8_t num) {
@@ -57,916 +47,2423 @@ uint8_t isZero_16(uint16_t num) {
 }
 
 /* Returns whether 16 (or 8)-bit number num is zero */
-#define isZero(num) _Generic(num, uint8_t: izZero_8, uint16_t: isZero_16)(num)
+#define isZero(num) _Generic(num, uint8_t: isZero_8, uint16_t: isZero_16)(num)
+
+/* Sign, zero and parity flags of every 8-bit result in their PSW bit
+ * positions, along with the bit that always reads as one; parity is set when
+ * the number of one bits is even */
+#define PARITY_BIT(n) ((((n) ^ (n) >> 1 ^ (n) >> 2 ^ (n) >> 3 ^ (n) >> 4 ^ \
+	(n) >> 5 ^ (n) >> 6 ^ (n) >> 7) & 1) ? 0 : FLAG_P)
+#define SZP(n) (((n) & FLAG_S) | ((n) == 0 ? FLAG_Z : 0) | PARITY_BIT(n) | \
+	FLAG_ALWAYS)
+#define SZP4(n) SZP(n), SZP((n) + 1), SZP((n) + 2), SZP((n) + 3)
+#define SZP16(n) SZP4(n), SZP4((n) + 4), SZP4((n) + 8), SZP4((n) + 12)
+#define SZP64(n) SZP16(n), SZP16((n) + 16), SZP16((n) + 32), SZP16((n) + 48)
+static const uint8_t szp_table[256] = {
+	SZP64(0), SZP64(64), SZP64(128), SZP64(192)
+};
+
+/* Auxiliary carry out of bit 3, indexed by AC_INDEX(); the 8080 subtracts by
+ * adding the complement, so the subtract table is the carry of that add */
+#define AC_INDEX(a, value, result) ((((a) & 0x08) >> 1) | \
+	(((value) & 0x08) >> 2) | (((result) & 0x08) >> 3))
+static const uint8_t ac_add_table[8] = {
+	0, 0, FLAG_AC, 0, FLAG_AC, 0, FLAG_AC, FLAG_AC
+};
+static const uint8_t ac_sub_table[8] = {
+	FLAG_AC, 0, 0, 0, FLAG_AC, FLAG_AC, FLAG_AC, 0
+};
 
 /* Returns 1 when 8-bit num is even; otherwise, return 0. */
 uint8_t Parity_8(uint8_t num) {
-	return 1 - (num & 0x01);
+	return (szp_table[num] & FLAG_P) != 0;
 }
 
 /* Returns 1 when 16-bit num is even; otherwise, return 0. */
 uint8_t Parity_16(uint16_t num) {
-	return 1 - (num & 0x0001);
+	return Parity_8(num & 0xFF) == Parity_8(num >> 8);
 }
 
 /* Returns the parity (1: even, 0: odd) of a 16 (or 8)-bit number num */
 #define Parity(num) _Generic(num, uint8_t: Parity_8, uint16_t: Parity_16)(num)
 
-/* Updates the state of an 8080 CPU after an add operation with result as the
- * sum */
-void State8080UpdateAdd(struct State8080 *state, uint16_t result)
+/* Reads the byte at address in the memory of the 8080 CPU */
+static inline uint8_t ReadByte(struct State8080 *state, uint16_t address)
+{
+	return MemoryRead(state->memory, address);
+}
+
+/* Writes value to the byte at address in the memory of the 8080 CPU */
+static inline void WriteByte(struct State8080 *state, uint16_t address,
+	uint8_t value)
+{
+	MemoryWrite(state->memory, address, value);
+}
+
+/* Computes the flags of an ALU operation of kind op on operands a and value
+ * that produced result; INR and DCR leave the carry flag unchanged */
+static inline void State8080ComputeFlags(struct State8080 *state, uint8_t op,
+	uint8_t a, uint8_t value, uint16_t result)
+{
+	switch (op) {
+		case ALU_ADD:
+			state->flags = szp_table[result & 0xFF] | (result >> 8) |
+				ac_add_table[AC_INDEX(a, value, result)];
+			break;
+		case ALU_SUB:
+			/* the 8080 adds the two's complement, so the carry flag ends up
+			 * holding the inverted carry out (the borrow) */
+			state->flags = szp_table[result & 0xFF] | ((result >> 8) ^ FLAG_C) |
+				ac_sub_table[AC_INDEX(a, value, result)];
+			break;
+		case ALU_AND:
+			state->flags = szp_table[result] | (((a | value) << 1) & FLAG_AC);
+			break;
+		case ALU_LOGIC:
+			state->flags = szp_table[result];
+			break;
+		case ALU_INR:
+			state->flags = (state->flags & FLAG_C) | szp_table[result] |
+				ac_add_table[AC_INDEX(a, 0, result)];
+			break;
+		case ALU_DCR:
+			state->flags = (state->flags & FLAG_C) | szp_table[result] |
+				ac_sub_table[AC_INDEX(a, 0, result)];
+			break;
+	}
+}
+
+/* Returns the flag byte of the 8080 CPU, first computing it from the last ALU
+ * operation if that was deferred in lazy flags mode */
+static inline uint8_t *State8080Flags(struct State8080 *state)
+{
+#if EMULATOR_LAZY_FLAGS
+	if (state->lazy.op != ALU_NONE) {
+		State8080ComputeFlags(state, state->lazy.op, state->lazy.a,
+			state->lazy.value, state->lazy.result);
+		state->lazy.op = ALU_NONE;
+	}
+#endif
+	return &state->flags;
+}
+
+/* Returns the carry flag as 0 or 1 */
+static inline uint8_t State8080Carry(struct State8080 *state)
+{
+	return *State8080Flags(state) & FLAG_C;
+}
+
+/* Sets the carry flag to carry (0 or 1), leaving the other flags alone */
+static inline void State8080SetCarry(struct State8080 *state, uint8_t carry)
+{
+	uint8_t *flags = State8080Flags(state);
+	*flags = (*flags & ~FLAG_C) | carry;
+}
+
+/* Updates the flags after an ALU operation; in lazy flags mode the operation
+ * is only recorded */
+static inline void State8080UpdateFlags(struct State8080 *state, uint8_t op,
+	uint8_t a, uint8_t value, uint16_t result)
+{
+#if EMULATOR_LAZY_FLAGS
+	/* INR and DCR keep the carry of the operation before them */
+	if (op == ALU_INR || op == ALU_DCR) {
+		State8080Flags(state);
+	}
+	state->lazy.op = op;
+	state->lazy.a = a;
+	state->lazy.value = value;
+	state->lazy.result = result;
+#else
+	State8080ComputeFlags(state, op, a, value, result);
+#endif
+}
+
+/* Adds value and carry to the accumulator, updating all flags */
+static void State8080Add(struct State8080 *state, uint8_t value, uint8_t carry)
+{
+	uint16_t result = (uint16_t)state->a + (uint16_t)value + carry;
+	State8080UpdateFlags(state, ALU_ADD, state->a, value, result);
+	/* Store the least significant 8 bits of result in a */
+	state->a = result & 0xFF;
+}
+
+/* Subtracts value and borrow from the accumulator, updating all flags, and
+ * returns the difference */
+static uint8_t State8080Sub(struct State8080 *state, uint8_t value,
+	uint8_t borrow)
+{
+	uint16_t result = (uint16_t)state->a + (uint8_t)~value + (borrow ^ 1);
+	State8080UpdateFlags(state, ALU_SUB, state->a, value, result);
+	return result & 0xFF;
+}
+
+/* Increments value as INR does; INR leaves the carry flag unchanged */
+static uint8_t State8080Inr(struct State8080 *state, uint8_t value)
+{
+	uint8_t result = value + 1;
+	State8080UpdateFlags(state, ALU_INR, value, 0, result);
+	return result;
+}
+
+/* Decrements value as DCR does; DCR leaves the carry flag unchanged */
+static uint8_t State8080Dcr(struct State8080 *state, uint8_t value)
+{
+	uint8_t result = value - 1;
+	State8080UpdateFlags(state, ALU_DCR, value, 0, result);
+	return result;
+}
+
+/* Decimal adjusts the accumulator after a BCD addition */
+static void State8080Daa(struct State8080 *state)
+{
+	uint8_t correction = 0;
+	uint8_t flags = *State8080Flags(state);
+	uint8_t carry = flags & FLAG_C;
+	uint8_t low = state->a & 0x0F;
+	uint8_t high = state->a >> 4;
+
+	if ((flags & FLAG_AC) || low > 9) {
+		correction |= 0x06;
+	}
+	if (carry || high > 9 || (high >= 9 && low > 9)) {
+		correction |= 0x60;
+		carry = FLAG_C;
+	}
+	State8080Add(state, correction, 0);
+	State8080SetCarry(state, carry);
+}
+
+/* Brings the flag byte up to date, computing it from the last ALU operation
+ * if that was deferred in lazy flags mode */
+void State8080SyncFlags(struct State8080 *state)
+{
+	State8080Flags(state);
+}
+
+/* Returns the flag byte as PUSH PSW stores it in the low byte of PSW */
+static inline uint8_t State8080GetFlags(struct State8080 *state)
+{
+	return *State8080Flags(state);
+}
+
+/* Loads the flag byte from the low byte of PSW as POP PSW does */
+static inline void State8080SetFlags(struct State8080 *state, uint8_t psw)
+{
+	/* every flag is overwritten, so a deferred ALU operation is dropped */
+	state->lazy.op = ALU_NONE;
+	state->flags = (psw & FLAGS_MASK) | FLAG_ALWAYS;
+}
+
+/* Pushes a 16-bit value onto the stack */
+static void State8080Push(struct State8080 *state, uint16_t value)
+{
+	state->sp -= 2;
+	WriteByte(state, state->sp + 1, value >> 8);
+	WriteByte(state, state->sp, value & 0xFF);
+}
+
+/* Pops a 16-bit value off the stack */
+static uint16_t State8080Pop(struct State8080 *state)
+{
+	uint16_t value = ReadByte(state, state->sp) |
+		(ReadByte(state, state->sp + 1) << 8);
+	state->sp += 2;
+	return value;
+}
+
+/* Returns the byte read by IN from port on the Space Invaders hardware */
+uint8_t MachineIn(struct State8080 *state, uint8_t port)
+{
+	switch (port) {
+		case 3:
+			return (state->ports.shift >> (8 - state->ports.shift_offset))
+				& 0xFF;
+		default:
+			return state->ports.in[port & 0x03];
+	}
+}
+
+/* Handles a byte written by OUT to port on the Space Invaders hardware */
+void MachineOut(struct State8080 *state, uint8_t port, uint8_t value)
+{
+	state->ports.out[port & 0x07] = value;
+	switch (port) {
+		case 2:
+			state->ports.shift_offset = value & 0x07;
+			break;
+		case 4:
+			state->ports.shift = (value << 8) | (state->ports.shift >> 8);
+			break;
+	}
+}
+
+/* Operand accessors used by the opcode table below; M refers to the byte in
+ * memory addressed by HL and IMM to the immediate byte of the instruction */
+#define GET_A state->a
+#define GET_B state->b
+#define GET_C state->c
+#define GET_D state->d
+#define GET_E state->e
+#define GET_H state->h
+#define GET_L state->l
+#define GET_M ReadByte(state, GET_HL)
+#define GET_IMM BYTE
+#define SET_A(v) state->a = (v)
+#define SET_B(v) state->b = (v)
+#define SET_C(v) state->c = (v)
+#define SET_D(v) state->d = (v)
+#define SET_E(v) state->e = (v)
+#define SET_H(v) state->h = (v)
+#define SET_L(v) state->l = (v)
+#define SET_M(v) WriteByte(state, GET_HL, (v))
+
+#define GET_BC state->bc
+#define GET_DE state->de
+#define GET_HL state->hl
+#define GET_SP state->sp
+#define GET_PSW ((uint16_t)(state->a << 8 | State8080GetFlags(state)))
+#define SET_BC(v) state->bc = (v)
+#define SET_DE(v) state->de = (v)
+#define SET_HL(v) state->hl = (v)
+#define SET_SP(v) state->sp = (v)
+#define SET_PSW(v) do { uint16_t pair = (v); state->a = pair >> 8; \
+	State8080SetFlags(state, pair & 0xFF); } while (0)
+
+/* the program counter; Run8080() keeps it in a local while it runs */
+#define PC state->pc
+
+/* data arguments of the current instruction */
+#define BYTE instruction[1]
+#define WORD ((uint16_t)(instruction[2] << 8 | instruction[1]))
+
+/* flag byte as read or partially written by an instruction */
+#define FLAGS (*State8080Flags(state))
+#define CARRY State8080Carry(state)
+#define SET_CARRY(v) State8080SetCarry(state, (v))
+
+/* branch conditions */
+#define COND_NZ (!(FLAGS & FLAG_Z))
+#define COND_Z (FLAGS & FLAG_Z)
+#define COND_NC (!(FLAGS & FLAG_C))
+#define COND_C (FLAGS & FLAG_C)
+#define COND_PO (!(FLAGS & FLAG_P))
+#define COND_PE (FLAGS & FLAG_P)
+#define COND_P (!(FLAGS & FLAG_S))
+#define COND_M (FLAGS & FLAG_S)
+
+/* Instruction bodies; each runs after the program counter has been moved
+ * past the instruction */
+#define NOP
+#define MOV(dst, src) SET_##dst(GET_##src)
+#define MVI(r) SET_##r(BYTE)
+#define LXI(rp) SET_##rp(WORD)
+#define LDA state->a = ReadByte(state, WORD)
+#define STA WriteByte(state, WORD, state->a)
+#define LHLD SET_HL(ReadByte(state, WORD) | (ReadByte(state, WORD + 1) << 8))
+#define SHLD WriteByte(state, WORD, state->l); \
+	WriteByte(state, WORD + 1, state->h)
+#define LDAX(rp) state->a = ReadByte(state, GET_##rp)
+#define STAX(rp) WriteByte(state, GET_##rp, state->a)
+#define XCHG do { uint16_t de = GET_DE; SET_DE(GET_HL); SET_HL(de); } while (0)
+#define XTHL do { uint16_t top = State8080Pop(state); \
+	State8080Push(state, GET_HL); SET_HL(top); } while (0)
+#define SPHL state->sp = GET_HL
+#define PCHL PC = GET_HL
+
+#define ADD(r) State8080Add(state, GET_##r, 0)
+#define ADC(r) State8080Add(state, GET_##r, CARRY)
+#define SUB(r) state->a = State8080Sub(state, GET_##r, 0)
+#define SBB(r) state->a = State8080Sub(state, GET_##r, CARRY)
+#define ANA(r) do { uint8_t value = GET_##r; \
+	State8080UpdateFlags(state, ALU_AND, state->a, value, state->a & value); \
+	state->a &= value; } while (0)
+#define XRA(r) state->a ^= GET_##r; \
+	State8080UpdateFlags(state, ALU_LOGIC, 0, 0, state->a)
+#define ORA(r) state->a |= GET_##r; \
+	State8080UpdateFlags(state, ALU_LOGIC, 0, 0, state->a)
+#define CMP(r) State8080Sub(state, GET_##r, 0)
+#define INR(r) SET_##r(State8080Inr(state, GET_##r))
+#define DCR(r) SET_##r(State8080Dcr(state, GET_##r))
+#define INX(rp) SET_##rp(GET_##rp + 1)
+#define DCX(rp) SET_##rp(GET_##rp - 1)
+#define DAD(rp) do { uint32_t sum = (uint32_t)GET_HL + GET_##rp; \
+	SET_CARRY(sum >> 16); SET_HL(sum); } while (0)
+#define DAA State8080Daa(state)
+
+#define RLC SET_CARRY(state->a >> 7); \
+	state->a = (state->a << 1) | (state->a >> 7)
+#define RRC SET_CARRY(state->a & 0x01); \
+	state->a = (state->a >> 1) | (state->a << 7)
+#define RAL do { uint8_t carry = CARRY; \
+	SET_CARRY(state->a >> 7); \
+	state->a = (state->a << 1) | carry; } while (0)
+#define RAR do { uint8_t carry = CARRY; \
+	SET_CARRY(state->a & 0x01); \
+	state->a = (state->a >> 1) | (carry << 7); } while (0)
+#define CMA state->a = ~state->a
+#define STC FLAGS |= FLAG_C
+#define CMC FLAGS ^= FLAG_C
+
+#define JMP PC = WORD
+#define JCC(cc) if (COND_##cc) JMP
+/* the address is fetched before the return address is pushed, as the stack
+ * may overlap the instruction */
+#define CALL do { uint16_t address = WORD; \
+	State8080Push(state, PC); PC = address; } while (0)
+#define CCC(cc) if (COND_##cc) { CALL; executed += taken_extra; }
+#define RET PC = State8080Pop(state)
+#define RCC(cc) if (COND_##cc) { RET; executed += taken_extra; }
+#define RST(n) do { State8080Push(state, PC); PC = (n) * 8; } while (0)
+#define PUSH(rp) State8080Push(state, GET_##rp)
+#define POP(rp) SET_##rp(State8080Pop(state))
+
+#define IN state->a = state->in(state, BYTE)
+#define OUT state->out(state, BYTE, state->a)
+/* an interrupt that arrived while disabled is taken after the instruction
+ * following EI, so EI ends the run to let the machine deliver it */
+#define EI state->int_enable = 1; if (state->int_pending) { EXIT_RUN; }
+#define DI state->int_enable = 0
+/* HLT stops the CPU until an interrupt arrives and ends the current run */
+#define HLT state->halted = 1; EXIT_RUN
+
+/* Superinstructions: idioms of the inner loops of Space Invaders that the
+ * block decoder fuses into one op, so that they are dispatched once, as
+ * FUSED(name, count, first, second, third, body) where first to third are
+ * the opcodes of the count instructions fused (third is 0 for a pair). The
+ * body runs each of them with STEP, which moves instruction on to the bytes
+ * of the next op; a write may make the rest of the block stale, so the
+ * superinstruction ends after it if it did. */
+#define STEP(opcode, body) \
+	PC += length_table[opcode]; \
+	executed += cycles_table[opcode].cycles; \
+	body; \
+	instruction += sizeof(struct DecodedOp)
+#define STOP_IF_STALE if (state->blocks->stale) { FUSED_STOP; }
+
+#define DCR_JNZ(FUSED, r, opcode) \
+	FUSED(DCR_##r##_JNZ, 2, opcode, 0xC2, 0, \
+		STEP(opcode, DCR(r)); STEP(0xC2, JCC(NZ)))
+#define MOV_M_INX_H(FUSED, r, opcode) \
+	FUSED(LXI_H_MOV_M_##r##_INX_H, 3, 0x21, opcode, 0x23, \
+		STEP(0x21, LXI(HL)); STEP(opcode, MOV(M, r)); STOP_IF_STALE; \
+		STEP(0x23, INX(HL)))
+
+#define FUSED_OPS(FUSED) \
+	FUSED(LDAX_B_INX_B, 2, 0x0A, 0x03, 0, \
+		STEP(0x0A, LDAX(BC)); STEP(0x03, INX(BC))) \
+	FUSED(LDAX_D_INX_D, 2, 0x1A, 0x13, 0, \
+		STEP(0x1A, LDAX(DE)); STEP(0x13, INX(DE))) \
+	FUSED(MOV_M_A_INX_H, 2, 0x77, 0x23, 0, \
+		STEP(0x77, MOV(M, A)); STOP_IF_STALE; STEP(0x23, INX(HL))) \
+	DCR_JNZ(FUSED, B, 0x05) DCR_JNZ(FUSED, C, 0x0D) \
+	DCR_JNZ(FUSED, D, 0x15) DCR_JNZ(FUSED, E, 0x1D) \
+	DCR_JNZ(FUSED, H, 0x25) DCR_JNZ(FUSED, L, 0x2D) \
+	DCR_JNZ(FUSED, A, 0x3D) \
+	FUSED(MOV_A_M_ORA_A_JZ, 3, 0x7E, 0xB7, 0xCA, \
+		STEP(0x7E, MOV(A, M)); STEP(0xB7, ORA(A)); STEP(0xCA, JCC(Z))) \
+	FUSED(MOV_A_M_ORA_A_JNZ, 3, 0x7E, 0xB7, 0xC2, \
+		STEP(0x7E, MOV(A, M)); STEP(0xB7, ORA(A)); STEP(0xC2, JCC(NZ))) \
+	MOV_M_INX_H(FUSED, B, 0x70) MOV_M_INX_H(FUSED, C, 0x71) \
+	MOV_M_INX_H(FUSED, D, 0x72) MOV_M_INX_H(FUSED, E, 0x73) \
+	MOV_M_INX_H(FUSED, A, 0x77)
+
+/* superinstructions are dispatched as 256 + their number */
+#define FUSED_NUMBER(name, count, first, second, third, body) FUSED_##name,
+enum { FUSED_OPS(FUSED_NUMBER) FUSED_COUNT };
+_Static_assert(FUSED_COUNT <= BLOCK_MAX_FUSED,
+	"the block cache counts the runs of every superinstruction");
+
+/* Cycles taken by each opcode, with the cost of a conditional call or return
+ * both when its condition fails and when it holds */
+#define CYCLES_ENTRY(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	[opcode] = { cycles, taken },
+const struct Cycles cycles_table[NUMBER_OF_INSTRUCTIONS] = {
+	OPCODES(CYCLES_ENTRY)
+};
+
+/* Length in bytes of each opcode */
+#define LENGTH_ENTRY(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	[opcode] = length,
+const uint8_t length_table[NUMBER_OF_INSTRUCTIONS] = {
+	OPCODES(LENGTH_ENTRY)
+};
+
+#if EMULATOR_DISPATCH == DISPATCH_TABLE || EMULATOR_JIT
+
+/* The JIT calls these for the instructions it does not translate. A handler
+ * cannot leave the run loop itself; Run8080() checks stop */
+#define EXIT_RUN state->stop = 1
+#define HANDLER(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	static int op_##opcode(struct State8080 *state, \
+		const uint8_t *instruction) \
+	{ \
+		const int taken_extra = (taken) - (cycles); \
+		int executed = cycles; \
+		(void)instruction; \
+		(void)taken_extra; \
+		PC += length; \
+		body; \
+		return executed; \
+	}
+OPCODES(HANDLER)
+#undef EXIT_RUN
+
+#define FUSED_STOP return executed
+#define FUSED_HANDLER(name, count, first, second, third, body) \
+	static int fused_##name(struct State8080 *state, \
+		const uint8_t *instruction) \
+	{ \
+		int executed = 0; \
+		state->blocks->fused_hits[FUSED_##name]++; \
+		body; \
+		return executed; \
+	}
+FUSED_OPS(FUSED_HANDLER)
+#undef FUSED_STOP
+
+#define HANDLER_ENTRY(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	[opcode] = op_##opcode,
+#define FUSED_HANDLER_ENTRY(name, count, first, second, third, body) \
+	[NUMBER_OF_INSTRUCTIONS + FUSED_##name] = fused_##name,
+const Handler handlers[NUMBER_OF_INSTRUCTIONS + FUSED_COUNT] = {
+	OPCODES(HANDLER_ENTRY)
+	FUSED_OPS(FUSED_HANDLER_ENTRY)
+};
+
+#endif
+
+/* Returns 1 if opcode can jump, call, return or leave the run loop, which
+ * ends a basic block; otherwise, return 0. */
+int EndsBlock(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0xC0: case 0xC8: case 0xD0: case 0xD8:	// RCC
+	case 0xE0: case 0xE8: case 0xF0: case 0xF8:
+	case 0xC2: case 0xCA: case 0xD2: case 0xDA:	// JCC
+	case 0xE2: case 0xEA: case 0xF2: case 0xFA:
+	case 0xC4: case 0xCC: case 0xD4: case 0xDC:	// CCC
+	case 0xE4: case 0xEC: case 0xF4: case 0xFC:
+	case 0xC7: case 0xCF: case 0xD7: case 0xDF:	// RST
+	case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+	case 0xC3: case 0xCB:				// JMP
+	case 0xC9: case 0xD9:				// RET
+	case 0xCD: case 0xDD: case 0xED: case 0xFD:	// CALL
+	case 0xE9:					// PCHL
+	case 0x76:					// HLT
+	case 0xFB:					// EI
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* The opcodes fused by each superinstruction, for the decoder to match */
+typedef struct FusedPattern {
+	uint8_t count;
+	uint8_t opcodes[3];
+	const char *name;
+} FusedPattern;
+
+#define FUSED_PATTERN(name, count, first, second, third, body) \
+	{ count, { first, second, third }, #name },
+static const struct FusedPattern fused_patterns[FUSED_COUNT] = {
+	FUSED_OPS(FUSED_PATTERN)
+};
+
+/* Returns the superinstruction fusing the longest idiom at the start of the
+ * count ops, or -1 if none does */
+static int State8080MatchFused(const struct DecodedOp *ops, int count)
+{
+	int best = -1;
+	int f;
+	int i;
+
+	for (f = 0; f < FUSED_COUNT; f++) {
+		const struct FusedPattern *pattern = &fused_patterns[f];
+
+		if (pattern->count > count ||
+			(best >= 0 && pattern->count <= fused_patterns[best].count)) {
+			continue;
+		}
+		for (i = 0; i < pattern->count; i++) {
+			if (ops[i].bytes[0] != pattern->opcodes[i]) {
+				break;
+			}
+		}
+		if (i == pattern->count) {
+			best = f;
+		}
+	}
+	return best;
+}
+
+/* Sets every op of block to dispatch on its opcode, or on the superinstruction
+ * fusing it with the ops after it */
+static void State8080FuseBlock(struct Block *block)
 {
-	/* Updates Zero flag */
-	if isZero(result) {
-		state->flags->z = 1;
-	} else {
-		state->flags->z = 0;
+	int i = 0;
+
+	while (i < block->count) {
+		struct DecodedOp *op = &block->ops[i];
+		int fused = EMULATOR_FUSION ?
+			State8080MatchFused(op, block->count - i) : -1;
+
+		op->dispatch = op->bytes[0];
+		op->span = 1;
+		if (fused >= 0) {
+			op->dispatch = NUMBER_OF_INSTRUCTIONS + fused;
+			op->span = fused_patterns[fused].count;
+		}
+		i++;
+		/* the ops fused into it keep dispatching on their opcodes for the
+		 * JIT, which translates them one by one */
+		for (; i < block->count && op + op->span > &block->ops[i]; i++) {
+			block->ops[i].dispatch = block->ops[i].bytes[0];
+			block->ops[i].span = 1;
+		}
 	}
-	
-	/* Updates Sign flag - set to 1 when bit 7 is set to 1 */
-	if (result & 0x0080) {
-		state->flags->s = 1;
-	} else {
-		state->flags->s = 0;
+}
+
+/* Decodes the basic block starting at pc into the block cache of the CPU and
+ * returns it, or NULL when it cannot be allocated */
+static struct Block *State8080DecodeBlock(struct State8080 *state,
+	uint16_t pc)
+{
+	struct Block *block = BlockCacheAlloc(state->blocks, pc);
+	uint16_t address = pc;
+	uint8_t opcode;
+
+	if (block == NULL) {
+		return NULL;
 	}
-	
-	/* Updates carry flag - set to 1 when instruction resulted in carry */
-	if (result > 0xFF) {
-		state->flags->c = 1;
-	} else {
-		state->flags->c = 0;
+	block->count = 0;
+	block->cycles = 0;
+	do {
+		struct DecodedOp *op = &block->ops[block->count++];
+		int i;
+
+		opcode = ReadByte(state, address);
+		for (i = 0; i < MAX_INSTRUCTION_SIZE; i++) {
+			op->bytes[i] = i < length_table[opcode] ?
+				ReadByte(state, address + i) : 0;
+		}
+		block->cycles += cycles_table[opcode].cycles;
+		address += length_table[opcode];
+	} while (!EndsBlock(opcode) && block->count < BLOCK_MAX_OPS);
+	State8080FuseBlock(block);
+
+	BlockCacheAdd(state->blocks, block, pc, address - 1);
+	return block;
+}
+
+/* Decodes a block at every address of the ROM of state, leaving out its
+ * mirrors and the blocks that run on into RAM, so that the caches of other
+ * machines running the same ROM image can share them */
+void State8080DecodeRom(struct State8080 *state)
+{
+	const struct Memory *memory = state->memory;
+	int page;
+	int i;
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		int mirror = 0;
+
+		for (i = 0; i < page; i++) {
+			mirror |= memory->read[i] == memory->read[page];
+		}
+		if (memory->type[page] != PAGE_ROM || mirror) {
+			continue;
+		}
+		for (i = 0; i < MEMORY_PAGE_SIZE; i++) {
+			uint16_t pc = page * MEMORY_PAGE_SIZE + i;
+			struct Block *block = State8080DecodeBlock(state, pc);
+
+			if (block != NULL &&
+				memory->type[block->pages[1]] != PAGE_ROM) {
+				BlockCacheRemove(state->blocks, pc);
+			}
+		}
 	}
-	
-	/* Update parity flag */
-	state->flags->p = Parity(answer);
 }
 
-/* emulates the 8080 instruction set given a pointer to the current state of 
- * the CPU; follows a simple fetch-decode=execute model */
-int Emulate(struct State8080 *state) 
+/* Returns the block starting at pc, decoding it if it is not cached */
+struct Block *State8080Block(struct State8080 *state, uint16_t pc)
+{
+	struct Block *block = BlockCacheFind(state->blocks, pc);
+
+	return block != NULL ? block : State8080DecodeBlock(state, pc);
+}
+
+/* Runs the 8080 CPU until at least cycle_budget cycles have been taken or the
+ * CPU halts, and returns the number of cycles consumed; a halted CPU idles
+ * away the whole budget until an interrupt wakes it. The cycles are added to
+ * the running cycle counter of the CPU. */
+int Run8080(struct State8080 *state, int cycle_budget)
 {
 	/* Implementation Note:
-	 * 
+	 *
 	 * Originally, the 8080 contained an instruction register that is supposed
 	 * to contain the current instruction to be decoded and then executed.
 	 * Emulating this feature of the CPU, one might place such a register
 	 * in the state struct.
-	 * 
+	 *
 	 * Alternatively, we will use a pointer to current instruction, which
-	 * will make referencing data arguments simpler. */
+	 * will make referencing data arguments simpler. An instruction running
+	 * onto the next page is copied to fetched first. */
+	const uint8_t *instruction;
+	uint8_t fetched[MEMORY_FETCH_SIZE];
+	int executed = 0;
+
+	/* with a block cache, whole blocks that fit in the budget run from their
+	 * decoded ops; the rest of the budget is run one instruction at a time
+	 * so that the run ends exactly where it would without the cache */
+	struct BlockCache *blocks = state->blocks;
+	struct Block *block;
+	const struct DecodedOp *op = NULL;
+	const struct DecodedOp *op_end = NULL;
+
+	if (cycle_budget <= 0) {
+		return 0;
+	}
+	if (state->halted) {
+		state->cycles += cycle_budget;
+		return cycle_budget;
+	}
+
+#if EMULATOR_JIT
+	if (state->jit != NULL) {
+		executed = JitRun(state, cycle_budget);
+		goto finish;
+	}
+#endif
+
+#if EMULATOR_DISPATCH == DISPATCH_GOTO
+	/* the program counter and memory map are held in locals for the whole
+	 * run and the program counter is written back once at the end */
+	const struct Memory *memory = state->memory;
+	uint16_t pc = state->pc;
+
+#undef PC
+#define PC pc
+#define EXIT_RUN goto done
+	/* threaded dispatch: every body ends with its own jump to the next op
+	 * of the block, or else its own budget check, fetch and indirect jump,
+	 * so each jump is predicted for the opcode it follows */
+#define NEXT \
+	if (op != op_end && !blocks->stale) { \
+		instruction = op->bytes; \
+		goto *labels[(op++)->dispatch]; \
+	} \
+	goto next
+#define LABEL_ENTRY(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	[opcode] = &&op_##opcode,
+#define LABEL(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	op_##opcode: { \
+		const int taken_extra = (taken) - (cycles); \
+		(void)taken_extra; \
+		PC += length; \
+		executed += cycles; \
+		body; \
+		NEXT; \
+	}
+#define FUSED_STOP NEXT
+#define FUSED_LABEL_ENTRY(name, count, first, second, third, body) \
+	[NUMBER_OF_INSTRUCTIONS + FUSED_##name] = &&fused_##name,
+#define FUSED_LABEL(name, count, first, second, third, body) \
+	fused_##name: { \
+		op += (count) - 1; \
+		blocks->fused_hits[FUSED_##name]++; \
+		body; \
+		NEXT; \
+	}
+	static void *const labels[NUMBER_OF_INSTRUCTIONS + FUSED_COUNT] = {
+		OPCODES(LABEL_ENTRY)
+		FUSED_OPS(FUSED_LABEL_ENTRY)
+	};
+
+next:
+	if (executed >= cycle_budget) {
+		goto done;
+	}
+	if (blocks != NULL && (block = State8080Block(state, pc)) != NULL &&
+		executed + block->cycles <= cycle_budget) {
+		blocks->stale = 0;
+		op = block->ops;
+		op_end = op + block->count;
+		instruction = op->bytes;
+		goto *labels[(op++)->dispatch];
+	}
 
 	/* fetch the instruction from memory as pointed at by PC */
-	uint8_t *instruction = &state->memory[state->pc];
-	
-	/* 16-bit register to temporarily hold result of 16-bit arithmetic ops */
-	uint16_t result;
-	
-	/* examine the opcode and execute it */
-	switch (*instruction) {
-
-		/* getting the possible data args, execute the instruction, and then
-		 * increase the program counter */
-		case 0x00:
-			state->pc++;
-			break;
-		case 0x01:
-			printf("LXI    B,#$%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0x02:
-			printf("STAX   B");
-			break;
-		case 0x03:
-			printf("INX    B");
-			break;
-		case 0x04:
-			printf("INR    B");
-			break;
-		case 0x05:
-			printf("DCR    B");
-			break;
-		case 0x06:
-			printf("MVI    B,#$%02x", next_instr[1]);
-			break;
-		case 0x07:
-			printf("RLC");
-			break;
-		case 0x08:
-			break;
-		case 0x09:
-			printf("DAD    B");
-			break;
-		case 0x0A:
-			printf("LDAX   B");
-			break;
-		case 0x0B:
-			printf("DCX    B");
-			break;
-		case 0x0C:
-			printf("INR    C");
-			break;
-		case 0x0D:
-			printf("DCR    C");
-			break;
-		case 0x0E:
-			printf("MVI    C,#$%02x", next_instr[1]);
-			break;
-		case 0x0F:
-			printf("RRC");
-			break;
-		case 0x10:
-			printf("NOP");
-			break;
-		case 0x11:
-			printf("LXI    D,#$%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0x12:
-			printf("STAX   D");
-			break;
-		case 0x13:
-			printf("INX    D");
-			break;
-		case 0x14:
-			printf("INR    D");
-			break;
-		case 0x15:
-			printf("DCR    D");
-			break;
-		case 0x16:
-			printf("MVI    D,#$%02x",next_instr[1]);
-			break;
-		case 0x17:
-			printf("RAL");
-			break;
-		case 0x18:
-			printf("NOP");
-			break;
-		case 0x19:
-			printf("DAD    D");
-			break;
-		case 0x1A:
-			printf("LDAX   D");
-			break;
-		case 0x1B:
-			printf("DCX    D");
-			break;
-		case 0x1C:
-			printf("INR    E");
-			break;
-		case 0x1D:
-			printf("DCR    E");
-			break;
-		case 0x1E:
-			printf("MVI    E,#$%02x",next_instr[1]);
-			break;
-		case 0x1F:
-			printf("RAR");
-			break;
-		case 0x20:
-			printf("RIM");
-			break;
-		case 0x21:
-			printf("LXI    H,#$%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0x22:
-			printf("SHLD   $%02x%02x",next_instr[2],next_instr[1]);
-			break;
-		case 0x23:
-			printf("INX    H");
-			break;
-		case 0x24:
-			printf("INR    H");
-			break;
-		case 0x25:
-			printf("DCR    H");
-			break;
-		case 0x26:
-			printf("MVI    H,#$%02x",next_instr[1]);
-			break;
-		case 0x27:
-			printf("DAA");
-			break;
-		case 0x28:
-			printf("NOP");
-			break;
-		case 0x29:
-			printf("DAD    H");
-			break;
-		case 0x2A:
-			printf("LHLD   $%02x%02x",next_instr[2],next_instr[1]);
-			break;
-		case 0x2B:
-			printf("DCX    H");
-			break;
-		case 0x2C:
-			printf("INR    L");
-			break;
-		case 0x2D:
-			printf("DCR    L");
-			break;
-		case 0x2E:
-			printf("MVI    L,#$%02x", next_instr[1]);
-			break;
-		case 0x2F:
-			printf("CMA");
-			break;
-		case 0x30:
-			printf("SIM");
-			break;
-		case 0x31:
-			printf("LXI    SP, #$%02x%02x",next_instr[2],next_instr[1]);
-			break;
-		case 0x32:
-			printf("STA    $%02x%02x",next_instr[2],next_instr[1]);
-			break;
-		case 0x33:
-			printf("INX    SP");
-			break;
-		case 0x34:
-			printf("INR    M");
-			break;
-		case 0x35:
-			printf("DCR    M");
-			break;
-		case 0x36:
-			printf("MVI    M,#$%02x", next_instr[1]);
-			break;
-		case 0x37:
-			printf("STC");
-			break;
-		case 0x38:
-			printf("NOP");
-			break;
-		case 0x39:
-			printf("DAD   SP");
-			break;
-		case 0x3A:
-			printf("LDA    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0x3B:
-			printf("DCX    SP");
-			break;
-		case 0x3C:
-			printf("INR    A");
-			break;
-		case 0x3D:
-			printf("DCR    A");
-			break;
-		case 0x3E:
-			printf("MVI    A,#$%02x", next_instr[1]);
-			break;
-		case 0x3F:
-			printf("CMC");
-			break;
-		case 0x40:
-			printf("MOV    B,B");
-			break;
-		case 0x41:
-			printf("MOV    B,C");
-			break;
-		case 0x42:
-			printf("MOV    B,D");
-			break;
-		case 0x43:
-			printf("MOV    B,E");
-			break;
-		case 0x44:
-			printf("MOV    B,H");
-			break;
-		case 0x45:
-			printf("MOV    B,L");
-			break;
-		case 0x46:
-			printf("MOV    B,M");
-			break;
-		case 0x47:
-			printf("MOV    B,A");
-			break;
-		case 0x48:
-			printf("MOV    C,B");
-			break;
-		case 0x49:
-			printf("MOV    C,C");
-			break;
-		case 0x4A:
-			printf("MOV    C,D");
-			break;
-		case 0x4B:
-			printf("MOV    C,E");
-			break;
-		case 0x4C:
-			printf("MOV    C,H");
-			break;
-		case 0x4D:
-			printf("MOV    C,L");
-			break;
-		case 0x4E:
-			printf("MOV    C,M");
-			break;
-		case 0x4F:
-			printf("MOV    C,A");
-			break;
-		case 0x50:
-			printf("MOV    D,B");
-			break;
-		case 0x51:
-			printf("MOV    D,C");
-			break;
-		case 0x52:
-			printf("MOV    D,D");
-			break;
-		case 0x53:
-			printf("MOV    D,E");
-			break;
-		case 0x54:
-			printf("MOV    D,H");
-			break;
-		case 0x55:
-			printf("MOV    D,L");
-			break;
-		case 0x56:
-			printf("MOV    D,M");
-			break;
-		case 0x57:
-			printf("MOV    D,A");
-			break;
-		case 0x58:
-			printf("MOV    E,B");
-			break;
-		case 0x59:
-			printf("MOV    E,C");
-			break;
-		case 0x5A:
-			printf("MOV    E,D");
-			break;
-		case 0x5B:
-			printf("MOV    E,E");
-			break;
-		case 0x5C:
-			printf("MOV    E,H");
-			break;
-		case 0x5D:
-			printf("MOV    E,L");
-			break;
-		case 0x5E:
-			printf("MOV    E,M");
-			break;
-		case 0x5F:
-			printf("MOV    E,A");
-			break;
-		case 0x60:
-			printf("MOV    H,B");
-			break;
-		case 0x61:
-			printf("MOV    H,C");
-			break;
-		case 0x62:
-			printf("MOV    H,D");
-			break;
-		case 0x63:
-			printf("MOV    H,E");
-			break;
-		case 0x64:
-			printf("MOV    H,H");
-			break;
-		case 0x65:
-			printf("MOV    H,L");
-			break;
-		case 0x66:
-			printf("MOV    H,M");
-			break;
-		case 0x67:
-			printf("MOV    H,A");
-			break;
-		case 0x68:
-			printf("MOV    L,B");
-			break;
-		case 0x69:
-			printf("MOV    L,C");
-			break;
-		case 0x6A:
-			printf("MOV    L,D");
-			break;
-		case 0x6B:
-			printf("MOV    L,E");
-			break;
-		case 0x6C:
-			printf("MOV    L,H");
-			break;
-		case 0x6D:
-			printf("MOV    L,L");
-			break;
-		case 0x6E:
-			printf("MOV    L,M");
-			break;
-		case 0x6F:
-			printf("MOV    L,A");
-			break;
-		case 0x70:
-			printf("MOV    M,B");
-			break;
-		case 0x71:
-			printf("MOV    M,C");
-			break;
-		case 0x72:
-			printf("MOV    M,D");
-			break;
-		case 0x73:
-			printf("MOV    M,E");
-			break;
-		case 0x74:
-			printf("MOV    M,H");
-			break;
-		case 0x75:
-			printf("MOV    M,L");
-			break;
-		case 0x76:
-			printf("HLT");
-			break;
-		case 0x77:
-			printf("MOV    M,A");
-			break;
-		case 0x78:
-			printf("MOV    A,B");
-			break;
-		case 0x79:
-			printf("MOV    A,C");
-			break;
-		case 0x7A:
-			printf("MOV    A,D");
-			break;
-		case 0x7B:
-			printf("MOV    A,E");
-			break;
-		case 0x7C:
-			printf("MOV    A,H");
-			break;
-		case 0x7D:
-			printf("MOV    A,L");
-			break;
-		case 0x7E:
-			printf("MOV    A,M");
-			break;
-		case 0x7F:
-			printf("MOV    A,A");
-			break;
-		case 0x80:	
-			result = (uint16_t)state->a + (uint16_t)state->b;
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x81:
-			result = (uint16_t)state->a + (uint16_t)state->c;
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x82:
-			result = (uint16_t)state->a + (uint16_t)state->d;
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x83:
-			result = (uint16_t)state->a + (uint16_t)state->e;
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x84:
-			result = (uint16_t)state->a + (uint16_t)state->h;
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x85:
-			result = (uint16_t)state->a + (uint16_t)state->l;
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x86:
-			result = (uint16_t)state->a + (uint16_t)state->l + (state->h << 8);
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x87:
-			result = (uint16_t)state->a + (uint16_t)state->a;
-			State8080UpdateAdd(state, result);
-			/* Store the least significant 8 bits of result in a */
-			state->a = result & 0xFF;
-			break;
-		case 0x88:
-			result = (uint16_t)state->a + (uint16_t)state->b + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x89:
-			result = (uint16_t)state->a + (uint16_t)state->c + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x8A:
-			result = (uint16_t)state->a + (uint16_t)state->d + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x8B:
-			result = (uint16_t)state->a + (uint16_t)state->e + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x8C:
-			result = (uint16_t)state->a + (uint16_t)state->h + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x8D:
-			result = (uint16_t)state->a + (uint16_t)state->l + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x8E:
-			result = (uint16_t)state->a + (uint16_t)state->l + (state->h << 8) + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x8F:
-			result = (uint16_t)state->a + (uint16_t)state->a + state->flags->c;
-			State8080UpdateAdd(state, result);
-			state->a = result & 0xFF;
-			break;
-		case 0x90:
-			printf("SUB    B");
-			break;
-		case 0x91:
-			printf("SUB    C");
-			break;
-		case 0x92:
-			printf("SUB    D");
-			break;
-		case 0x93:
-			printf("SUB    E");
-			break;
-		case 0x94:
-			printf("SUB    H");
-			break;
-		case 0x95:
-			printf("SUB    L");
-			break;
-		case 0x96:
-			printf("SUB    M");
-			break;
-		case 0x97:
-			printf("SUB    A");
-			break;
-		case 0x98:
-			printf("SBB    B");
-			break;
-		case 0x99:
-			printf("SBB    C");
-			break;
-		case 0x9A:
-			printf("SBB    D");
-			break;
-		case 0x9B:
-			printf("SBB    E");
-			break;
-		case 0x9C:
-			printf("SBB    H");
-			break;
-		case 0x9D:
-			printf("SBB    L");
-			break;
-		case 0x9E:
-			printf("SBB    M");
-			break;
-		case 0x9F:
-			printf("SBB    A");
-			break;
-		case 0xA0:
-			printf("ANA    B");
-			break;
-		case 0xA1:
-			printf("ANA    C");
-			break;
-		case 0xA2:
-			printf("ANA    D");
-			break;
-		case 0xA3:
-			printf("ANA    E");
-			break;
-		case 0xA4:
-			printf("ANA    H");
-			break;
-		case 0xA5:
-			printf("ANA    L");
-			break;
-		case 0xA6:
-			printf("ANA    M");
-			break;
-		case 0xA7:
-			printf("ANA    A");
-			break;
-		case 0xA8:
-			printf("XRA    B");
-			break;
-		case 0xA9:
-			printf("XRA    C");
-			break;
-		case 0xAA:
-			printf("XRA    D");
-			break;
-		case 0xAB:
-			printf("XRA    E");
-			break;
-		case 0xAC:
-			printf("XRA    H");
-			break;
-		case 0xAD:
-			printf("XRA    L");
-			break;
-		case 0xAE:
-			printf("XRA    M");
-			break;
-		case 0xAF:
-			printf("XRA    A");
-			break;
-		case 0xB0:
-			printf("ORA    B");
-			break;
-		case 0xB1:
-			printf("ORA    C");
-			break;
-		case 0xB2:
-			printf("ORA    D");
-			break;
-		case 0xB3:
-			printf("ORA    E");
-			break;
-		case 0xB4:
-			printf("ORA    H");
-			break;
-		case 0xB5:
-			printf("ORA    L");
-			break;
-		case 0xB6:
-			printf("ORA    M");
-			break;
-		case 0xB7:
-			printf("ORA    A");
-			break;
-		case 0xB8:
-			printf("CMP    B");
-			break;
-		case 0xB9:
-			printf("CMP    C");
-			break;
-		case 0xBA:
-			printf("CMP    D");
-			break;
-		case 0xBB:
-			printf("CMP    E");
-			break;
-		case 0xBC:
-			printf("CMP    H");
-			break;
-		case 0xBD:
-			printf("CMP    L");
-			break;
-		case 0xBE:
-			printf("CMP    M");
-			break;
-		case 0xBF:
-			printf("CMP    A");
-			break;
-		case 0xC0:
-			printf("RNZ");
-			break;
-		case 0xC1:
-			printf("POP    B");
-			break;
-		case 0xC2:
-			printf("JNZ    $%02x%02x",next_instr[2],next_instr[1]);
-			break;
-		case 0xC3:
-			printf("JMP    $%02x%02x",next_instr[2],next_instr[1]);
-			break;
-		case 0xC4:
-			printf("CNZ    $%02x%02x",next_instr[2],next_instr[1]);
-			break;
-		case 0xC5:
-			printf("PUSH   B");
-			break;
-		case 0xC6:
-			printf("ADI    #$%02x", next_instr[1]);
-			break;
-		case 0xC7:
-			printf("RST    0");
-			break;
-		case 0xC8:
-			printf("RZ");
-			break;
-		case 0xC9:
-			printf("RET");
-			break;
-		case 0xCA:
-			printf("JZ    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xCB:
-			printf("NOP");
-			break;
-		case 0xCC:
-			printf("CZ    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xCD:
-			printf("CALL   $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xCE:
-			printf("ACI    #$%02x", next_instr[1]);
-			break;
-		case 0xCF:
-			printf("RST    1");
-			break;
-		case 0xD0:
-			printf("RNC");
-			break;
-		case 0xD1:
-			printf("POP    D");
-			break;
-		case 0xD2:
-			printf("JNC    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xD3:
-			printf("OUT    D8");
-			break;
-		case 0xD4:
-			printf("CNC    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xD5:
-			printf("PUSH   D");
-			break;
-		case 0xD6:
-			printf("SUI    #$%02x", next_instr[1]);
-			break;
-		case 0xD7:
-			printf("RST    2");
-			break;
-		case 0xD8:
-			printf("RC");
-			break;
-		case 0xD9:
-			printf("NOP");
-			break;
-		case 0xDA:
-			printf("JC     $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xDB:
-			printf("IN     D8");
-			break;
-		case 0xDC:
-			printf("CC     $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xDD:
-			printf("NOP");
-			break;
-		case 0xDE:
-			printf("SBI    #$%02x", next_instr[1]);
-			break;
-		case 0xDF:
-			printf("RST    3");
-			break;
-		case 0xE0:
-			printf("RPO");
-			break;
-		case 0xE1:
-			printf("POP    H");
-			break;
-		case 0xE2:
-			printf("JPO    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xE3:
-			printf("XTHL");
-			break;
-		case 0xE4:
-			printf("CPO    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xE5:
-			printf("PUSH   H");
-			break;
-		case 0xE6:
-			printf("ANI    #$%02x", next_instr[1]);
-			break;
-		case 0xE7:
-			printf("RST    4");
-			break;
-		case 0xE8:
-			printf("RPE");
-			break;
-		case 0xE9:
-			printf("PCHL");
-			break;
-		case 0xEA:
-			printf("JPE    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xEB:
-			printf("XCHG");
-			break;
-		case 0xEC:
-			printf("CPE    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xED:
-			printf("NOP");
-			break;
-		case 0xEE:
-			printf("XRI    $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xEF:
-			printf("RST    5");
-			break;
-		case 0xF0:
-			printf("RP");
-			break;
-		case 0xF1:
-			printf("POP    PSW");
-			break;
-		case 0xF2:
-			printf("JP     $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xF3:
-			printf("DI");
-			break;
-		case 0xF4:
-			printf("CP     $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xF5:
-			printf("PUSH   PSW");
-			break;
-		case 0xF6:
-			printf("ORI    #$%02x", next_instr[1]);
-			break;
-		case 0xF7:
-			printf("RST    6");
-			break;
-		case 0xF8:
-			printf("RM");
-			break;
-		case 0xF9:
-			printf("SPHL");
-			break;
-		case 0xFA:
-			printf("JM     $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xFB:
-			printf("EI");
-			break;
-		case 0xFC:
-			printf("CM     $%02x%02x", next_instr[2], next_instr[1]);
-			break;
-		case 0xFD:
-			printf("NOP");
-			break;
-		case 0xFE:
-			printf("CPI    #$%02x", next_instr[1]);
-			break;
-		case 0xFF:
-			printf("RST    7");
-			break;
-		default:
-			printf("INSTRUCTION: %x ", next_instr[0]);
-			break;
+	op = op_end;
+	instruction = MemoryFetch(memory, pc, fetched);
+	goto *labels[*instruction];
+	OPCODES(LABEL)
+	FUSED_OPS(FUSED_LABEL)
+
+done:
+	state->pc = pc;
+#undef FUSED_STOP
+#undef NEXT
+#undef EXIT_RUN
+#undef PC
+#define PC state->pc
+#else
+	while (executed < cycle_budget && !state->stop) {
+		if (blocks != NULL &&
+			(block = State8080Block(state, state->pc)) != NULL &&
+			executed + block->cycles <= cycle_budget) {
+			blocks->stale = 0;
+			op_end = block->ops + block->count;
+			for (op = block->ops; op != op_end && !blocks->stale;
+				op += op->span) {
+				executed += handlers[op->dispatch](state, op->bytes);
+			}
+			continue;
+		}
+
+		/* fetch the instruction from memory as pointed at by PC */
+		instruction = MemoryFetch(state->memory, state->pc, fetched);
+		executed += handlers[*instruction](state, instruction);
+	}
+	state->stop = 0;
+#endif
+
+#if EMULATOR_JIT
+finish:
+#endif
+	if (state->halted && executed < cycle_budget) {
+		executed = cycle_budget;
+	}
+	state->cycles += executed;
+	return executed;
+}
+
+/* Runs the 8080 CPU until its cycle counter reaches deadline and returns the
+ * cycles consumed; an instruction that runs past the deadline shortens the
+ * next run, so time never drifts from the cycle counter */
+int Run8080Until(struct State8080 *state, uint64_t deadline)
+{
+	if (state->cycles >= deadline) {
+		return 0;
+	}
+	return Run8080(state, (int)(deadline - state->cycles));
+}
+
+/* emulates one instruction of the 8080 given a pointer to the current state
+ * of the CPU and returns the cycles it took; follows a simple
+ * fetch-decode-execute model */
+int Emulate(struct State8080 *state)
+{
+	return Run8080(state, 1);
+}
+
+/* Takes the waiting interrupt if interrupts are enabled: pushes the program
+ * counter, jumps to the RST vector and disables further interrupts */
+static void State8080TakeInterrupt(struct State8080 *state)
+{
+	if (!state->int_pending || !state->int_enable) {
+		return;
+	}
+	state->int_pending = 0;
+	state->int_enable = 0;
+	state->halted = 0;
+	State8080Push(state, state->pc);
+	state->pc = state->int_vector * 8;
+	state->cycles += INTERRUPT_CYCLES;
+}
+
+/* Requests interrupt RST n; it is taken at once when interrupts are enabled
+ * and otherwise waits for EI, replacing any interrupt already waiting */
+void State8080Interrupt(struct State8080 *state, uint8_t n)
+{
+	state->int_pending = 1;
+	state->int_vector = n;
+	State8080TakeInterrupt(state);
+}
 
+/* Saves the CPU and I/O hardware of a Space Invaders machine into cpu */
+void State8080SaveCpu(struct State8080 *state, struct SavedCpu *cpu)
+{
+	cpu->cycles = state->cycles;
+	cpu->bc = state->bc;
+	cpu->de = state->de;
+	cpu->hl = state->hl;
+	cpu->sp = state->sp;
+	cpu->pc = state->pc;
+	cpu->a = state->a;
+	cpu->flags = *State8080Flags(state);
+	cpu->int_enable = state->int_enable;
+	cpu->int_pending = state->int_pending;
+	cpu->int_vector = state->int_vector;
+	cpu->halted = state->halted;
+	cpu->ports = state->ports;
 }
 
-/* start emulation of the space invaders machine given the space invaders
- * ROM file; return 0 on user-enabled exit and 1 otherwise */
-int startup(FILE *fp){
+/* Puts the CPU and I/O hardware back in the state saved in cpu */
+void State8080RestoreCpu(struct State8080 *state, const struct SavedCpu *cpu)
+{
+	state->cycles = cpu->cycles;
+	state->bc = cpu->bc;
+	state->de = cpu->de;
+	state->hl = cpu->hl;
+	state->sp = cpu->sp;
+	state->pc = cpu->pc;
+	state->a = cpu->a;
+	state->flags = cpu->flags;
+	state->lazy.op = ALU_NONE;
+	state->int_enable = cpu->int_enable;
+	state->int_pending = cpu->int_pending;
+	state->int_vector = cpu->int_vector;
+	state->halted = cpu->halted;
+	state->stop = 0;
+	state->ports = cpu->ports;
+}
+
+/* Saves the state of a Space Invaders machine into save; RAM and VRAM are
+ * copied in one go, as they are one block of host memory on either map */
+void State8080Save(struct State8080 *state, struct Savestate *save)
+{
+	State8080SaveCpu(state, &save->cpu);
+	memcpy(save->ram, state->memory->read[RAM_START >> 8],
+		SAVESTATE_RAM_SIZE);
+}
+
+/* Puts the machine back in the state saved in save. The blocks decoded
+ * from RAM are invalidated as a write to them would; the scheduler is left
+ * alone, see MachineResume(). */
+void State8080Restore(struct State8080 *state, const struct Savestate *save)
+{
+	struct Memory *memory = state->memory;
+	uint8_t *ram = memory->read[RAM_START >> 8];
+	int page;
+
+	State8080RestoreCpu(state, &save->cpu);
+	memcpy(ram, save->ram, SAVESTATE_RAM_SIZE);
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		if (memory->read[page] >= ram &&
+			memory->read[page] < ram + SAVESTATE_RAM_SIZE) {
+			MemoryRewritten(memory, page);
+		}
+	}
+}
+
+/* Screen interrupt events; each requests its RST and schedules itself again
+ * one frame later */
+static void MidScreen(struct Scheduler *scheduler, uint64_t deadline,
+	void *data)
+{
+	State8080Interrupt(data, MID_SCREEN_RST);
+	SchedulerAdd(scheduler, deadline + CYCLES_PER_FRAME, MidScreen, data);
+}
+
+static void EndScreen(struct Scheduler *scheduler, uint64_t deadline,
+	void *data)
+{
+	State8080Interrupt(data, END_SCREEN_RST);
+	SchedulerAdd(scheduler, deadline + CYCLES_PER_FRAME, EndScreen, data);
+}
+
+/* Schedules the screen interrupts of the Space Invaders hardware, starting
+ * with the frame that begins at the current cycle count */
+void MachineInit(struct State8080 *state, struct Scheduler *scheduler)
+{
+	SchedulerInit(scheduler);
+	SchedulerAdd(scheduler, state->cycles + CYCLES_PER_FRAME / 2, MidScreen,
+		state);
+	SchedulerAdd(scheduler, state->cycles + CYCLES_PER_FRAME, EndScreen,
+		state);
+}
+
+/* Schedules the screen interrupts of the Space Invaders hardware after a
+ * restore, due where they were when the state was saved in a machine that
+ * MachineInit() started at cycle 0; events of other kinds are dropped */
+void MachineResume(struct State8080 *state, struct Scheduler *scheduler)
+{
+	uint64_t frame = state->cycles / CYCLES_PER_FRAME * CYCLES_PER_FRAME;
+	uint64_t mid = frame + CYCLES_PER_FRAME / 2;
+
+	/* MachineRun() has already run the events due at the cycle count */
+	SchedulerInit(scheduler);
+	SchedulerAdd(scheduler, mid > state->cycles ? mid :
+		mid + CYCLES_PER_FRAME, MidScreen, state);
+	SchedulerAdd(scheduler, frame + CYCLES_PER_FRAME, EndScreen, state);
+}
+
+/* Runs the machine until the cycle counter reaches until; the CPU runs
+ * uninterrupted up to the next scheduled event, so checking for interrupts
+ * costs nothing per instruction */
+void MachineRun(struct State8080 *state, struct Scheduler *scheduler,
+	uint64_t until)
+{
+	while (state->cycles < until) {
+		uint64_t deadline = SchedulerNext(scheduler);
+		Run8080Until(state, deadline < until ? deadline : until);
+
+		/* EI ended the run with an interrupt waiting */
+		if (state->int_pending && state->int_enable) {
+			Emulate(state);
+			State8080TakeInterrupt(state);
+		}
+		SchedulerRunDue(scheduler, state->cycles);
+	}
+}
+
+/* Gives state a block cache if blocks is set and a JIT if jit is set */
+static void MachineBackend(struct State8080 *state, int blocks, int jit)
+{
+	if (blocks || jit) {
+		state->blocks = malloc(sizeof(struct BlockCache));
+		if (state->blocks == NULL) {
+			fprintf(stderr, "MachineBackend: malloc failed for block cache\n");
+			exit(1);
+		}
+		BlockCacheInit(state->blocks, state->memory);
+	}
+#if EMULATOR_JIT
+	if (jit) {
+		state->jit = malloc(sizeof(struct Jit));
+		if (state->jit == NULL || JitInit(state->jit) != 0) {
+			free(state->jit);
+			state->jit = NULL;
+		}
+	}
+#else
+	(void)jit;
+#endif
+}
+
+/* Allocates a Space Invaders machine running the ROM image, which must
+ * outlive it, with a block cache if blocks is set and translated by the JIT
+ * if jit is set. The cache shares the blocks on the ROM pages of rom_blocks
+ * if it is not NULL, so that only RAM and VRAM are the machine's own. */
+static struct State8080 *NewRomMachine(const uint8_t *image,
+	const struct BlockCache *rom_blocks, int blocks, int jit)
+{
 	/* allocate memory for state of the CPU */
-	struct State8080 *state = malloc(sizeof(struct State8080));
-	
+	struct State8080 *state = calloc(1, sizeof(struct State8080));
+	struct Memory *memory = malloc(sizeof(struct Memory));
+
 	/* exit on allocation error */
-	if (state == NULL) {
-		fprintf(stderr, "startup: malloc failed for state\n");
+	if (state == NULL || memory == NULL) {
+		fprintf(stderr, "NewRomMachine: malloc failed for state\n");
+		exit(1);
+	}
+
+	/* allocate memory for space invaders RAM and map the ROM */
+	if (MemoryInit(memory, MEMORY_MAP_INVADERS) != 0) {
+		free(memory);
+		free(state);
+		return NULL;
+	}
+	MemoryMapRom(memory, image);
+	state->memory = memory;
+	state->flags = FLAG_ALWAYS;
+	state->in = MachineIn;
+	state->out = MachineOut;
+	MachineBackend(state, blocks, jit);
+	if (state->blocks != NULL && rom_blocks != NULL) {
+		BlockCacheShare(state->blocks, rom_blocks);
+	}
+	return state;
+}
+
+/* Allocates a Space Invaders machine running the ROM at path, with a block
+ * cache if blocks is set and translated by the JIT if jit is set; returns
+ * NULL on failure */
+static struct State8080 *NewMachine(const char *path, int blocks, int jit)
+{
+	struct Rom *rom = malloc(sizeof(struct Rom));
+	struct State8080 *state;
+
+	if (rom == NULL) {
+		fprintf(stderr, "NewMachine: malloc failed for ROM\n");
 		exit(1);
 	}
-	
-	/* allocate memory for space invaders ROM and RAM */
-	state->memory;
+	if (RomOpen(rom, path) != 0) {
+		free(rom);
+		return NULL;
+	}
+	state = NewRomMachine(rom->image, NULL, blocks, jit);
+	if (state == NULL) {
+		RomClose(rom);
+		free(rom);
+		return NULL;
+	}
+	state->rom = rom;
+	return state;
+}
+
+/* Releases a machine made by NewMachine() or NewRomMachine(): its JIT, block
+ * cache, memory and the ROM it opened itself; does nothing if state is
+ * NULL */
+static void MachineFree(struct State8080 *state)
+{
+	if (state == NULL) {
+		return;
+	}
+#if EMULATOR_JIT
+	if (state->jit != NULL) {
+		JitFree(state->jit);
+	}
+#endif
+	free(state->jit);
+	if (state->blocks != NULL) {
+		BlockCacheFree(state->blocks);
+		free(state->blocks);
+	}
+	MemoryFree(state->memory);
+	free(state->memory);
+	if (state->rom != NULL) {
+		RomClose(state->rom);
+		free(state->rom);
+	}
+	free(state);
+}
+
+/* Opens the Space Invaders ROM at path, which is a single image or a folder
+ * of split files, and builds a machine for it; returns 0 on success and 1
+ * otherwise */
+int startup(const char *path){
+	struct State8080 *state = NewMachine(path, 1, EMULATOR_JIT);
+
+	if (state == NULL) {
+		return 1;
+	}
+	MachineFree(state);
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* Prints how often each superinstruction ran over frames frames and the
+ * dispatches it saved, most saved first, leaving out those never run */
+static void FusionReport(const struct BlockCache *blocks, int frames)
+{
+	uint64_t saved = 0;
+	int printed[FUSED_COUNT] = { 0 };
+	int n;
+
+	printf("%-28s %5s %12s %14s\n", "superinstruction", "ops", "runs",
+		"saved/frame");
+	for (n = 0; n < FUSED_COUNT; n++) {
+		uint64_t most = 0;
+		int best = -1;
+		int f;
+
+		for (f = 0; f < FUSED_COUNT; f++) {
+			uint64_t fused_saved = blocks->fused_hits[f] *
+				(fused_patterns[f].count - 1);
+
+			if (!printed[f] && fused_saved > most) {
+				most = fused_saved;
+				best = f;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		printed[best] = 1;
+		saved += most;
+		printf("%-28s %5d %12llu %14.1f\n", fused_patterns[best].name,
+			fused_patterns[best].count,
+			(unsigned long long)blocks->fused_hits[best],
+			(double)most / frames);
+	}
+	printf("%-28s %5s %12s %14.1f\n", "total", "", "",
+		(double)saved / frames);
+}
+
+/* Input port 1 of the Space Invaders hardware */
+#define INPUT_COIN 0x01
+#define INPUT_P1_START 0x04
+#define INPUT_P1_FIRE 0x10
+#define INPUT_P1_LEFT 0x20
+#define INPUT_P1_RIGHT 0x40
+
+/* The inputs of the benchmark: a coin, the one player start, then the
+ * player sweeps left and right and fires, so that the game itself runs and
+ * not only its attract mode */
+static uint8_t BenchmarkInput(int frame)
+{
+	uint8_t input = 0;
+
+	if (frame >= 30 && frame < 36) {
+		input |= INPUT_COIN;
+	}
+	if (frame >= 90 && frame < 96) {
+		input |= INPUT_P1_START;
+	}
+	if (frame >= 180) {
+		input |= (frame / 128) % 2 ? INPUT_P1_RIGHT : INPUT_P1_LEFT;
+		if (frame % 32 < 4) {
+			input |= INPUT_P1_FIRE;
+		}
+	}
+	return input;
+}
+
+/* Sets the inputs of each frame as it begins */
+static void BenchmarkFrame(struct Scheduler *scheduler, uint64_t deadline,
+	void *data)
+{
+	struct State8080 *state = data;
+
+	state->ports.in[1] = BenchmarkInput(deadline / CYCLES_PER_FRAME);
+	SchedulerAdd(scheduler, deadline + CYCLES_PER_FRAME, BenchmarkFrame,
+		data);
+}
+
+/* Counts the instructions run until the cycle counter reaches until by
+ * stepping through them one at a time, the way MachineRun() runs them */
+static uint64_t CountInstructions(struct State8080 *state,
+	struct Scheduler *scheduler, uint64_t until)
+{
+	uint64_t count = 0;
+
+	while (state->cycles < until) {
+		uint64_t deadline = SchedulerNext(scheduler);
+
+		if (deadline > until) {
+			deadline = until;
+		}
+		while (state->cycles < deadline &&
+			!(state->int_pending && state->int_enable)) {
+			count += !state->halted;
+			Emulate(state);
+		}
+		if (state->int_pending && state->int_enable) {
+			count++;
+			Emulate(state);
+			State8080TakeInterrupt(state);
+		}
+		SchedulerRunDue(scheduler, state->cycles);
+	}
+	return count;
+}
+
+/* The build options the benchmark was built with, for its results */
+static const char *BuildName(void)
+{
+	return EMULATOR_DISPATCH == DISPATCH_GOTO ?
+		(EMULATOR_LAZY_FLAGS ? "goto+lazy" : "goto") :
+		(EMULATOR_LAZY_FLAGS ? "table+lazy" : "table");
+}
+
+/* Runs frames frames of the ROM at path on each backend built in, with the
+ * scripted inputs of BenchmarkInput(), and prints the emulated clock rate,
+ * instructions, frames and nanoseconds per instruction of each. Every run
+ * starts from a fresh machine with the same inputs on the same cycles, so
+ * all backends must end in the same state. When results is given, a line of
+ * comma-separated values per backend is appended to that file, after a
+ * header if the file is new. */
+static int Benchmark(const char *path, int frames, const char *results)
+{
+	static const char *const names[] = {
+		"interpreter", "block cache", "jit"
+	};
+	double base = 0;
+	uint8_t first[MEMORY_SIZE];
+	uint64_t until = (uint64_t)frames * CYCLES_PER_FRAME;
+	uint64_t instructions;
+	int backends = EMULATOR_JIT ? 3 : 2;
+	FILE *out = NULL;
+	struct State8080 *state;
+	struct Scheduler scheduler;
+	int i;
+
+	/* every backend runs the same instructions; count them once */
+	state = NewMachine(path, 0, 0);
+	if (state == NULL) {
+		return 1;
+	}
+	MachineInit(state, &scheduler);
+	SchedulerAdd(&scheduler, 0, BenchmarkFrame, state);
+	instructions = CountInstructions(state, &scheduler, until);
+	MachineFree(state);
+
+	if (results != NULL) {
+		out = fopen(results, "a");
+		if (out == NULL) {
+			fprintf(stderr, "Benchmark: cannot open %s\n", results);
+			return 1;
+		}
+		if (ftell(out) == 0) {
+			fprintf(out, "time,build,fusion,backend,frames,cycles,"
+				"instructions,seconds,mhz,mips,fps,ns_per_instruction,"
+				"speedup\n");
+		}
+	}
+
+	printf("%-12s %9s %9s %9s %9s %7s\n", "backend", "MHz", "MIPS",
+		"fps", "ns/instr", "speedup");
+	for (i = 0; i < backends; i++) {
+		struct timespec start;
+		struct timespec end;
+		double seconds;
+		double mhz;
+		double mips;
+		double fps;
+		int page;
+
+		state = NewMachine(path, i >= 1, i == 2);
+		if (state == NULL) {
+			return 1;
+		}
+		if (i == 2 && state->jit == NULL) {
+			fprintf(stderr, "Benchmark: no executable memory for the JIT\n");
+			MachineFree(state);
+			return 1;
+		}
+		MachineInit(state, &scheduler);
+		SchedulerAdd(&scheduler, 0, BenchmarkFrame, state);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		MachineRun(state, &scheduler, until);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		seconds = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+		mhz = state->cycles / seconds / 1e6;
+		mips = instructions / seconds / 1e6;
+		fps = frames / seconds;
+		if (i == 0) {
+			base = mhz;
+		}
+		printf("%-12s %9.1f %9.1f %9.0f %9.2f %6.2fx\n", names[i], mhz,
+			mips, fps, 1e3 / mips, mhz / base);
+		if (out != NULL) {
+			fprintf(out, "%lld,%s,%d,%s,%d,%llu,%llu,%.6f,%.3f,%.3f,"
+				"%.1f,%.3f,%.3f\n", (long long)time(NULL),
+				BuildName(), EMULATOR_FUSION, names[i], frames,
+				(unsigned long long)state->cycles,
+				(unsigned long long)instructions, seconds, mhz, mips,
+				fps, 1e3 / mips, mhz / base);
+		}
+		if (i == 1 && EMULATOR_FUSION) {
+			FusionReport(state->blocks, frames);
+		}
+#if EMULATOR_JIT
+		if (state->jit != NULL) {
+			printf("%-12s %llu blocks, %llu native ops, %llu handler ops\n",
+				"", (unsigned long long)state->jit->blocks,
+				(unsigned long long)state->jit->native_ops,
+				(unsigned long long)state->jit->handler_ops);
+		}
+#endif
+
+		/* RAM and VRAM must match the interpreter's */
+		for (page = RAM_START / MEMORY_PAGE_SIZE;
+			page < MIRROR_START / MEMORY_PAGE_SIZE; page++) {
+			uint8_t *host = state->memory->read[page];
+			uint8_t *saved = first + page * MEMORY_PAGE_SIZE;
+
+			if (i == 0) {
+				memcpy(saved, host, MEMORY_PAGE_SIZE);
+			} else if (memcmp(saved, host, MEMORY_PAGE_SIZE) != 0) {
+				fprintf(stderr, "Benchmark: %s diverged from the "
+					"interpreter at 0x%04x\n", names[i],
+					page * MEMORY_PAGE_SIZE);
+				if (out != NULL) {
+					fclose(out);
+				}
+				MachineFree(state);
+				return 1;
+			}
+		}
+		MachineFree(state);
+	}
+	if (out != NULL) {
+		fclose(out);
+	}
+	return 0;
+}
+
+/* Gives a session of the batch the inputs of the benchmark, late by the
+ * number of frames in its data */
+static void BatchInput(struct Session *session, int frame)
+{
+	session->state->ports.in[1] = BenchmarkInput(frame -
+		(int)(intptr_t)session->data);
+}
+
+/* Runs count sessions of the ROM at path for frames frames each on threads
+ * threads, or one per core if threads is 0, and prints the frames run per
+ * second by all of them. The sessions get the same inputs, so they must all
+ * end in the same state. Only their RAM and VRAM are their own. */
+static int RunBatch(const char *path, int count, int frames, int threads)
+{
+	struct Session *sessions = calloc(count, sizeof(struct Session));
+	struct State8080 *decoder = NULL;
+	struct BatchStats stats;
+	struct Rom rom;
+	int result = 1;
+	int i;
+
+	if (sessions == NULL) {
+		fprintf(stderr, "RunBatch: malloc failed for sessions\n");
+		return 1;
+	}
+
+	/* the sessions share the ROM and the blocks decoded from it */
+	if (RomOpen(&rom, path) != 0 ||
+		(decoder = NewRomMachine(rom.image, NULL, 1, 0)) == NULL) {
+		goto cleanup;
+	}
+	State8080DecodeRom(decoder);
+	for (i = 0; i < count; i++) {
+		struct State8080 *state = NewRomMachine(rom.image, decoder->blocks,
+			1, 0);
+
+		if (state == NULL) {
+			goto cleanup;
+		}
+		SessionInit(&sessions[i], state, frames, BatchInput, NULL);
+	}
+	if (BatchRun(sessions, count, threads, &stats) != 0) {
+		goto cleanup;
+	}
+	printf("%d sessions of %d frames on %d threads: %.3f s, %.0f frames/s "
+		"(%.0fx real time), %llu steals\n", count, frames, stats.threads,
+		stats.seconds, stats.frames / stats.seconds,
+		stats.frames / stats.seconds / FRAMES_PER_SECOND,
+		(unsigned long long)stats.steals);
+
+	result = 0;
+	for (i = 1; i < count; i++) {
+		const struct Memory *memory = sessions[i].state->memory;
+		const struct Memory *first = sessions[0].state->memory;
+
+		if (memcmp(memory->arena, first->arena,
+			MIRROR_START - RAM_START) != 0) {
+			fprintf(stderr, "RunBatch: session %d diverged from session 0\n",
+				i);
+			result = 1;
+			break;
+		}
+	}
+
+cleanup:
+	/* the sessions go before the decoder whose blocks they share */
+	for (i = 0; i < count; i++) {
+		MachineFree(sessions[i].state);
+	}
+	MachineFree(decoder);
+	RomClose(&rom);
+	free(sessions);
+	return result;
+}
+
+/* Returns 1 if lane of lockstep ended in the same state as machine */
+static int LockstepSame(const struct Lockstep *lockstep, int lane,
+	struct State8080 *state, struct State8080 *machine)
+{
+	LockstepStore(lockstep, lane, state);
+	State8080SyncFlags(machine);
+	return state->a == machine->a && state->flags == machine->flags &&
+		state->bc == machine->bc && state->de == machine->de &&
+		state->hl == machine->hl && state->sp == machine->sp &&
+		state->pc == machine->pc && state->cycles == machine->cycles &&
+		memcmp(state->memory->arena, machine->memory->arena,
+		MIRROR_START - RAM_START) == 0;
+}
+
+/* Runs count machines of the ROM at path for frames frames each, first one
+ * after the other on the block cache and then in lockstep, and prints the
+ * frames run per second by each. Machine i gets the inputs of the benchmark
+ * i % (spread + 1) frames late, so that the machines drift apart the more
+ * the larger spread is. Both runs must end every machine in the same state. */
+static int RunLockstep(const char *path, int count, int frames, int spread)
+{
+	struct Session *sessions = calloc(count, sizeof(struct Session));
+	struct State8080 **lanes = calloc(count, sizeof(struct State8080 *));
+	struct State8080 *decoder = NULL;
+	struct Lockstep lockstep = { 0 };
+	struct BatchStats stats;
+	struct timespec start;
+	struct timespec end;
+	struct Rom rom;
+	double seconds;
+	uint64_t ops;
+	int result = 1;
+	int frame;
+	int i;
+
+	if (sessions == NULL || lanes == NULL) {
+		fprintf(stderr, "RunLockstep: malloc failed for machines\n");
+		free(sessions);
+		free(lanes);
+		return 1;
+	}
+	if (RomOpen(&rom, path) != 0 ||
+		(decoder = NewRomMachine(rom.image, NULL, 1, 0)) == NULL) {
+		goto cleanup;
+	}
+	State8080DecodeRom(decoder);
+	for (i = 0; i < count; i++) {
+		struct State8080 *state = NewRomMachine(rom.image, decoder->blocks,
+			1, 0);
+
+		if (state == NULL) {
+			goto cleanup;
+		}
+		SessionInit(&sessions[i], state, frames, BatchInput,
+			(void *)(intptr_t)(i % (spread + 1)));
+		if ((lanes[i] = NewRomMachine(rom.image, NULL, 0, 0)) == NULL) {
+			goto cleanup;
+		}
+	}
+
+	if (BatchRun(sessions, count, 1, &stats) != 0 ||
+		LockstepInit(&lockstep, lanes, count) != 0) {
+		goto cleanup;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (frame = 0; frame < frames; frame++) {
+		for (i = 0; i < count; i++) {
+			lockstep.ports[i].in[1] = BenchmarkInput(frame -
+				i % (spread + 1));
+		}
+		LockstepRunFrame(&lockstep, frame);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+
+	ops = lockstep.vector_ops + lockstep.memory_ops +
+		lockstep.interpreted_ops;
+	printf("%d machines of %d frames, inputs up to %d frames apart\n",
+		count, frames, spread);
+	printf("  block cache: %.3f s, %.0f frames/s\n", stats.seconds,
+		stats.frames / stats.seconds);
+	printf("  lockstep (%s): %.3f s, %.0f frames/s, %.2fx\n",
+		lockstep.vector ? "avx2" : "scalar", seconds,
+		(double)count * frames / seconds,
+		stats.seconds / seconds);
+	printf("  %.1f lanes per step; %.1f%% in vector lanes, %.1f%% lane by "
+		"lane, %.1f%% interpreted\n", (double)ops / lockstep.steps,
+		100.0 * lockstep.vector_ops / ops, 100.0 * lockstep.memory_ops / ops,
+		100.0 * lockstep.interpreted_ops / ops);
+
+	result = 0;
+	for (i = 0; i < count; i++) {
+		if (!LockstepSame(&lockstep, i, lanes[i], sessions[i].state)) {
+			fprintf(stderr, "RunLockstep: lane %d diverged from its "
+				"machine\n", i);
+			result = 1;
+			break;
+		}
+	}
+
+cleanup:
+	LockstepFree(&lockstep);
+	for (i = 0; i < count; i++) {
+		MachineFree(sessions[i].state);
+		MachineFree(lanes[i]);
+	}
+	MachineFree(decoder);
+	RomClose(&rom);
+	free(sessions);
+	free(lanes);
+	return result;
+}
+
+/* Runs the machine from frame first up to frame last with the inputs of
+ * the benchmark */
+static void RunFrames(struct State8080 *state, struct Scheduler *scheduler,
+	int first, int last)
+{
+	int frame;
+
+	for (frame = first; frame < last; frame++) {
+		state->ports.in[1] = BenchmarkInput(frame);
+		MachineRun(state, scheduler, (uint64_t)(frame + 1) * CYCLES_PER_FRAME);
+	}
+}
+
+#define SAVESTATE_RING 64	// savestates the timing loops cycle through
+#define SAVESTATE_ROUNDS 100000
+
+/* Runs the ROM at path for frames frames on the block cache, saving its
+ * state halfway, and checks that restoring that state and running the
+ * second half again ends in the same state. Then times saving and
+ * restoring, and prints the size of a savestate and the microseconds each
+ * takes. */
+static int SavestateBenchmark(const char *path, int frames)
+{
+	struct State8080 *state = NewMachine(path, 1, 0);
+	struct Savestate *ring;
+	struct Savestate *expected;
+	struct Savestate *again;
+	struct Scheduler scheduler;
+	struct timespec start;
+	struct timespec end;
+	double save_us;
+	double restore_us;
+	int result = 1;
+	int i;
+
+	if (state == NULL) {
+		return 1;
+	}
+	ring = calloc(SAVESTATE_RING, sizeof(struct Savestate));
+	expected = calloc(1, sizeof(struct Savestate));
+	again = calloc(1, sizeof(struct Savestate));
+	if (ring == NULL || expected == NULL || again == NULL) {
+		fprintf(stderr, "SavestateBenchmark: malloc failed\n");
+		goto cleanup;
+	}
+
+	/* the second half must run the same after a restore */
+	MachineInit(state, &scheduler);
+	RunFrames(state, &scheduler, 0, frames / 2);
+	State8080Save(state, &ring[0]);
+	RunFrames(state, &scheduler, frames / 2, frames);
+	State8080Save(state, expected);
+	State8080Restore(state, &ring[0]);
+	MachineResume(state, &scheduler);
+	RunFrames(state, &scheduler, frames / 2, frames);
+	State8080Save(state, again);
+	if (memcmp(expected, again, sizeof(struct Savestate)) != 0) {
+		fprintf(stderr, "SavestateBenchmark: the machine ran differently "
+			"after a restore\n");
+		goto cleanup;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < SAVESTATE_ROUNDS; i++) {
+		State8080Save(state, &ring[i % SAVESTATE_RING]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	save_us = ((end.tv_sec - start.tv_sec) * 1e6 +
+		(end.tv_nsec - start.tv_nsec) / 1e3) / SAVESTATE_ROUNDS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < SAVESTATE_ROUNDS; i++) {
+		State8080Restore(state, &ring[i % SAVESTATE_RING]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	restore_us = ((end.tv_sec - start.tv_sec) * 1e6 +
+		(end.tv_nsec - start.tv_nsec) / 1e3) / SAVESTATE_ROUNDS;
+
+	printf("savestate: %zu bytes, save %.3f us (%.0f/s), restore %.3f us "
+		"(%.0f/s)\n", sizeof(struct Savestate), save_us, 1e6 / save_us,
+		restore_us, 1e6 / restore_us);
+	result = 0;
+
+cleanup:
+	free(ring);
+	free(expected);
+	free(again);
+	MachineFree(state);
+	return result;
+}
+
+#define SNAPSHOT_BRANCH_FRAMES 10	// frames each branch of the tree runs
+
+/* Elapsed microseconds from start to end */
+static double Microseconds(const struct timespec *start,
+	const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+		(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/* Grows a tree of incremental snapshots of the ROM at path: a trunk of one
+ * snapshot per frame for frames frames, then branches times a branch of
+ * SNAPSHOT_BRANCH_FRAMES frames from a trunk snapshot picked at random, run
+ * on inputs of its own. A savestate of every snapshot is kept alongside,
+ * and restoring any snapshot must give back its savestate. Prints the memory
+ * the tree takes against as many savestates, and the microseconds taking
+ * and restoring a snapshot take. */
+static int SnapshotBenchmark(const char *path, int frames, int branches)
 {
+	int nodes = frames + branches * SNAPSHOT_BRANCH_FRAMES;
+	struct State8080 *state = NewMachine(path, 1, 0);
+	struct Snapshot *tree;
+	struct Savestate *expected;
+	struct Savestate *again;
+	struct SnapshotStore store;
+	struct Scheduler scheduler;
+	struct timespec start;
+	struct timespec end;
+	double take_us = 0;
+	double restore_us = 0;
+	size_t tree_bytes;
+	size_t full_bytes;
+	uint32_t seed = 1;
+	int result = 1;
+	int node = 0;
+	int i;
+
+	if (state == NULL || SnapshotStoreInit(&store, state,
+		(nodes + 1) * SNAPSHOT_PAGES) != 0) {
+		MachineFree(state);
+		return 1;
+	}
+	tree = calloc(nodes, sizeof(struct Snapshot));
+	expected = calloc(nodes, sizeof(struct Savestate));
+	again = calloc(1, sizeof(struct Savestate));
+	if (tree == NULL || expected == NULL || again == NULL) {
+		fprintf(stderr, "SnapshotBenchmark: malloc failed\n");
+		goto cleanup;
+	}
+
+	MachineInit(state, &scheduler);
+	for (i = 0; i < frames; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		SnapshotTake(&store, &tree[node]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		take_us += Microseconds(&start, &end);
+		State8080Save(state, &expected[node++]);
+		RunFrames(state, &scheduler, i, i + 1);
+	}
+	for (i = 0; i < branches; i++) {
+		int from;
+		int frame;
+
+		seed = seed * 1103515245 + 12345;
+		from = (seed >> 16) % frames;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		SnapshotRestore(&store, &tree[from]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		restore_us += Microseconds(&start, &end);
+		MachineResume(state, &scheduler);
+		for (frame = from; frame < from + SNAPSHOT_BRANCH_FRAMES; frame++) {
+			state->ports.in[1] = BenchmarkInput(frame + i + 1);
+			MachineRun(state, &scheduler,
+				(uint64_t)(frame + 1) * CYCLES_PER_FRAME);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			SnapshotTake(&store, &tree[node]);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			take_us += Microseconds(&start, &end);
+			State8080Save(state, &expected[node++]);
+		}
+	}
+
+	/* every snapshot, trunk and branches alike, in an order of its own */
+	for (i = 0; i < nodes; i++) {
+		int at = (int)(((uint64_t)i * 7919) % nodes);
+
+		SnapshotRestore(&store, &tree[at]);
+		State8080Save(state, again);
+		if (memcmp(&expected[at], again, sizeof(struct Savestate)) != 0) {
+			fprintf(stderr, "SnapshotBenchmark: snapshot %d restored "
+				"wrong\n", at);
+			goto cleanup;
+		}
+	}
+
+	tree_bytes = (size_t)store.used * sizeof(struct SnapshotPage) +
+		(size_t)nodes * sizeof(struct Snapshot);
+	full_bytes = (size_t)nodes * sizeof(struct Savestate);
+	printf("snapshots: %d in a tree, %d pages (%.1f per snapshot), %zu KiB "
+		"against %zu KiB of savestates (%.1f%%)\n", nodes, store.used,
+		(double)store.used / nodes, tree_bytes / 1024, full_bytes / 1024,
+		100.0 * tree_bytes / full_bytes);
+	printf("snapshots: take %.3f us, restore %.3f us\n", take_us / nodes,
+		branches ? restore_us / branches : 0);
+	result = 0;
+
+cleanup:
+	for (i = 0; tree != NULL && i < nodes; i++) {
+		SnapshotRelease(&store, &tree[i]);
+	}
+	SnapshotStoreFree(&store);
+	free(tree);
+	free(expected);
+	free(again);
+	MachineFree(state);
+	return result;
+}
+
+/* Records seconds seconds of frames of the ROM at path into a rewind ring
+ * and pool taking kib KiB in all, running twice as long so that the ring
+ * wraps, then steps back through every frame it holds, each of which must
+ * give back the savestate taken when it was recorded. Prints the history
+ * held, the memory it takes per second, and the microseconds recording and
+ * stepping back a frame take on average and at worst. */
+static int RewindBenchmark(const char *path, int seconds, int kib)
+{
+	int frames = seconds * FRAMES_PER_SECOND;
+	long pages = ((long)kib * 1024 -
+		(long)frames * (long)sizeof(struct Snapshot)) /
+		(long)sizeof(struct SnapshotPage);
+	struct State8080 *state;
+	struct Savestate *expected;
+	struct Savestate *again;
+	struct Scheduler scheduler;
+	struct Rewind rewind;
+	struct timespec start;
+	struct timespec end;
+	double record_us = 0;
+	double record_max = 0;
+	double back_us = 0;
+	double back_max = 0;
+	size_t bytes;
+	int result = 1;
+	int held;
+	int frame;
+
+	if (frames <= 0 || pages < 2 * SNAPSHOT_PAGES) {
+		fprintf(stderr, "RewindBenchmark: %d KiB cannot hold %d seconds\n",
+			kib, seconds);
+		return 1;
+	}
+	state = NewMachine(path, 1, 0);
+	if (state == NULL || RewindInit(&rewind, state, frames, pages) != 0) {
+		MachineFree(state);
+		return 1;
+	}
+	expected = calloc(frames, sizeof(struct Savestate));
+	again = calloc(1, sizeof(struct Savestate));
+	if (expected == NULL || again == NULL) {
+		fprintf(stderr, "RewindBenchmark: malloc failed\n");
+		goto cleanup;
+	}
+
+	MachineInit(state, &scheduler);
+	for (frame = 0; frame < 2 * frames; frame++) {
+		double us;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		RewindRecord(&rewind);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		us = Microseconds(&start, &end);
+		record_us += us;
+		record_max = us > record_max ? us : record_max;
+		State8080Save(state, &expected[frame % frames]);
+		RunFrames(state, &scheduler, frame, frame + 1);
+	}
+	held = rewind.count;
+	bytes = RewindBytes(&rewind);
+
+	while (rewind.count > 0) {
+		double us;
+
+		frame--;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		RewindStepBack(&rewind);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		us = Microseconds(&start, &end);
+		back_us += us;
+		back_max = us > back_max ? us : back_max;
+		State8080Save(state, again);
+		if (memcmp(&expected[frame % frames], again,
+			sizeof(struct Savestate)) != 0) {
+			fprintf(stderr, "RewindBenchmark: frame %d stepped back "
+				"wrong\n", frame);
+			goto cleanup;
+		}
+	}
+
+	printf("rewind: %.1f s of %d held in %zu KiB of %d, %.1f KiB per "
+		"second\n", (double)held / FRAMES_PER_SECOND, seconds,
+		bytes / 1024, kib, (double)bytes / 1024 * FRAMES_PER_SECOND / held);
+	printf("rewind: record %.3f us (worst %.3f), step back %.3f us (worst "
+		"%.3f)\n", record_us / (2 * frames), record_max, back_us / held,
+		back_max);
+	result = 0;
+
+cleanup:
+	RewindFree(&rewind);
+	free(expected);
+	free(again);
+	MachineFree(state);
+	return result;
+}
+
+/* Runs the ROM at path for frames frames with the benchmark's inputs, once
+ * plainly and once running ahead frames ahead, and checks that run-ahead
+ * leaves the real run alone and shows the screen the plain run drew ahead
+ * frames later, wherever the inputs stay the same over those frames. Prints
+ * the microseconds a frame takes either way and what each frame run ahead
+ * adds, its share of the snapshot and restore included. */
+static int RunAheadBenchmark(const char *path, int frames, int ahead)
+{
+	struct State8080 *state = NewMachine(path, 1, EMULATOR_JIT);
+	struct State8080 *runner = NewMachine(path, 1, EMULATOR_JIT);
+	uint8_t *plain;
+	uint8_t *shown;
+	struct Savestate *expected;
+	struct Savestate *again;
+	struct Scheduler scheduler;
+	struct RunAhead run;
+	struct timespec start;
+	struct timespec end;
+	double plain_us;
+	double ahead_us;
+	int result = 1;
+	int checked = 0;
+	int frame;
+
+	if (state == NULL || runner == NULL ||
+		RunAheadInit(&run, runner, ahead) != 0) {
+		MachineFree(runner);
+		MachineFree(state);
+		return 1;
+	}
+	plain = malloc((size_t)frames * VRAM_SIZE);
+	shown = malloc((size_t)frames * VRAM_SIZE);
+	expected = calloc(1, sizeof(struct Savestate));
+	again = calloc(1, sizeof(struct Savestate));
+	if (plain == NULL || shown == NULL || expected == NULL ||
+		again == NULL) {
+		fprintf(stderr, "RunAheadBenchmark: malloc failed\n");
+		goto cleanup;
+	}
+
+	MachineInit(state, &scheduler);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (frame = 0; frame < frames; frame++) {
+		state->ports.in[1] = BenchmarkInput(frame);
+		MachineRun(state, &scheduler,
+			(uint64_t)(frame + 1) * CYCLES_PER_FRAME);
+		memcpy(plain + (size_t)frame * VRAM_SIZE,
+			state->memory->read[VRAM_START >> 8], VRAM_SIZE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	plain_us = Microseconds(&start, &end) / frames;
+	State8080Save(state, expected);
+
+	MachineInit(runner, &scheduler);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (frame = 0; frame < frames; frame++) {
+		runner->ports.in[1] = BenchmarkInput(frame);
+		RunAheadFrame(&run, &scheduler, frame);
+		memcpy(shown + (size_t)frame * VRAM_SIZE, run.screen, VRAM_SIZE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ahead_us = Microseconds(&start, &end) / frames;
+	State8080Save(runner, again);
+
+	if (memcmp(expected, again, sizeof(struct Savestate)) != 0) {
+		fprintf(stderr, "RunAheadBenchmark: running ahead changed the "
+			"real run\n");
+		goto cleanup;
+	}
+	for (frame = 0; frame + ahead < frames; frame++) {
+		int same = 1;
+		int i;
+
+		for (i = 1; i <= ahead; i++) {
+			same &= BenchmarkInput(frame + i) == BenchmarkInput(frame);
+		}
+		if (!same) {
+			continue;
+		}
+		if (memcmp(shown + (size_t)frame * VRAM_SIZE,
+			plain + (size_t)(frame + ahead) * VRAM_SIZE, VRAM_SIZE) != 0) {
+			fprintf(stderr, "RunAheadBenchmark: frame %d showed the "
+				"wrong screen\n", frame);
+			goto cleanup;
+		}
+		checked++;
+	}
+
+	printf("run-ahead %d: %.1f us per frame against %.1f us plain, %.1f us "
+		"added per frame run ahead; %d screens checked\n", ahead,
+		ahead_us, plain_us, ahead ? (ahead_us - plain_us) / ahead : 0,
+		checked);
+	result = 0;
+
+cleanup:
+	RunAheadFree(&run);
+	free(plain);
+	free(shown);
+	free(expected);
+	free(again);
+	MachineFree(runner);
+	MachineFree(state);
+	return result;
+}
+
+/* Records frames frames of the ROM at path, on the benchmark's inputs, into
+ * a movie at movie_path, and prints its size */
+static int RecordMovie(const char *path, const char *movie_path, int frames)
+{
+	struct State8080 *state = NewMachine(path, 1, EMULATOR_JIT);
+	struct Scheduler scheduler;
+	struct Movie movie;
+	long bytes;
+	int frame;
+
+	if (state == NULL) {
+		return 1;
+	}
+	MachineInit(state, &scheduler);
+	if (MovieRecord(&movie, movie_path, state) != 0) {
+		MachineFree(state);
+		return 1;
+	}
+	for (frame = 0; frame < frames; frame++) {
+		state->ports.in[1] = BenchmarkInput(frame);
+		MachineRun(state, &scheduler,
+			(uint64_t)(frame + 1) * CYCLES_PER_FRAME);
+		if (MovieRecordFrame(&movie) != 0) {
+			MovieClose(&movie);
+			MachineFree(state);
+			return 1;
+		}
+	}
+	bytes = ftell(movie.file) + (long)movie.at;
+	MachineFree(state);
+	if (MovieClose(&movie) != 0) {
+		return 1;
+	}
+	printf("movie: %d frames in %ld bytes, %ld of them header\n", frames,
+		bytes, (long)MOVIE_HEADER_SIZE);
+	return 0;
+}
+
+/* Replays the movie at movie_path on the ROM at path as fast as the host
+ * runs it, checking the state hash of every frame, and prints how much
+ * faster than real time it ran */
+static int PlayMovie(const char *path, const char *movie_path)
+{
+	struct State8080 *state = NewMachine(path, 1, EMULATOR_JIT);
+	struct Scheduler scheduler;
+	struct Movie movie;
+	struct timespec start;
+	struct timespec end;
+	double seconds;
+	uint32_t hash;
+	int frame;
+	int got;
+
+	if (state == NULL) {
+		return 1;
+	}
+	if (MoviePlay(&movie, movie_path, state) != 0) {
+		MachineFree(state);
+		return 1;
+	}
+	MachineResume(state, &scheduler);
+	frame = state->cycles / CYCLES_PER_FRAME;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((got = MoviePlayFrame(&movie, &hash)) == 1) {
+		MachineRun(state, &scheduler,
+			(uint64_t)(++frame) * CYCLES_PER_FRAME);
+		if (MovieStateHash(state) != hash) {
+			fprintf(stderr, "PlayMovie: frame %u ran differently\n",
+				movie.frames - 1);
+			MovieClose(&movie);
+			MachineFree(state);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	MovieClose(&movie);
+	MachineFree(state);
+	if (got < 0) {
+		return 1;
+	}
+	seconds = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("movie: %u frames replayed and checked in %.3f s, %.0fx real "
+		"time\n", movie.frames, seconds,
+		movie.frames / (seconds * FRAMES_PER_SECOND));
+	return 0;
+}
+
+#define VIDEO_SCREENS 16		// screens the conversions are checked and timed on
+#define VIDEO_ROUNDS 2000
+
+/* Runs the ROM at path for frames frames with the benchmark's inputs,
+ * keeping VIDEO_SCREENS screens along the way, one of them random bytes,
+ * then checks every path of every framebuffer format against the scalar
+ * reference on them and times it. Prints the microseconds a conversion takes
+ * and its share of a frame at 60 Hz and of the time emulating one took. */
+static int VideoBenchmark(const char *path, int frames)
+{
+	static const char *const format_names[] = { "rgba", "indexed" };
+	static const char *const path_names[] = { "scalar", "sse2", "avx2" };
+	struct State8080 *state = NewMachine(path, 1, EMULATOR_JIT);
+	uint8_t *screens;
+	uint32_t *expected;
+	uint32_t *frame_buffer;
+	struct Scheduler scheduler;
+	struct timespec start;
+	struct timespec end;
+	double frame_us;
+	uint32_t seed = 1;
+	int result = 1;
+	int format;
+	int frame;
+	int i;
+
+	if (state == NULL) {
+		return 1;
+	}
+	screens = malloc((size_t)VIDEO_SCREENS * VRAM_SIZE);
+	expected = malloc(VIDEO_WIDTH * VIDEO_HEIGHT * sizeof(uint32_t));
+	frame_buffer = malloc(VIDEO_WIDTH * VIDEO_HEIGHT * sizeof(uint32_t));
+	if (screens == NULL || expected == NULL || frame_buffer == NULL) {
+		fprintf(stderr, "VideoBenchmark: malloc failed\n");
+		goto cleanup;
+	}
+	if (frames < VIDEO_SCREENS) {
+		frames = VIDEO_SCREENS;
+	}
+
+	MachineInit(state, &scheduler);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (frame = 0; frame < frames; frame++) {
+		state->ports.in[1] = BenchmarkInput(frame);
+		MachineRun(state, &scheduler,
+			(uint64_t)(frame + 1) * CYCLES_PER_FRAME);
+		if ((frame + 1) % (frames / VIDEO_SCREENS) == 0 &&
+			(frame + 1) / (frames / VIDEO_SCREENS) < VIDEO_SCREENS) {
+			memcpy(screens + (size_t)(frame + 1) /
+				(frames / VIDEO_SCREENS) * VRAM_SIZE,
+				state->memory->read[VRAM_START >> 8], VRAM_SIZE);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	frame_us = Microseconds(&start, &end) / frames;
+	for (i = 0; i < VRAM_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		screens[i] = seed >> 16;
+	}
+
+	for (format = VIDEO_RGBA; format <= VIDEO_INDEXED; format++) {
+		int way;
+
+		for (way = VIDEO_SCALAR; way <= VideoBestPath(); way++) {
+			double us;
+
+			for (i = 0; i < VIDEO_SCREENS; i++) {
+				const uint8_t *vram = screens + (size_t)i * VRAM_SIZE;
+
+				VideoConvert(vram, expected, format, VIDEO_SCALAR);
+				VideoConvert(vram, frame_buffer, format, way);
+				if (memcmp(expected, frame_buffer, VIDEO_WIDTH *
+					VIDEO_HEIGHT * (format == VIDEO_RGBA ? 4 : 1)) != 0) {
+					fprintf(stderr, "VideoBenchmark: %s %s differs from "
+						"the reference on screen %d\n",
+						format_names[format], path_names[way], i);
+					goto cleanup;
+				}
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (i = 0; i < VIDEO_ROUNDS; i++) {
+				VideoConvert(screens + (size_t)(i % VIDEO_SCREENS) *
+					VRAM_SIZE, frame_buffer, format, way);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			us = Microseconds(&start, &end) / VIDEO_ROUNDS;
+			printf("video %-7s %-6s: %7.2f us, %5.2f%% of a frame at 60 Hz, "
+				"%6.1f%% of emulating one\n", format_names[format],
+				path_names[way], us, us * FRAMES_PER_SECOND / 1e4,
+				100 * us / frame_us);
+		}
+	}
+	result = 0;
+
+cleanup:
+	free(screens);
+	free(expected);
+	free(frame_buffer);
+	MachineFree(state);
+	return result;
+}
+
+/* The CP/M machine the 8080 test programs run on: 64 KiB of RAM holding
+ * the program at 0x0100, a warm boot at 0x0000 that halts, and a BDOS entry
+ * at 0x0005 that jumps to an OUT to CPM_BDOS_PORT and a RET at the top of
+ * memory; the address of the jump also tells a program where its memory
+ * ends. Only the console output calls of the BDOS are provided. */
+#define CPM_TPA 0x0100
+#define CPM_BDOS 0x0005
+#define CPM_STUB 0xFF00
+#define CPM_BDOS_PORT 0
+#define BDOS_WRITE 2		// print the character in E
+#define BDOS_WRITE_STRING 9	// print the string at DE, ended by '$'
+
+#define CPM_OUTPUT_SIZE 0x10000
+#define CPM_RUN_CYCLES 1000000	// cycles per run between checks for the end
+#define CPM_CYCLE_LIMIT 50000000000ULL	// 8080EXM takes about 24 billion
+
+/* Console output of the program under test */
+static struct Console {
+	char text[CPM_OUTPUT_SIZE];
+	size_t length;
+	int echo;		// also print it as it is written
+} console;
+
+/* Writes ch to the console; a NUL prints nothing and is not kept, so that
+ * the output stays one string */
+static void CpmPutChar(char ch)
+{
+	if (ch != '\0' && console.length < CPM_OUTPUT_SIZE - 1) {
+		console.text[console.length++] = ch;
+		console.text[console.length] = '\0';
+	}
+	if (console.echo) {
+		putchar(ch);
+		fflush(stdout);
+	}
+}
+
+/* Handles the BDOS call made through the OUT of the stub; a string with no
+ * '$' stops after once around memory */
+static void CpmOut(struct State8080 *state, uint8_t port, uint8_t value)
+{
+	uint16_t address;
+	long count;
+
+	(void)value;
+	if (port != CPM_BDOS_PORT) {
+		return;
+	}
+	switch (state->c) {
+		case BDOS_WRITE:
+			CpmPutChar(state->e);
+			break;
+		case BDOS_WRITE_STRING:
+			address = state->de;
+			for (count = 0; count < MEMORY_SIZE &&
+				MemoryRead(state->memory, address) != '$'; count++) {
+				CpmPutChar(MemoryRead(state->memory, address++));
+			}
+			break;
+	}
+}
+
+static uint8_t CpmIn(struct State8080 *state, uint8_t port)
+{
+	(void)state;
+	(void)port;
+	return 0;
+}
+
+/* Allocates a CP/M machine running the program at path, with a block cache
+ * if blocks is set and translated by the JIT if jit is set; returns NULL on
+ * failure */
+static struct State8080 *NewCpmMachine(const char *path, int blocks, int jit)
+{
+	static const uint8_t boot[] = { 0x76 };	// HLT
+	static const uint8_t bdos[] = { 0xC3, CPM_STUB & 0xFF, CPM_STUB >> 8 };
+	static const uint8_t stub[] = { 0xD3, CPM_BDOS_PORT, 0xC9 };
+	struct State8080 *state = calloc(1, sizeof(struct State8080));
+	struct Memory *memory = malloc(sizeof(struct Memory));
+	uint8_t *program = malloc(CPM_STUB - CPM_TPA);
 	FILE *fp;
-	
-	// open the file provided in the current folder
-	if ((fp = fopen(argv[1], "r")) != NULL) 
-	{
-		print_instructions(fp);
-		fclose(fp);
-		return 0;
+	size_t size;
+
+	if (state == NULL || memory == NULL || program == NULL) {
+		fprintf(stderr, "NewCpmMachine: malloc failed for state\n");
+		exit(1);
+	}
+	if ((fp = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "NewCpmMachine: cannot open %s\n", path);
+		free(program);
+		free(memory);
+		free(state);
+		return NULL;
+	}
+	size = fread(program, 1, CPM_STUB - CPM_TPA, fp);
+	fclose(fp);
+
+	if (MemoryInit(memory, MEMORY_MAP_FLAT) != 0) {
+		free(program);
+		free(memory);
+		free(state);
+		return NULL;
+	}
+	MemoryLoad(memory, 0x0000, boot, sizeof(boot));
+	MemoryLoad(memory, CPM_BDOS, bdos, sizeof(bdos));
+	MemoryLoad(memory, CPM_STUB, stub, sizeof(stub));
+	MemoryLoad(memory, CPM_TPA, program, size);
+	free(program);
+
+	/* a program may also end by returning to the warm boot address that
+	 * CP/M leaves on its stack */
+	state->memory = memory;
+	state->flags = FLAG_ALWAYS;
+	state->sp = CPM_STUB - 2;
+	state->pc = CPM_TPA;
+	state->in = CpmIn;
+	state->out = CpmOut;
+	MachineBackend(state, blocks, jit);
+	return state;
+}
+
+/* Runs the CP/M test program at path on each backend built in and reports
+ * whether it passed and how long it took. The program passes when it ends
+ * within CPM_CYCLE_LIMIT cycles without printing ERROR or FAIL, and every
+ * backend must print the same. The instructions are counted once, in a run
+ * stepped one instruction at a time, which also prints the output. Returns
+ * 0 if the program passed on every backend and 1 otherwise. */
+static int TestProgram(const char *path)
+{
+	static const char *const names[] = {
+		"interpreter", "block cache", "jit"
+	};
+	static char expected[CPM_OUTPUT_SIZE];
+	struct State8080 *state = NewCpmMachine(path, 0, 0);
+	uint64_t instructions = 0;
+	uint64_t cycles;
+	int backends = EMULATOR_JIT ? 3 : 2;
+	int passed;
+	int i;
+
+	if (state == NULL) {
+		return 1;
+	}
+	printf("%s\n", path);
+	console.length = 0;
+	console.text[0] = '\0';
+	console.echo = 1;
+	while (!state->halted && state->cycles < CPM_CYCLE_LIMIT) {
+		instructions++;
+		Emulate(state);
+	}
+	console.echo = 0;
+	cycles = state->cycles;
+	memcpy(expected, console.text, console.length + 1);
+	passed = state->halted && strstr(expected, "ERROR") == NULL &&
+		strstr(expected, "FAIL") == NULL;
+	MachineFree(state);
+	printf("\n%s: %s, %llu instructions, %llu cycles\n", path,
+		passed ? "passed" : "FAILED", (unsigned long long)instructions,
+		(unsigned long long)cycles);
+
+	for (i = 0; i < backends && passed; i++) {
+		struct timespec start;
+		struct timespec end;
+		double seconds;
+
+		state = NewCpmMachine(path, i >= 1, i == 2);
+		if (state == NULL) {
+			return 1;
+		}
+		if (i == 2 && state->jit == NULL) {
+			fprintf(stderr, "TestProgram: no executable memory for the JIT\n");
+			MachineFree(state);
+			return 1;
+		}
+		console.length = 0;
+		console.text[0] = '\0';
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (!state->halted && state->cycles < CPM_CYCLE_LIMIT) {
+			Run8080(state, CPM_RUN_CYCLES);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		seconds = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+		passed = state->halted && strcmp(console.text, expected) == 0;
+		MachineFree(state);
+		printf("%-12s %-6s %9.3f s %9.1f MIPS %9.1f MHz\n", names[i],
+			passed ? "passed" : "FAILED", seconds,
+			instructions / seconds / 1e6, cycles / seconds / 1e6);
+	}
+	return passed ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	// emulator8080 -b rom [frames [results.csv]] times the backends on the
+	// ROM, appending the results to results.csv if given
+	if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+		return Benchmark(argv[2], argc >= 4 ? atoi(argv[3]) : 3600,
+			argc >= 5 ? argv[4] : NULL) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -m rom sessions [frames [threads]] runs many machines
+	// at once on all cores, or on as many threads as given
+	if (argc >= 4 && strcmp(argv[1], "-m") == 0) {
+		return RunBatch(argv[2], atoi(argv[3]),
+			argc >= 5 ? atoi(argv[4]) : 3600,
+			argc >= 6 ? atoi(argv[5]) : 0) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -l rom lanes [frames [spread]] compares many machines
+	// run in lockstep with the same run one after the other
+	if (argc >= 4 && strcmp(argv[1], "-l") == 0) {
+		return RunLockstep(argv[2], atoi(argv[3]),
+			argc >= 5 ? atoi(argv[4]) : 3600,
+			argc >= 6 ? atoi(argv[5]) : 0) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -s rom [frames] checks and times savestates
+	if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		return SavestateBenchmark(argv[2],
+			argc >= 4 ? atoi(argv[3]) : 600) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -c rom [frames [branches]] checks a tree of snapshots
+	if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+		return SnapshotBenchmark(argv[2], argc >= 4 ? atoi(argv[3]) : 1000,
+			argc >= 5 ? atoi(argv[4]) : 200) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -r rom [seconds [KiB]] checks and times rewinding
+	if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+		return RewindBenchmark(argv[2], argc >= 4 ? atoi(argv[3]) : 60,
+			argc >= 5 ? atoi(argv[4]) : 5120) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -a rom [frames [ahead]] checks and times run-ahead
+	if (argc >= 3 && strcmp(argv[1], "-a") == 0) {
+		return RunAheadBenchmark(argv[2], argc >= 4 ? atoi(argv[3]) : 3600,
+			argc >= 5 ? atoi(argv[4]) : 2) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -w rom movie [frames] records a movie
+	if (argc >= 4 && strcmp(argv[1], "-w") == 0) {
+		return RecordMovie(argv[2], argv[3],
+			argc >= 5 ? atoi(argv[4]) : 3600) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -p rom movie replays and checks a movie
+	if (argc >= 4 && strcmp(argv[1], "-p") == 0) {
+		return PlayMovie(argv[2], argv[3]) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -v rom [frames] checks and times the video conversion
+	if (argc >= 3 && strcmp(argv[1], "-v") == 0) {
+		return VideoBenchmark(argv[2],
+			argc >= 4 ? atoi(argv[3]) : 3600) == 0 ? 0 : -1;
+	}
+
+	// emulator8080 -t program.com ... runs CP/M CPU test programs
+	if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+		int failed = 0;
+		int i;
+
+		for (i = 2; i < argc; i++) {
+			failed += TestProgram(argv[i]);
+		}
+		printf("%d of %d passed\n", argc - 2 - failed, argc - 2);
+		return failed == 0 ? 0 : -1;
+	}
+
+	// the ROM image, or the folder holding the split ROM files
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s rom\n"
+			"       %s -b rom [frames [results.csv]]\n"
+			"       %s -m rom sessions [frames [threads]]\n"
+			"       %s -l rom lanes [frames [spread]]\n"
+			"       %s -s rom [frames]\n"
+			"       %s -c rom [frames [branches]]\n"
+			"       %s -r rom [seconds [KiB]]\n"
+			"       %s -a rom [frames [ahead]]\n"
+			"       %s -w rom movie [frames]\n"
+			"       %s -p rom movie\n"
+			"       %s -v rom [frames]\n"
+			"       %s -t program.com ...\n", argv[0], argv[0], argv[0],
+			argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+			argv[0], argv[0]);
+		return -1;
 	}
-	return -1;
+	return startup(argv[1]) == 0 ? 0 : -1;
 }
-			
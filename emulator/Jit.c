@@ -0,0 +1,1061 @@
+/* Jit.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Translates basic blocks of 8080 code into x86-64 host code.
+ */
+
+#include "State8080.h"
+#include "Jit.h"
+#include "Opcodes.h"
+
+#if EMULATOR_JIT
+
+#if !defined(__x86_64__)
+#error "the JIT only emits x86-64 code"
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Register use in translated code. The accumulator and the flag byte share
+ * rax, so LAHF and SAHF move the flags between AH and the host flags, which
+ * are laid out exactly as the low byte of PSW. The pairs BC, DE and HL live
+ * in CX, DX and BX, and SP in SI.
+ *   rbp   the State8080         r12   the Memory
+ *   r13d  cycles left           r15d  set when a write made blocks stale
+ *   rdi, r8-r11                 scratch; r9b carries bytes to and from memory
+ * An instruction cannot name both a high byte register and a register that
+ * needs a REX prefix, so bytes move between the two through [rsp]. */
+#define HOST_AL 0
+#define HOST_CL 1
+#define HOST_DL 2
+#define HOST_BL 3
+#define HOST_AH 4
+#define HOST_CH 5
+#define HOST_DH 6
+#define HOST_BH 7
+#define HOST_CX 1
+#define HOST_DX 2
+#define HOST_BX 3
+#define HOST_SI 6
+
+/* the 8080 register fields in opcode order; M has no register */
+#define REGISTER_M 6
+static const int host_register[8] = {
+	HOST_CH, HOST_CL, HOST_DH, HOST_DL, HOST_BH, HOST_BL, -1, HOST_AL
+};
+
+/* the 8080 register pair fields BC, DE, HL and SP */
+static const int host_pair[4] = { HOST_CX, HOST_DX, HOST_BX, HOST_SI };
+
+/* high and low byte registers of PUSH and POP, whose last pair is PSW */
+static const int host_high[4] = { HOST_CH, HOST_DH, HOST_BH, HOST_AL };
+static const int host_low[4] = { HOST_CL, HOST_DL, HOST_BL, HOST_AH };
+
+/* x86 opcodes of the 8080 ALU groups ADD, ADC, SUB, SBB, ANA, XRA, ORA and
+ * CMP in the form op r/m8, r8 */
+#define ALU_GROUP_ADC 1
+#define ALU_GROUP_SUB 2
+#define ALU_GROUP_SBB 3
+#define ALU_GROUP_ANA 4
+#define ALU_GROUP_XRA 5
+#define ALU_GROUP_ORA 6
+#define ALU_GROUP_CMP 7
+static const uint8_t alu_opcode[8] = {
+	0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38
+};
+
+/* flag tested by each branch condition; the odd conditions hold when it is
+ * set and the even ones when it is clear */
+static const uint8_t condition_flag[4] = { FLAG_Z, FLAG_C, FLAG_P, FLAG_S };
+
+/* x86 conditional jumps, as the second byte of 0F xx rel32 */
+#define JUMP 0
+#define JUMP_Z 0x84
+#define JUMP_NZ 0x85
+#define JUMP_L 0x8C
+
+/* where an ALU operand comes from */
+#define SOURCE_R9 8
+#define SOURCE_IMM 9
+
+#define OFFSET(field) offsetof(struct State8080, field)
+_Static_assert(offsetof(struct State8080, blocks) < 0x80,
+	"translated code reaches State8080 fields with 8-bit displacements");
+
+/* room a block needs in the code buffer, at worst */
+#define BLOCK_CODE_SIZE (BLOCK_MAX_OPS * 256 + 256)
+
+/* exits of the block being translated, which are emitted after it */
+#define MAX_EXITS (4 * BLOCK_MAX_OPS + 8)
+
+typedef struct JitExit {
+	uint32_t site;		// offset of the rel32 jumping to the exit
+	int set_pc;		// 0 when the program counter is already stored
+	uint16_t pc;		// address the CPU continues at
+	int refund;		// cycles of the instructions the exit skips
+} JitExit;
+
+typedef struct Translation {
+	struct Jit *jit;
+	struct State8080 *state;
+	struct JitExit exits[MAX_EXITS];
+	int exit_count;
+	/* the cycles of a block are taken on entry, so an exit before its end
+	 * gives back those of the instructions after the current one */
+	int refund;
+} Translation;
+
+static void Emit(struct Jit *jit, const uint8_t *bytes, size_t size)
+{
+	memcpy(jit->code + jit->used, bytes, size);
+	jit->used += size;
+}
+
+#define EMIT(jit, ...) Emit(jit, (const uint8_t[]){ __VA_ARGS__ }, \
+	sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+static void Emit16(struct Jit *jit, uint16_t value)
+{
+	Emit(jit, (const uint8_t *)&value, sizeof(value));
+}
+
+static void Emit32(struct Jit *jit, uint32_t value)
+{
+	Emit(jit, (const uint8_t *)&value, sizeof(value));
+}
+
+static void Emit64(struct Jit *jit, const void *pointer)
+{
+	uint64_t value = (uintptr_t)pointer;
+	Emit(jit, (const uint8_t *)&value, sizeof(value));
+}
+
+/* Points the rel32 at site to target */
+static void Patch32(struct Jit *jit, size_t site, size_t target)
+{
+	int32_t relative = (int32_t)(target - (site + 4));
+	memcpy(jit->code + site, &relative, sizeof(relative));
+}
+
+/* Emits a jump, or a conditional jump, with its rel32 left to be patched and
+ * returns the offset of the rel32 */
+static size_t EmitJump(struct Jit *jit, uint8_t condition)
+{
+	if (condition == JUMP) {
+		EMIT(jit, 0xE9);
+	} else {
+		EMIT(jit, 0x0F, condition);
+	}
+	Emit32(jit, 0);
+	return jit->used - 4;
+}
+
+/* Moves the 8080 registers between the host registers and the State8080;
+ * the pairs of a little-endian State8080 hold their registers as CX, DX and
+ * BX do */
+static void EmitSpill(struct Jit *jit)
+{
+	EMIT(jit, 0x88, 0x45 | HOST_AL << 3, OFFSET(a),
+		0x88, 0x45 | HOST_AH << 3, OFFSET(flags),
+		0x66, 0x89, 0x45 | HOST_CX << 3, OFFSET(bc),
+		0x66, 0x89, 0x45 | HOST_DX << 3, OFFSET(de),
+		0x66, 0x89, 0x45 | HOST_BX << 3, OFFSET(hl),
+		0x66, 0x89, 0x45 | HOST_SI << 3, OFFSET(sp));
+}
+
+static void EmitReload(struct Jit *jit)
+{
+	EMIT(jit, 0x8A, 0x45 | HOST_AL << 3, OFFSET(a),
+		0x8A, 0x45 | HOST_AH << 3, OFFSET(flags),
+		0x66, 0x8B, 0x45 | HOST_CX << 3, OFFSET(bc),
+		0x66, 0x8B, 0x45 | HOST_DX << 3, OFFSET(de),
+		0x66, 0x8B, 0x45 | HOST_BX << 3, OFFSET(hl),
+		0x0F, 0xB7, 0x45 | HOST_SI << 3, OFFSET(sp));
+}
+
+/* Emits the code that enters translated code, JitEnter(state, code, budget),
+ * and the code that leaves it with the program counter already stored */
+static void EmitEnterAndExit(struct Jit *jit)
+{
+	jit->exit = jit->used;
+	EmitSpill(jit);
+	EMIT(jit, 0x44, 0x89, 0xE8,		// mov eax, r13d
+		0x48, 0x83, 0xC4, 0x08,		// add rsp, 8
+		0x41, 0x5F, 0x41, 0x5E,		// pop r15, r14
+		0x41, 0x5D, 0x41, 0x5C,		// pop r13, r12
+		0x5B, 0x5D, 0xC3);		// pop rbx, rbp; ret
+
+	jit->enter = (int (*)(struct State8080 *, void *, int))
+		(void *)(jit->code + jit->used);
+	EMIT(jit, 0x55, 0x53,			// push rbp, rbx
+		0x41, 0x54, 0x41, 0x55,		// push r12, r13
+		0x41, 0x56, 0x41, 0x57,		// push r14, r15
+		0x48, 0x83, 0xEC, 0x08,		// sub rsp, 8
+		0x48, 0x89, 0xFD,		// mov rbp, rdi
+		0x4C, 0x8B, 0x65, OFFSET(memory),	// mov r12, [rbp+memory]
+		0x41, 0x89, 0xD5,		// mov r13d, edx
+		0x49, 0x89, 0xF6,		// mov r14, rsi
+		0x45, 0x31, 0xFF);		// xor r15d, r15d
+	EmitReload(jit);
+	EMIT(jit, 0x41, 0xFF, 0xE6);		// jmp r14
+
+	/* writes r9b to the watched page at edi through MemoryWriteSlow() and
+	 * sets r15d if the write made blocks stale */
+	jit->write_slow = jit->used;
+	EMIT(jit, 0x48, 0x83, 0xEC, 0x08);	// sub rsp, 8
+	EmitSpill(jit);
+	EMIT(jit, 0x4C, 0x8B, 0x45, OFFSET(blocks),	// mov r8, [rbp+blocks]
+		0x41, 0xC7, 0x80);		// mov dword [r8+stale], 0
+	Emit32(jit, offsetof(struct BlockCache, stale));
+	Emit32(jit, 0);
+	EMIT(jit, 0x89, 0xFE,			// mov esi, edi
+		0x41, 0x0F, 0xB6, 0xD1,		// movzx edx, r9b
+		0x4C, 0x89, 0xE7,		// mov rdi, r12
+		0x48, 0xB8);			// mov rax, MemoryWriteSlow
+	Emit64(jit, (void *)MemoryWriteSlow);
+	EMIT(jit, 0xFF, 0xD0);			// call rax
+	EmitReload(jit);
+	EMIT(jit, 0x4C, 0x8B, 0x45, OFFSET(blocks),
+		0x41, 0x83, 0xB8);		// cmp dword [r8+stale], 0
+	Emit32(jit, offsetof(struct BlockCache, stale));
+	EMIT(jit, 0x00,
+		0x74, 0x06,			// je +6
+		0x41, 0xBF, 1, 0, 0, 0,		// mov r15d, 1
+		0x48, 0x83, 0xC4, 0x08,		// add rsp, 8
+		0xC3);				// ret
+}
+
+/* Emits a jump, or a conditional jump, that leaves translated code with the
+ * program counter set to pc */
+static void EmitExit(struct Translation *t, uint8_t condition, uint16_t pc)
+{
+	struct JitExit *exit = &t->exits[t->exit_count++];
+
+	exit->site = EmitJump(t->jit, condition);
+	exit->set_pc = 1;
+	exit->pc = pc;
+	exit->refund = t->refund;
+}
+
+/* Emits a jump, or a conditional jump, that leaves translated code with the
+ * program counter as the State8080 holds it */
+static void EmitExitAsIs(struct Translation *t, uint8_t condition)
+{
+	struct JitExit *exit;
+	size_t site = EmitJump(t->jit, condition);
+
+	if (t->refund == 0) {
+		Patch32(t->jit, site, t->jit->exit);
+		return;
+	}
+	exit = &t->exits[t->exit_count++];
+	exit->site = site;
+	exit->set_pc = 0;
+	exit->refund = t->refund;
+}
+
+/* Emits a jump to the translated block at target; until there is one, the
+ * jump leaves translated code and is linked to be patched later */
+static void EmitChain(struct Translation *t, uint16_t target)
+{
+	struct Jit *jit = t->jit;
+	size_t site;
+
+	if (jit->entry[target] != NULL) {
+		site = EmitJump(jit, JUMP);
+		Patch32(jit, site, (uint8_t *)jit->entry[target] - jit->code);
+		return;
+	}
+	EmitExit(t, JUMP, target);
+	if (jit->link_count < JIT_MAX_LINKS) {
+		struct JitLink *link = &jit->links[jit->link_count];
+
+		link->site = t->exits[t->exit_count - 1].site;
+		link->next = jit->link_head[target];
+		jit->link_head[target] = jit->link_count++;
+	}
+}
+
+/* Emits a jump to the translated block at the address in edi, looked up in
+ * the entry table; an address with no translation leaves translated code */
+static void EmitDynamicChain(struct Translation *t)
+{
+	struct Jit *jit = t->jit;
+
+	EMIT(jit, 0x66, 0x89, 0x7D, OFFSET(pc),	// mov [rbp+pc], di
+		0x49, 0xB8);			// mov r8, entry
+	Emit64(jit, jit->entry);
+	EMIT(jit, 0x4D, 0x8B, 0x04, 0xF8,	// mov r8, [r8+rdi*8]
+		0x4D, 0x85, 0xC0);		// test r8, r8
+	EmitExitAsIs(t, JUMP_Z);
+	EMIT(jit, 0x41, 0xFF, 0xE0);		// jmp r8
+}
+
+/* Emits a load of the stale flag of the block cache into r8 */
+static void EmitStaleAddress(struct Translation *t)
+{
+	EMIT(t->jit, 0x49, 0xB8);		// mov r8, &blocks->stale
+	Emit64(t->jit, &t->state->blocks->stale);
+}
+
+/* Moves the host byte register reg to r9b and back */
+static void EmitToR9(struct Jit *jit, int reg)
+{
+	EMIT(jit, 0x88, reg << 3 | 0x04, 0x24,	// mov [rsp], reg
+		0x44, 0x0F, 0xB6, 0x0C, 0x24);	// movzx r9d, byte [rsp]
+}
+
+static void EmitFromR9(struct Jit *jit, int reg)
+{
+	EMIT(jit, 0x44, 0x88, 0x0C, 0x24,	// mov [rsp], r9b
+		0x8A, reg << 3 | 0x04, 0x24);	// mov reg, [rsp]
+}
+
+/* Emits edi = HL, edi = the address in a register pair, edi = address and
+ * edi = SP + 1 */
+static void EmitAddressHL(struct Jit *jit)
+{
+	EMIT(jit, 0x0F, 0xB7, 0xFB);		// movzx edi, bx
+}
+
+static void EmitAddressPair(struct Jit *jit, int pair)
+{
+	EMIT(jit, 0x0F, 0xB7, 0xF8 | host_pair[pair]);	// movzx edi, pair
+}
+
+static void EmitAddress(struct Jit *jit, uint16_t address)
+{
+	EMIT(jit, 0xBF);			// mov edi, address
+	Emit32(jit, address);
+}
+
+static void EmitAddressStack(struct Jit *jit, int above)
+{
+	if (above) {
+		EMIT(jit, 0x8D, 0x7E, 0x01,	// lea edi, [rsi+1]
+			0x0F, 0xB7, 0xFF);	// movzx edi, di
+	} else {
+		EMIT(jit, 0x0F, 0xB7, 0xFE);	// movzx edi, si
+	}
+}
+
+/* Emits r9d = the byte at the address in edi, through the read pages */
+static void EmitRead(struct Jit *jit)
+{
+	EMIT(jit, 0x41, 0x89, 0xF8,		// mov r8d, edi
+		0x41, 0xC1, 0xE8, 0x08,		// shr r8d, 8
+		0x4F, 0x8B, 0x04, 0xC4,		// mov r8, [r12+r8*8]
+		0x44, 0x0F, 0xB6, 0xD7,		// movzx r10d, dil
+		0x47, 0x0F, 0xB6, 0x0C, 0x10);	// movzx r9d, byte [r8+r10]
+}
+
+/* Emits a write of r9b to the address in edi, through the write pages; a
+ * watched page calls the slow write routine */
+static void EmitWrite(struct Translation *t)
+{
+	struct Jit *jit = t->jit;
+	size_t site;
+
+	EMIT(jit, 0x41, 0x89, 0xF8,		// mov r8d, edi
+		0x41, 0xC1, 0xE8, 0x08,		// shr r8d, 8
+		0x4F, 0x8B, 0x84, 0xC4);	// mov r8, [r12+r8*8+write]
+	Emit32(jit, offsetof(struct Memory, write));
+	EMIT(jit, 0x4D, 0x85, 0xC0,		// test r8, r8
+		0x74, 0x0A,			// jz slow
+		0x44, 0x0F, 0xB6, 0xD7,		// movzx r10d, dil
+		0x47, 0x88, 0x0C, 0x10,		// mov [r8+r10], r9b
+		0xEB, 0x05,			// jmp done
+		0xE8);				// slow: call write_slow
+	site = jit->used;
+	Emit32(jit, 0);
+	Patch32(jit, site, jit->write_slow);
+}
+
+/* Emits an exit to pc if a write of the current instruction made blocks
+ * stale; the rest of the block may have been overwritten */
+static void EmitStaleCheck(struct Translation *t, uint16_t pc)
+{
+	EMIT(t->jit, 0x45, 0x85, 0xFF);		// test r15d, r15d
+	EmitExit(t, JUMP_NZ, pc);
+}
+
+/* Emits PUSH of the host byte registers high and low */
+static void EmitPush(struct Translation *t, int high, int low)
+{
+	struct Jit *jit = t->jit;
+
+	EMIT(jit, 0x66, 0x83, 0xEE, 0x02);	// sub si, 2
+	EmitAddressStack(jit, 1);
+	EmitToR9(jit, high);
+	EmitWrite(t);
+	EmitAddressStack(jit, 0);
+	EmitToR9(jit, low);
+	EmitWrite(t);
+}
+
+/* Emits PUSH of a constant, the return address of a call */
+static void EmitPushConstant(struct Translation *t, uint16_t value)
+{
+	struct Jit *jit = t->jit;
+
+	EMIT(jit, 0x66, 0x83, 0xEE, 0x02);	// sub si, 2
+	EmitAddressStack(jit, 1);
+	EMIT(jit, 0x41, 0xB1, value >> 8);	// mov r9b, high
+	EmitWrite(t);
+	EmitAddressStack(jit, 0);
+	EMIT(jit, 0x41, 0xB1, value & 0xFF);	// mov r9b, low
+	EmitWrite(t);
+}
+
+/* Emits a pop into edi, as RET does */
+static void EmitPopAddress(struct Jit *jit)
+{
+	EmitAddressStack(jit, 0);
+	EmitRead(jit);
+	EMIT(jit, 0x45, 0x0F, 0xB6, 0xD9);	// movzx r11d, r9b
+	EmitAddressStack(jit, 1);
+	EmitRead(jit);
+	EMIT(jit, 0x41, 0xC1, 0xE1, 0x08,	// shl r9d, 8
+		0x45, 0x09, 0xD9,		// or r9d, r11d
+		0x66, 0x83, 0xC6, 0x02,		// add si, 2
+		0x44, 0x89, 0xCF);		// mov edi, r9d
+}
+
+/* Emits an ALU operation of group on the accumulator and source, a host
+ * byte register, r9b or imm; the flags are only brought into AH when an
+ * instruction after it reads them */
+static void EmitAlu(struct Jit *jit, int group, int source, uint8_t imm,
+	int live)
+{
+	uint8_t opcode = alu_opcode[group];
+
+	if (group == ALU_GROUP_ADC || group == ALU_GROUP_SBB) {
+		EMIT(jit, 0x9E);		// sahf
+	}
+	/* ANA sets the auxiliary carry to bit 3 of the OR of its operands */
+	if (group == ALU_GROUP_ANA && live) {
+		EMIT(jit, 0x88, 0x04, 0x24);	// mov [rsp], al
+		if (source == SOURCE_IMM) {
+			EMIT(jit, 0x80, 0x0C, 0x24, imm);
+		} else if (source == SOURCE_R9) {
+			EMIT(jit, 0x44, 0x08, 0x0C, 0x24);
+		} else {
+			EMIT(jit, 0x08, source << 3 | 0x04, 0x24);
+		}
+	}
+
+	if (source == SOURCE_IMM) {
+		EMIT(jit, opcode + 4, imm);	// op al, imm
+	} else if (source == SOURCE_R9) {
+		EMIT(jit, 0x44, opcode, 0xC8);	// op al, r9b
+	} else {
+		EMIT(jit, opcode, 0xC0 | source << 3);	// op al, source
+	}
+	if (!live) {
+		return;
+	}
+
+	EMIT(jit, 0x9F);			// lahf
+	switch (group) {
+	case ALU_GROUP_SUB:
+	case ALU_GROUP_SBB:
+	case ALU_GROUP_CMP:
+		/* the 8080 subtracts by adding the complement, so its auxiliary
+		 * carry is the inverse of the host borrow */
+		EMIT(jit, 0x80, 0xF4, FLAG_AC);
+		break;
+	case ALU_GROUP_ANA:
+		EMIT(jit, 0x80, 0xE4, (uint8_t)~FLAG_AC,
+			0xF6, 0x04, 0x24, 0x08,	// test byte [rsp], 8
+			0x74, 0x03,		// jz +3
+			0x80, 0xCC, FLAG_AC);
+		break;
+	case ALU_GROUP_XRA:
+	case ALU_GROUP_ORA:
+		EMIT(jit, 0x80, 0xE4, (uint8_t)~FLAG_AC);
+		break;
+	}
+}
+
+/* Emits INR (dec 0) or DCR (dec 1) of the host byte register reg, or of r9b
+ * when reg is SOURCE_R9 */
+static void EmitIncrement(struct Jit *jit, int reg, int dec, int live)
+{
+	if (live) {
+		EMIT(jit, 0x9E);		// sahf
+	}
+	if (reg == SOURCE_R9) {
+		EMIT(jit, 0x41, 0xFE, 0xC1 | dec << 3);
+	} else {
+		EMIT(jit, 0xFE, 0xC0 | dec << 3 | reg);
+	}
+	if (live) {
+		EMIT(jit, 0x9F);		// lahf
+		if (dec) {
+			EMIT(jit, 0x80, 0xF4, FLAG_AC);
+		}
+	}
+}
+
+/* Emits the copy of the host carry into the carry flag in AH */
+static void EmitCarry(struct Jit *jit)
+{
+	EMIT(jit, 0x0F, 0x92, 0x04, 0x24,	// setc [rsp]
+		0x80, 0xE4, (uint8_t)~FLAG_C,	// and ah, ~FLAG_C
+		0x0A, 0x24, 0x24);		// or ah, [rsp]
+}
+
+/* Flags read and written by each instruction, for the liveness pass */
+#define FLAG_READS(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	[opcode] = reads,
+#define FLAG_WRITES(opcode, length, cycles, taken, mnemonic, operands, \
+	kind, reads, writes, body) \
+	[opcode] = writes,
+static const uint8_t flag_reads[256] = { OPCODES(FLAG_READS) };
+static const uint8_t flag_writes[256] = { OPCODES(FLAG_WRITES) };
+
+/* Returns 1 if translated code may leave the block after opcode: after a
+ * write that made the block stale, or after a handler, which may also stop
+ * the run; every flag must then be up to date in AH */
+static int JitMayLeave(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x27: case 0xD3: case 0xDB: case 0xE3:	// DAA, OUT, IN, XTHL
+	case 0x02: case 0x12:				// STAX
+	case 0x22: case 0x32:				// SHLD, STA
+	case 0x34: case 0x35: case 0x36:		// INR M, DCR M, MVI M
+	case 0x70: case 0x71: case 0x72: case 0x73:	// MOV M
+	case 0x74: case 0x75: case 0x77:
+	case 0xC5: case 0xD5: case 0xE5: case 0xF5:	// PUSH
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Emits an instruction left to its handler */
+static void EmitHandler(struct Translation *t, const struct DecodedOp *op,
+	uint16_t address)
+{
+	struct Jit *jit = t->jit;
+	struct DecodedOp *copy = &jit->ops[jit->op_count++];
+
+	*copy = *op;
+	EMIT(jit, 0x66, 0xC7, 0x45, OFFSET(pc));	// mov word [rbp+pc], address
+	Emit16(jit, address);
+	EmitSpill(jit);
+	EmitStaleAddress(t);
+	EMIT(jit, 0x41, 0xC7, 0x00, 0, 0, 0, 0,	// mov dword [r8], 0
+		0x48, 0x89, 0xEF,		// mov rdi, rbp
+		0x48, 0xBE);			// mov rsi, copy
+	Emit64(jit, copy->bytes);
+	EMIT(jit, 0x48, 0xB8);			// mov rax, handler
+	Emit64(jit, (void *)handlers[op->bytes[0]]);
+	EMIT(jit, 0xFF, 0xD0);			// call rax
+	EmitReload(jit);
+
+	/* HLT and EI may end the run, and a write may have made the rest of the
+	 * block stale; the handler has moved the program counter on */
+	EMIT(jit, 0x80, 0x7D, OFFSET(stop), 0x00);	// cmp byte [rbp+stop], 0
+	EmitExitAsIs(t, JUMP_NZ);
+	EmitStaleAddress(t);
+	EMIT(jit, 0x41, 0x83, 0x38, 0x00);	// cmp dword [r8], 0
+	EmitExitAsIs(t, JUMP_NZ);
+	if (EndsBlock(op->bytes[0])) {
+		EMIT(jit, 0x0F, 0xB7, 0x7D, OFFSET(pc));	// movzx edi, [rbp+pc]
+		EmitDynamicChain(t);
+	}
+	jit->handler_ops++;
+}
+
+/* Emits an instruction as host code; returns 1 if it ended the block and -1
+ * if it has no translation */
+static int EmitOp(struct Translation *t, const struct DecodedOp *op,
+	uint16_t next, int live)
+{
+	struct Jit *jit = t->jit;
+	uint8_t opcode = op->bytes[0];
+	uint8_t imm = op->bytes[1];
+	uint16_t word = op->bytes[1] | op->bytes[2] << 8;
+	int dst = (opcode >> 3) & 0x07;
+	int src = opcode & 0x07;
+	int pair = (opcode >> 4) & 0x03;
+	uint8_t flag = condition_flag[dst >> 1];
+	/* jumps past the branch when its condition fails */
+	uint8_t fails = (dst & 1) ? JUMP_Z : JUMP_NZ;
+	size_t skip;
+
+	/* MOV */
+	if (opcode >= 0x40 && opcode <= 0x7F && opcode != 0x76) {
+		if (src == REGISTER_M) {
+			EmitAddressHL(jit);
+			EmitRead(jit);
+			EmitFromR9(jit, host_register[dst]);
+		} else if (dst == REGISTER_M) {
+			EmitAddressHL(jit);
+			EmitToR9(jit, host_register[src]);
+			EmitWrite(t);
+			EmitStaleCheck(t, next);
+		} else {
+			EMIT(jit, 0x88, 0xC0 | host_register[src] << 3 |
+				host_register[dst]);
+		}
+		return 0;
+	}
+
+	/* ADD to CMP, on a register, M or an immediate byte */
+	if (opcode >= 0x80 && opcode <= 0xBF) {
+		if (src == REGISTER_M) {
+			EmitAddressHL(jit);
+			EmitRead(jit);
+			EmitAlu(jit, dst, SOURCE_R9, 0, live);
+		} else {
+			EmitAlu(jit, dst, host_register[src], 0, live);
+		}
+		return 0;
+	}
+	if ((opcode & 0xC7) == 0xC6) {
+		EmitAlu(jit, dst, SOURCE_IMM, imm, live);
+		return 0;
+	}
+
+	if (opcode < 0x40) {
+		switch (opcode & 0x0F) {
+		case 0x01:	// LXI
+			EMIT(jit, 0x66, 0xB8 | host_pair[pair]);
+			Emit16(jit, word);
+			return 0;
+		case 0x03:	// INX
+		case 0x0B:	// DCX
+			EMIT(jit, 0x66, 0xFF, ((opcode & 0x08) ? 0xC8 : 0xC0) |
+				host_pair[pair]);
+			return 0;
+		case 0x09:	// DAD
+			if (live) {
+				EMIT(jit, 0x80, 0xE4, (uint8_t)~FLAG_C);
+			}
+			EMIT(jit, 0x66, 0x01, 0xC0 | host_pair[pair] << 3 | HOST_BX);
+			if (live) {
+				EMIT(jit, 0x73, 0x03,	// jnc +3
+					0x80, 0xCC, FLAG_C);
+			}
+			return 0;
+		}
+		switch (opcode & 0x07) {
+		case 0x00:	// NOP
+			return 0;
+		case 0x04:	// INR
+		case 0x05:	// DCR
+			if (dst == REGISTER_M) {
+				EmitAddressHL(jit);
+				EmitRead(jit);
+				EmitIncrement(jit, SOURCE_R9, src & 1, live);
+				EmitWrite(t);
+				EmitStaleCheck(t, next);
+			} else {
+				EmitIncrement(jit, host_register[dst], src & 1, live);
+			}
+			return 0;
+		case 0x06:	// MVI
+			if (dst == REGISTER_M) {
+				EmitAddressHL(jit);
+				EMIT(jit, 0x41, 0xB1, imm);	// mov r9b, imm
+				EmitWrite(t);
+				EmitStaleCheck(t, next);
+			} else {
+				EMIT(jit, 0xB0 | host_register[dst], imm);
+			}
+			return 0;
+		}
+	}
+
+	switch (opcode) {
+	case 0x02:	// STAX
+	case 0x12:
+		EmitAddressPair(jit, pair);
+		EmitToR9(jit, HOST_AL);
+		EmitWrite(t);
+		EmitStaleCheck(t, next);
+		return 0;
+	case 0x0A:	// LDAX
+	case 0x1A:
+		EmitAddressPair(jit, pair);
+		EmitRead(jit);
+		EmitFromR9(jit, HOST_AL);
+		return 0;
+	case 0x22:	// SHLD
+		EmitAddress(jit, word);
+		EmitToR9(jit, HOST_BL);
+		EmitWrite(t);
+		EmitAddress(jit, (uint16_t)(word + 1));
+		EmitToR9(jit, HOST_BH);
+		EmitWrite(t);
+		EmitStaleCheck(t, next);
+		return 0;
+	case 0x2A:	// LHLD
+		EmitAddress(jit, word);
+		EmitRead(jit);
+		EmitFromR9(jit, HOST_BL);
+		EmitAddress(jit, (uint16_t)(word + 1));
+		EmitRead(jit);
+		EmitFromR9(jit, HOST_BH);
+		return 0;
+	case 0x32:	// STA
+		EmitAddress(jit, word);
+		EmitToR9(jit, HOST_AL);
+		EmitWrite(t);
+		EmitStaleCheck(t, next);
+		return 0;
+	case 0x3A:	// LDA
+		EmitAddress(jit, word);
+		EmitRead(jit);
+		EmitFromR9(jit, HOST_AL);
+		return 0;
+	case 0x07:	// RLC
+	case 0x0F:	// RRC
+	case 0x17:	// RAL
+	case 0x1F:	// RAR
+		if (opcode == 0x17 || opcode == 0x1F) {
+			EMIT(jit, 0x9E);	// sahf
+		}
+		EMIT(jit, 0xD0, 0xC0 | (opcode >> 3) << 3);	// rol/ror/rcl/rcr al, 1
+		if (live) {
+			EmitCarry(jit);
+		}
+		return 0;
+	case 0x2F:	// CMA
+		EMIT(jit, 0xF6, 0xD0);		// not al
+		return 0;
+	case 0x37:	// STC
+		EMIT(jit, 0x80, 0xCC, FLAG_C);
+		return 0;
+	case 0x3F:	// CMC
+		EMIT(jit, 0x80, 0xF4, FLAG_C);
+		return 0;
+	case 0xEB:	// XCHG
+		EMIT(jit, 0x66, 0x87, 0xD3);	// xchg bx, dx
+		return 0;
+	case 0xF9:	// SPHL
+		EMIT(jit, 0x66, 0x89, 0xDE);	// mov si, bx
+		return 0;
+	case 0xF3:	// DI
+		EMIT(jit, 0xC6, 0x45, OFFSET(int_enable), 0x00);
+		return 0;
+	case 0xC1:	// POP
+	case 0xD1:
+	case 0xE1:
+	case 0xF1:
+		EmitAddressStack(jit, 0);
+		EmitRead(jit);
+		if (opcode == 0xF1) {
+			EMIT(jit, 0x41, 0x80, 0xE1, FLAGS_MASK,	// and r9b, mask
+				0x41, 0x80, 0xC9, FLAG_ALWAYS);	// or r9b, always
+		}
+		EmitFromR9(jit, host_low[pair]);
+		EmitAddressStack(jit, 1);
+		EmitRead(jit);
+		EmitFromR9(jit, host_high[pair]);
+		EMIT(jit, 0x66, 0x83, 0xC6, 0x02);	// add si, 2
+		return 0;
+	case 0xC5:	// PUSH
+	case 0xD5:
+	case 0xE5:
+	case 0xF5:
+		EmitPush(t, host_high[pair], host_low[pair]);
+		EmitStaleCheck(t, next);
+		return 0;
+	case 0xC3:	// JMP
+	case 0xCB:
+		EmitChain(t, word);
+		return 1;
+	case 0xCD:	// CALL
+	case 0xDD:
+	case 0xED:
+	case 0xFD:
+		EmitPushConstant(t, next);
+		EmitStaleCheck(t, word);
+		EmitChain(t, word);
+		return 1;
+	case 0xC9:	// RET
+	case 0xD9:
+		EmitPopAddress(jit);
+		EmitDynamicChain(t);
+		return 1;
+	case 0xE9:	// PCHL
+		EmitAddressHL(jit);
+		EmitDynamicChain(t);
+		return 1;
+	}
+
+	switch (opcode & 0xC7) {
+	case 0xC2:	// JCC
+		EMIT(jit, 0xF6, 0xC4, flag);	// test ah, flag
+		skip = EmitJump(jit, fails);
+		EmitChain(t, word);
+		Patch32(jit, skip, jit->used);
+		EmitChain(t, next);
+		return 1;
+	case 0xC4:	// CCC
+		EMIT(jit, 0xF6, 0xC4, flag);
+		skip = EmitJump(jit, fails);
+		EMIT(jit, 0x41, 0x83, 0xED,	// sub r13d, taken extra
+			cycles_table[opcode].taken - cycles_table[opcode].cycles);
+		EmitPushConstant(t, next);
+		EmitStaleCheck(t, word);
+		EmitChain(t, word);
+		Patch32(jit, skip, jit->used);
+		EmitChain(t, next);
+		return 1;
+	case 0xC0:	// RCC
+		EMIT(jit, 0xF6, 0xC4, flag);
+		skip = EmitJump(jit, fails);
+		EMIT(jit, 0x41, 0x83, 0xED,
+			cycles_table[opcode].taken - cycles_table[opcode].cycles);
+		EmitPopAddress(jit);
+		EmitDynamicChain(t);
+		Patch32(jit, skip, jit->used);
+		EmitChain(t, next);
+		return 1;
+	}
+	return -1;
+}
+
+/* Returns 1 if the code on page may still be run translated; a page that
+ * was written after code on it was translated modified itself */
+static int JitPageUsable(struct Jit *jit, struct State8080 *state, int page)
+{
+	uint32_t generation = state->blocks->generation[page];
+
+	if (jit->self_modifying[page]) {
+		return 0;
+	}
+	if (!jit->seen[page]) {
+		jit->seen[page] = 1;
+		jit->generation[page] = generation;
+	} else if (jit->generation[page] != generation) {
+		jit->self_modifying[page] = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* Translates block, which starts at pc, and returns its entry, or NULL when
+ * the code buffer is full */
+static void *JitTranslate(struct Jit *jit, struct State8080 *state,
+	uint16_t pc, const struct Block *block)
+{
+	struct Translation t;
+	uint8_t live[BLOCK_MAX_OPS];
+	uint8_t flags = FLAGS_MASK;
+	uint16_t address = pc;
+	size_t entry = jit->used;
+	int refund;
+	int ended = 0;
+	int i;
+
+	if (jit->used + BLOCK_CODE_SIZE > JIT_CODE_SIZE ||
+		jit->op_count + BLOCK_MAX_OPS > JIT_MAX_OPS) {
+		return NULL;
+	}
+	t.jit = jit;
+	t.state = state;
+	t.exit_count = 0;
+	t.refund = 0;
+
+	/* flags live after each instruction; all are live at the end and
+	 * wherever translated code may leave the block early */
+	for (i = block->count - 1; i >= 0; i--) {
+		uint8_t opcode = block->ops[i].bytes[0];
+
+		if (JitMayLeave(opcode)) {
+			flags = FLAGS_MASK;
+		}
+		live[i] = flags;
+		flags = (flags & ~flag_writes[opcode]) | flag_reads[opcode];
+	}
+
+	/* code on a page that can be written runs only while the page keeps
+	 * the generation it was translated at */
+	for (i = 0; i < 2; i++) {
+		int page = block->pages[i];
+
+		if (state->memory->type[page] == PAGE_ROM ||
+			(i == 1 && page == block->pages[0])) {
+			continue;
+		}
+		EMIT(jit, 0x49, 0xB8);		// mov r8, &generation
+		Emit64(jit, &state->blocks->generation[page]);
+		EMIT(jit, 0x41, 0x81, 0x38);	// cmp dword [r8], generation
+		Emit32(jit, block->generation[i]);
+		EmitExit(&t, JUMP_NZ, pc);
+	}
+
+	/* a block runs only if it fits in the cycles left, as in the
+	 * interpreter */
+	EMIT(jit, 0x41, 0x81, 0xFD);		// cmp r13d, cycles
+	Emit32(jit, block->cycles);
+	EmitExit(&t, JUMP_L, pc);
+	EMIT(jit, 0x41, 0x81, 0xED);		// sub r13d, cycles
+	Emit32(jit, block->cycles);
+
+	refund = block->cycles;
+	for (i = 0; i < block->count && !ended; i++) {
+		const struct DecodedOp *op = &block->ops[i];
+		uint16_t next = address + length_table[op->bytes[0]];
+		int result;
+
+		refund -= cycles_table[op->bytes[0]].cycles;
+		t.refund = refund;
+
+		result = EmitOp(&t, op, next,
+			live[i] & flag_writes[op->bytes[0]]);
+
+		if (result < 0) {
+			EmitHandler(&t, op, address);
+			ended = EndsBlock(op->bytes[0]);
+		} else {
+			jit->native_ops++;
+			ended = result;
+		}
+		address = next;
+	}
+	if (!ended) {
+		EmitChain(&t, address);
+	}
+
+	/* the exits give back cycles, set the program counter and leave */
+	for (i = 0; i < t.exit_count; i++) {
+		struct JitExit *exit = &t.exits[i];
+		size_t site;
+
+		Patch32(jit, exit->site, jit->used);
+		if (exit->refund != 0) {
+			EMIT(jit, 0x41, 0x81, 0xC5);	// add r13d, refund
+			Emit32(jit, exit->refund);
+		}
+		if (exit->set_pc) {
+			EMIT(jit, 0x66, 0xC7, 0x45, OFFSET(pc));
+			Emit16(jit, exit->pc);
+		}
+		site = EmitJump(jit, JUMP);
+		Patch32(jit, site, jit->exit);
+	}
+
+	/* jumps already translated to this block now go straight to it */
+	jit->entry[pc] = jit->code + entry;
+	jit->pages[pc][0] = block->pages[0];
+	jit->pages[pc][1] = block->pages[1];
+	for (i = jit->link_head[pc]; i >= 0; i = jit->links[i].next) {
+		Patch32(jit, jit->links[i].site, entry);
+	}
+	jit->link_head[pc] = -1;
+	jit->blocks++;
+	return jit->entry[pc];
+}
+
+/* Returns the translation of block, which starts at pc, translating it if
+ * needed; returns NULL for code left to the interpreter */
+static void *JitCode(struct Jit *jit, struct State8080 *state, uint16_t pc,
+	const struct Block *block)
+{
+	if (!JitPageUsable(jit, state, block->pages[0]) ||
+		!JitPageUsable(jit, state, block->pages[1])) {
+		jit->entry[pc] = NULL;
+		return NULL;
+	}
+	if (jit->entry[pc] != NULL) {
+		return jit->entry[pc];
+	}
+	return JitTranslate(jit, state, pc, block);
+}
+
+/* Maps the code buffer and emits the code entering and leaving it; returns
+ * 0 on success and -1 when executable memory cannot be had */
+int JitInit(struct Jit *jit)
+{
+	int i;
+
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		fprintf(stderr, "JitInit: cannot map executable memory\n");
+		return -1;
+	}
+	jit->ops = malloc(JIT_MAX_OPS * sizeof(struct DecodedOp));
+	if (jit->ops == NULL) {
+		fprintf(stderr, "JitInit: malloc failed\n");
+		munmap(jit->code, JIT_CODE_SIZE);
+		return -1;
+	}
+	jit->used = 0;
+	jit->op_count = 0;
+	jit->link_count = 0;
+	jit->blocks = 0;
+	jit->native_ops = 0;
+	jit->handler_ops = 0;
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		jit->entry[i] = NULL;
+		jit->link_head[i] = -1;
+	}
+	for (i = 0; i < MEMORY_PAGES; i++) {
+		jit->seen[i] = 0;
+		jit->self_modifying[i] = 0;
+	}
+	EmitEnterAndExit(jit);
+	return 0;
+}
+
+/* Releases the code buffer */
+void JitFree(struct Jit *jit)
+{
+	munmap(jit->code, JIT_CODE_SIZE);
+	free(jit->ops);
+	jit->code = NULL;
+	jit->ops = NULL;
+}
+
+/* Runs the 8080 CPU on translated code until at least cycle_budget cycles
+ * have been taken or the run is stopped, and returns the cycles taken. The
+ * CPU needs a block cache. Blocks that do not fit in the cycles left run
+ * one instruction at a time and self-modifying pages are interpreted, so a
+ * run ends exactly where it would in the interpreter. */
+int JitRun(struct State8080 *state, int cycle_budget)
+{
+	struct Jit *jit = state->jit;
+	struct BlockCache *blocks = state->blocks;
+	int remaining = cycle_budget;
+
+	while (remaining > 0 && !state->stop) {
+		struct Block *block = State8080Block(state, state->pc);
+		const struct DecodedOp *op;
+		void *code;
+
+		if (block == NULL || block->cycles > remaining) {
+			uint8_t fetched[MEMORY_FETCH_SIZE];
+			const uint8_t *instruction = MemoryFetch(state->memory,
+				state->pc, fetched);
+
+			remaining -= handlers[*instruction](state, instruction);
+			continue;
+		}
+		code = JitCode(jit, state, state->pc, block);
+		if (code != NULL) {
+			remaining = jit->enter(state, code, remaining);
+			continue;
+		}
+		blocks->stale = 0;
+		for (op = block->ops; op != block->ops + block->count &&
+			!blocks->stale; op++) {
+			remaining -= handlers[op->bytes[0]](state, op->bytes);
+		}
+	}
+	state->stop = 0;
+	return cycle_budget - remaining;
+}
+
+#endif
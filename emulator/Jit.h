@@ -0,0 +1,63 @@
+/* Jit.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Translates basic blocks of 8080 code into x86-64 host code.
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Memory.h"
+
+#define JIT_CODE_SIZE (16 << 20)
+#define JIT_MAX_OPS (1 << 18)	// instructions kept for the handler calls
+#define JIT_MAX_LINKS (1 << 16)
+
+struct State8080;
+struct DecodedOp;
+
+/* A jump in translated code to a block that was not translated yet; it is
+ * patched to jump straight to the block once it is */
+typedef struct JitLink {
+	uint32_t site;		// offset in the code of the rel32 to patch
+	int next;		// next link to the same address, or -1
+} JitLink;
+
+typedef struct Jit {
+	uint8_t *code;		// executable buffer holding the translations
+	size_t used;
+	int (*enter)(struct State8080 *state, void *code, int budget);
+	size_t exit;		// offset of the code that returns to JitRun()
+	size_t write_slow;	// offset of the routine writing to watched pages
+
+	/* entry of the translated block at each address, or NULL; translated
+	 * code looks up the target of a return or PCHL here */
+	void *entry[MEMORY_SIZE];
+	uint8_t pages[MEMORY_SIZE][2];	// pages of the block at each address
+
+	/* a page whose generation moves on after code on it was translated has
+	 * modified itself and is left to the interpreter from then on */
+	uint8_t seen[MEMORY_PAGES];
+	uint8_t self_modifying[MEMORY_PAGES];
+	uint32_t generation[MEMORY_PAGES];
+
+	int link_head[MEMORY_SIZE];
+	struct JitLink links[JIT_MAX_LINKS];
+	int link_count;
+
+	struct DecodedOp *ops;	// copies of the instructions left to handlers
+	int op_count;
+
+	/* statistics for the benchmark */
+	uint64_t blocks;	// blocks translated
+	uint64_t native_ops;	// instructions translated into host code
+	uint64_t handler_ops;	// instructions translated into handler calls
+} Jit;
+
+int JitInit(struct Jit *jit);
+void JitFree(struct Jit *jit);
+int JitRun(struct State8080 *state, int cycle_budget);
+
+#endif
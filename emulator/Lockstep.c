@@ -0,0 +1,948 @@
+/* Lockstep.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Experimental engine stepping many Space Invaders machines in lockstep, their
+ * registers kept in structure-of-arrays layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Lockstep.h"
+#include "Memory.h"
+#include "State8080.h"
+
+/* the vector path needs AVX2, which is checked for when the engine starts,
+ * so the rest of the emulator is still built for any x86-64 */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LOCKSTEP_AVX2 1
+#include <immintrin.h>
+#else
+#define LOCKSTEP_AVX2 0
+#endif
+
+#define REGISTER_M 6
+#define REGISTER_A 7
+
+/* How the lanes of a group run an opcode */
+enum {
+	LOCKSTEP_INTERPRET,	// one by one through the interpreter
+	LOCKSTEP_MEMORY,	// one by one, for loads, stores, stack and calls
+	LOCKSTEP_VECTOR		// 16 at a time, for registers and M operands
+};
+
+/* Returns 1 if the host can run the vector path */
+int LockstepVectorized(void)
+{
+#if LOCKSTEP_AVX2
+	return __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+}
+
+/* Returns how the lanes of a group run opcode */
+static uint8_t LockstepRunKind(uint8_t opcode, int vector)
+{
+	int dst = (opcode >> 3) & 0x07;
+	int src = opcode & 0x07;
+
+	if (opcode >= 0x40 && opcode <= 0x7F && opcode != 0x76) {
+		if (src == REGISTER_M || dst == REGISTER_M) {
+			return LOCKSTEP_MEMORY;		// MOV r,M and MOV M,r
+		}
+		return vector ? LOCKSTEP_VECTOR : LOCKSTEP_INTERPRET;
+	}
+	switch (opcode) {
+	case 0x02: case 0x12:	// STAX
+	case 0x0A: case 0x1A:	// LDAX
+	case 0x22: case 0x2A:	// SHLD, LHLD
+	case 0x32: case 0x3A:	// STA, LDA
+	case 0x36:		// MVI M
+	case 0xE3:		// XTHL
+		return LOCKSTEP_MEMORY;
+	case 0x27:		// DAA
+	case 0x76:		// HLT
+	case 0xD3: case 0xDB:	// OUT, IN
+	case 0xF3: case 0xFB:	// DI, EI
+		return LOCKSTEP_INTERPRET;
+	case 0xE9: case 0xEB: case 0xF9:	// PCHL, XCHG, SPHL
+	case 0xC3: case 0xCB:	// JMP
+		return vector ? LOCKSTEP_VECTOR : LOCKSTEP_INTERPRET;
+	}
+	/* what is left of the last quarter is the stack, calls and returns,
+	 * but for the conditional jumps and the ALU immediates */
+	if (opcode >= 0xC0 && (src == 0 || src == 1 || src == 4 || src == 5 ||
+		src == 7)) {
+		return LOCKSTEP_MEMORY;
+	}
+	return vector ? LOCKSTEP_VECTOR : LOCKSTEP_INTERPRET;
+}
+
+/* Allocates an element of size bytes for every lane and padding lane;
+ * exits on failure as the other allocations of the emulator do */
+static void *LaneArray(const struct Lockstep *lockstep, size_t size)
+{
+	void *array = calloc(lockstep->padded, size);
+
+	if (array == NULL) {
+		fprintf(stderr, "LockstepInit: malloc failed for lanes\n");
+		exit(1);
+	}
+	return array;
+}
+
+/* Takes over the count machines as the lanes of lockstep; they must be
+ * Space Invaders machines, and their memories are run by the lanes from
+ * then on. Returns 0 on success and -1 otherwise. */
+int LockstepInit(struct Lockstep *lockstep, struct State8080 *const *machines,
+	int count)
+{
+	int page;
+	int i;
+
+	if (count <= 0) {
+		fprintf(stderr, "LockstepInit: no machines\n");
+		return -1;
+	}
+	memset(lockstep, 0, sizeof(*lockstep));
+	lockstep->count = count;
+	lockstep->padded = (count + LOCKSTEP_WIDTH - 1) / LOCKSTEP_WIDTH *
+		LOCKSTEP_WIDTH;
+	lockstep->vector = LockstepVectorized();
+	for (i = 0; i < 256; i++) {
+		lockstep->run[i] = LockstepRunKind(i, lockstep->vector);
+	}
+	lockstep->a = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->flags = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->bc = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->de = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->hl = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->sp = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->pc = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->group = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->active = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->operand = LaneArray(lockstep, sizeof(uint16_t));
+	lockstep->cycles = LaneArray(lockstep, sizeof(uint64_t));
+	lockstep->int_enable = LaneArray(lockstep, sizeof(uint8_t));
+	lockstep->int_pending = LaneArray(lockstep, sizeof(uint8_t));
+	lockstep->int_vector = LaneArray(lockstep, sizeof(uint8_t));
+	lockstep->halted = LaneArray(lockstep, sizeof(uint8_t));
+	lockstep->take = LaneArray(lockstep, sizeof(uint8_t));
+	lockstep->ports = LaneArray(lockstep, sizeof(struct Ports));
+	lockstep->memory = LaneArray(lockstep, sizeof(struct Memory *));
+
+	for (i = 0; i < count; i++) {
+		struct State8080 *state = machines[i];
+
+		State8080SyncFlags(state);
+		lockstep->a[i] = state->a;
+		lockstep->flags[i] = state->flags;
+		lockstep->bc[i] = state->bc;
+		lockstep->de[i] = state->de;
+		lockstep->hl[i] = state->hl;
+		lockstep->sp[i] = state->sp;
+		lockstep->pc[i] = state->pc;
+		lockstep->cycles[i] = state->cycles;
+		lockstep->int_enable[i] = state->int_enable;
+		lockstep->int_pending[i] = state->int_pending;
+		lockstep->int_vector[i] = state->int_vector;
+		lockstep->halted[i] = state->halted;
+		lockstep->ports[i] = state->ports;
+		lockstep->memory[i] = state->memory;
+	}
+
+	/* the lanes of a group on a shared page, as the ROM is, run the same
+	 * instruction without comparing its bytes */
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		lockstep->shared[page] = 1;
+		for (i = 1; i < count; i++) {
+			if (lockstep->memory[i]->read[page] !=
+				lockstep->memory[0]->read[page]) {
+				lockstep->shared[page] = 0;
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Frees the lanes; the memories stay with their machines */
+void LockstepFree(struct Lockstep *lockstep)
+{
+	free(lockstep->a);
+	free(lockstep->flags);
+	free(lockstep->bc);
+	free(lockstep->de);
+	free(lockstep->hl);
+	free(lockstep->sp);
+	free(lockstep->pc);
+	free(lockstep->group);
+	free(lockstep->active);
+	free(lockstep->operand);
+	free(lockstep->cycles);
+	free(lockstep->int_enable);
+	free(lockstep->int_pending);
+	free(lockstep->int_vector);
+	free(lockstep->halted);
+	free(lockstep->take);
+	free(lockstep->ports);
+	free(lockstep->memory);
+	memset(lockstep, 0, sizeof(*lockstep));
+}
+
+/* Copies lane into state, which then runs it as a Space Invaders machine */
+void LockstepStore(const struct Lockstep *lockstep, int lane,
+	struct State8080 *state)
+{
+	state->a = lockstep->a[lane];
+	state->flags = lockstep->flags[lane];
+	state->lazy.op = ALU_NONE;
+	state->bc = lockstep->bc[lane];
+	state->de = lockstep->de[lane];
+	state->hl = lockstep->hl[lane];
+	state->sp = lockstep->sp[lane];
+	state->pc = lockstep->pc[lane];
+	state->cycles = lockstep->cycles[lane];
+	state->int_enable = lockstep->int_enable[lane];
+	state->int_pending = lockstep->int_pending[lane];
+	state->int_vector = lockstep->int_vector[lane];
+	state->halted = lockstep->halted[lane];
+	state->stop = 0;
+	state->ports = lockstep->ports[lane];
+	state->in = MachineIn;
+	state->out = MachineOut;
+	state->memory = lockstep->memory[lane];
+}
+
+/* Copies state back into lane after the interpreter has run it */
+static void LockstepLoad(struct Lockstep *lockstep, int lane,
+	struct State8080 *state)
+{
+	State8080SyncFlags(state);
+	lockstep->a[lane] = state->a;
+	lockstep->flags[lane] = state->flags;
+	lockstep->bc[lane] = state->bc;
+	lockstep->de[lane] = state->de;
+	lockstep->hl[lane] = state->hl;
+	lockstep->sp[lane] = state->sp;
+	lockstep->pc[lane] = state->pc;
+	lockstep->cycles[lane] = state->cycles;
+	lockstep->int_enable[lane] = state->int_enable;
+	lockstep->int_pending[lane] = state->int_pending;
+	lockstep->int_vector[lane] = state->int_vector;
+	lockstep->halted[lane] = state->halted;
+	lockstep->ports[lane] = state->ports;
+}
+
+/* Runs the next instruction of lane through the interpreter */
+static void LockstepInterpret(struct Lockstep *lockstep, int lane)
+{
+	LockstepStore(lockstep, lane, &lockstep->scratch);
+	Emulate(&lockstep->scratch);
+	LockstepLoad(lockstep, lane, &lockstep->scratch);
+}
+
+/* Requests interrupt RST n of lane as State8080Interrupt() does */
+static void LockstepInterrupt(struct Lockstep *lockstep, int lane, uint8_t n)
+{
+	LockstepStore(lockstep, lane, &lockstep->scratch);
+	State8080Interrupt(&lockstep->scratch, n);
+	LockstepLoad(lockstep, lane, &lockstep->scratch);
+}
+
+/* Returns register r of lane, B to A in opcode order, M excepted */
+static uint8_t LaneGet(const struct Lockstep *lockstep, int r, int lane)
+{
+	switch (r) {
+	case 0: return lockstep->bc[lane] >> 8;
+	case 1: return lockstep->bc[lane] & 0xFF;
+	case 2: return lockstep->de[lane] >> 8;
+	case 3: return lockstep->de[lane] & 0xFF;
+	case 4: return lockstep->hl[lane] >> 8;
+	case 5: return lockstep->hl[lane] & 0xFF;
+	default: return lockstep->a[lane];
+	}
+}
+
+/* Sets register r of lane, B to A in opcode order, M excepted */
+static void LaneSet(struct Lockstep *lockstep, int r, int lane,
+	uint8_t value)
+{
+	uint16_t *pairs[3] = { lockstep->bc, lockstep->de, lockstep->hl };
+
+	if (r == REGISTER_A) {
+		lockstep->a[lane] = value;
+	} else if (r & 1) {
+		pairs[r >> 1][lane] = (pairs[r >> 1][lane] & 0xFF00) | value;
+	} else {
+		pairs[r >> 1][lane] = (pairs[r >> 1][lane] & 0x00FF) | value << 8;
+	}
+}
+
+/* The flag tested by each pair of conditions, NZ and Z to P and M */
+static const uint8_t condition_flag[4] = { FLAG_Z, FLAG_C, FLAG_P, FLAG_S };
+
+/* Returns 1 if condition cc of a conditional jump, call or return, NZ to M
+ * in opcode order, holds for flags */
+static int LaneCondition(uint16_t flags, int cc)
+{
+	int set = (flags & condition_flag[cc >> 1]) != 0;
+
+	return (cc & 1) ? set : !set;
+}
+
+static void LanePush(struct Lockstep *lockstep, int lane, uint16_t value)
+{
+	struct Memory *memory = lockstep->memory[lane];
+
+	lockstep->sp[lane] -= 2;
+	MemoryWrite(memory, lockstep->sp[lane] + 1, value >> 8);
+	MemoryWrite(memory, lockstep->sp[lane], value & 0xFF);
+}
+
+static uint16_t LanePop(struct Lockstep *lockstep, int lane)
+{
+	struct Memory *memory = lockstep->memory[lane];
+	uint16_t value = MemoryRead(memory, lockstep->sp[lane]) |
+		MemoryRead(memory, lockstep->sp[lane] + 1) << 8;
+
+	lockstep->sp[lane] += 2;
+	return value;
+}
+
+/* Loops over the lanes of the group */
+#define FOR_GROUP(i) \
+	for (i = 0; i < lockstep->count; i++) if (lockstep->group[i])
+
+/* Runs the load, store, stack, call or return at code, found at pc, lane
+ * by lane for the lanes of the group, and returns its cycles; a taken
+ * conditional call or return adds what it takes over that itself */
+static int LockstepMemoryOp(struct Lockstep *lockstep, const uint8_t *code,
+	uint16_t pc)
+{
+	uint8_t opcode = code[0];
+	uint16_t word = code[1] | code[2] << 8;
+	uint16_t next = pc + length_table[opcode];
+	uint16_t *pairs[4] = {
+		lockstep->bc, lockstep->de, lockstep->hl, lockstep->sp
+	};
+	uint16_t *rp = pairs[(opcode >> 4) & 0x03];
+	int dst = (opcode >> 3) & 0x07;
+	int src = opcode & 0x07;
+	int extra = cycles_table[opcode].taken - cycles_table[opcode].cycles;
+	uint16_t value;
+	int i;
+
+	FOR_GROUP(i) {
+		lockstep->pc[i] = next;
+	}
+	switch (opcode) {
+	case 0x0A: case 0x1A:	// LDAX
+		FOR_GROUP(i) {
+			lockstep->a[i] = MemoryRead(lockstep->memory[i], rp[i]);
+		}
+		break;
+	case 0x02: case 0x12:	// STAX
+		FOR_GROUP(i) {
+			MemoryWrite(lockstep->memory[i], rp[i], lockstep->a[i]);
+		}
+		break;
+	case 0x2A:	// LHLD
+		FOR_GROUP(i) {
+			lockstep->hl[i] = MemoryRead(lockstep->memory[i], word) |
+				MemoryRead(lockstep->memory[i], word + 1) << 8;
+		}
+		break;
+	case 0x22:	// SHLD
+		FOR_GROUP(i) {
+			MemoryWrite(lockstep->memory[i], word, lockstep->hl[i] & 0xFF);
+			MemoryWrite(lockstep->memory[i], word + 1, lockstep->hl[i] >> 8);
+		}
+		break;
+	case 0x3A:	// LDA
+		FOR_GROUP(i) {
+			lockstep->a[i] = MemoryRead(lockstep->memory[i], word);
+		}
+		break;
+	case 0x32:	// STA
+		FOR_GROUP(i) {
+			MemoryWrite(lockstep->memory[i], word, lockstep->a[i]);
+		}
+		break;
+	case 0x36:	// MVI M
+		FOR_GROUP(i) {
+			MemoryWrite(lockstep->memory[i], lockstep->hl[i], code[1]);
+		}
+		break;
+	case 0xE3:	// XTHL
+		FOR_GROUP(i) {
+			value = LanePop(lockstep, i);
+			LanePush(lockstep, i, lockstep->hl[i]);
+			lockstep->hl[i] = value;
+		}
+		break;
+	case 0xF1:	// POP PSW
+		FOR_GROUP(i) {
+			value = LanePop(lockstep, i);
+			lockstep->flags[i] = (value & FLAGS_MASK) | FLAG_ALWAYS;
+			lockstep->a[i] = value >> 8;
+		}
+		break;
+	case 0xC1: case 0xD1: case 0xE1:	// POP
+		FOR_GROUP(i) {
+			rp[i] = LanePop(lockstep, i);
+		}
+		break;
+	case 0xF5:	// PUSH PSW
+		FOR_GROUP(i) {
+			LanePush(lockstep, i, lockstep->a[i] << 8 | lockstep->flags[i]);
+		}
+		break;
+	case 0xC5: case 0xD5: case 0xE5:	// PUSH
+		FOR_GROUP(i) {
+			LanePush(lockstep, i, rp[i]);
+		}
+		break;
+	case 0xCD: case 0xDD: case 0xED: case 0xFD:	// CALL
+		FOR_GROUP(i) {
+			LanePush(lockstep, i, next);
+			lockstep->pc[i] = word;
+		}
+		break;
+	case 0xC9: case 0xD9:	// RET
+		FOR_GROUP(i) {
+			lockstep->pc[i] = LanePop(lockstep, i);
+		}
+		break;
+	default:
+		if (opcode < 0xC0 && src == REGISTER_M) {	// MOV r,M
+			FOR_GROUP(i) {
+				LaneSet(lockstep, dst, i,
+					MemoryRead(lockstep->memory[i], lockstep->hl[i]));
+			}
+		} else if (opcode < 0xC0) {	// MOV M,r
+			FOR_GROUP(i) {
+				MemoryWrite(lockstep->memory[i], lockstep->hl[i],
+					LaneGet(lockstep, src, i));
+			}
+		} else if (src == 7) {	// RST
+			FOR_GROUP(i) {
+				LanePush(lockstep, i, next);
+				lockstep->pc[i] = dst * 8;
+			}
+		} else {	// Ccc and Rcc
+			FOR_GROUP(i) {
+				if (!LaneCondition(lockstep->flags[i], dst)) {
+					continue;
+				}
+				if (src == 4) {
+					LanePush(lockstep, i, next);
+					lockstep->pc[i] = word;
+				} else {
+					lockstep->pc[i] = LanePop(lockstep, i);
+				}
+				lockstep->cycles[i] += extra;
+			}
+		}
+		break;
+	}
+	return cycles_table[opcode].cycles;
+}
+
+#if LOCKSTEP_AVX2
+#define AVX2 __attribute__((target("avx2")))
+#define VLOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define VBLEND(p, v, mask) VSTORE(p, _mm256_blendv_epi8(VLOAD(p), (v), (mask)))
+#define VSET(n) _mm256_set1_epi16(n)
+
+/* Returns the sign, zero, parity and always-one flags of the 8-bit results
+ * in r, as the sign, zero and parity table of the interpreter gives them;
+ * the parity of a byte is that of its two nibbles, looked up 16 at a time */
+AVX2 static inline __m256i VecSzp(__m256i r)
+{
+	const __m256i odd = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+		0, FLAG_P, FLAG_P, 0, FLAG_P, 0, 0, FLAG_P,
+		FLAG_P, 0, 0, FLAG_P, 0, FLAG_P, FLAG_P, 0));
+	__m256i low = _mm256_and_si256(r, VSET(0x0F));
+	__m256i high = _mm256_and_si256(_mm256_srli_epi16(r, 4), VSET(0x0F));
+	__m256i parity = _mm256_xor_si256(_mm256_shuffle_epi8(odd, low),
+		_mm256_shuffle_epi8(odd, high));
+	__m256i zero = _mm256_cmpeq_epi16(r, _mm256_setzero_si256());
+
+	return _mm256_or_si256(
+		_mm256_or_si256(_mm256_and_si256(r, VSET(FLAG_S)),
+			_mm256_and_si256(zero, VSET(FLAG_Z))),
+		_mm256_or_si256(_mm256_andnot_si256(parity, VSET(FLAG_P)),
+			VSET(FLAG_ALWAYS)));
+}
+
+/* Returns the auxiliary carry of the operation on a and value that gave
+ * result, looked up in table by bit 3 of each as the interpreter does */
+AVX2 static inline __m256i VecAc(__m256i table, __m256i a, __m256i value,
+	__m256i result)
+{
+	const __m256i bit3 = VSET(0x08);
+	__m256i index = _mm256_or_si256(
+		_mm256_or_si256(_mm256_srli_epi16(_mm256_and_si256(a, bit3), 1),
+			_mm256_srli_epi16(_mm256_and_si256(value, bit3), 2)),
+		_mm256_srli_epi16(_mm256_and_si256(result, bit3), 3));
+
+	return _mm256_and_si256(_mm256_shuffle_epi8(table, index), VSET(0xFF));
+}
+
+/* Returns register r of the 16 lanes from lane, B to A in opcode order,
+ * M being the operand gathered for them */
+AVX2 static inline __m256i VecGet(const struct Lockstep *lockstep, int r,
+	int lane)
+{
+	switch (r) {
+	case 0: return _mm256_srli_epi16(VLOAD(lockstep->bc + lane), 8);
+	case 1: return _mm256_and_si256(VLOAD(lockstep->bc + lane), VSET(0xFF));
+	case 2: return _mm256_srli_epi16(VLOAD(lockstep->de + lane), 8);
+	case 3: return _mm256_and_si256(VLOAD(lockstep->de + lane), VSET(0xFF));
+	case 4: return _mm256_srli_epi16(VLOAD(lockstep->hl + lane), 8);
+	case 5: return _mm256_and_si256(VLOAD(lockstep->hl + lane), VSET(0xFF));
+	case REGISTER_M: return VLOAD(lockstep->operand + lane);
+	default: return VLOAD(lockstep->a + lane);
+	}
+}
+
+/* Sets register r of the lanes in mask among the 16 from lane */
+AVX2 static inline void VecSet(struct Lockstep *lockstep, int r, int lane,
+	__m256i value, __m256i mask)
+{
+	uint16_t *pairs[3] = { lockstep->bc, lockstep->de, lockstep->hl };
+	__m256i old;
+
+	if (r == REGISTER_A) {
+		VBLEND(lockstep->a + lane, value, mask);
+		return;
+	}
+	if (r == REGISTER_M) {
+		VBLEND(lockstep->operand + lane, value, mask);
+		return;
+	}
+	old = VLOAD(pairs[r >> 1] + lane);
+	if (r & 1) {
+		value = _mm256_or_si256(_mm256_and_si256(old, VSET(0xFF00)), value);
+	} else {
+		value = _mm256_or_si256(_mm256_and_si256(old, VSET(0x00FF)),
+			_mm256_slli_epi16(value, 8));
+	}
+	VSTORE(pairs[r >> 1] + lane, _mm256_blendv_epi8(old, value, mask));
+}
+
+/* Runs the instruction on registers, or on M as an ALU operand or by INR
+ * and DCR, at code, found at pc, in vector lanes for the lanes of the group;
+ * the cycles are left to the caller */
+AVX2 static void LockstepVector(struct Lockstep *lockstep, const uint8_t *code,
+	uint16_t pc)
+{
+	const __m256i add_ac = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+		0, 0, FLAG_AC, 0, FLAG_AC, 0, FLAG_AC, FLAG_AC,
+		0, 0, 0, 0, 0, 0, 0, 0));
+	const __m256i sub_ac = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+		FLAG_AC, 0, 0, 0, FLAG_AC, FLAG_AC, FLAG_AC, 0,
+		0, 0, 0, 0, 0, 0, 0, 0));
+	const __m256i one = VSET(1);
+	const __m256i byte = VSET(0xFF);
+	uint8_t opcode = code[0];
+	uint16_t word = code[1] | code[2] << 8;
+	uint16_t next = pc + length_table[opcode];
+	uint16_t *pairs[4] = {
+		lockstep->bc, lockstep->de, lockstep->hl, lockstep->sp
+	};
+	int dst = (opcode >> 3) & 0x07;
+	int src = opcode & 0x07;
+	int pair = (opcode >> 4) & 0x03;
+	int alu = opcode >= 0x80 && (opcode < 0xC0 || src == 6) ? dst : -1;
+	int step = opcode < 0x40 && (src == 4 || src == 5);	// INR, DCR
+	int on_m = (alu >= 0 && opcode < 0xC0 && src == REGISTER_M) ||
+		(step && dst == REGISTER_M);
+	int i;
+
+	if (on_m) {
+		FOR_GROUP(i) {
+			lockstep->operand[i] = MemoryRead(lockstep->memory[i],
+				lockstep->hl[i]);
+		}
+	}
+
+	for (i = 0; i < lockstep->padded; i += LOCKSTEP_WIDTH) {
+		__m256i mask = VLOAD(lockstep->group + i);
+		__m256i new_pc = VSET(next);
+		__m256i flags = VLOAD(lockstep->flags + i);
+		__m256i a;
+		__m256i value;
+		__m256i result;
+		__m256i carry;
+
+		if (_mm256_testz_si256(mask, mask)) {
+			continue;
+		}
+
+		if (alu >= 0) {
+			a = VLOAD(lockstep->a + i);
+			carry = _mm256_and_si256(flags, one);
+			value = opcode >= 0xC0 ? VSET(code[1]) :
+				VecGet(lockstep, src, i);
+			switch (alu) {
+			case 0: case 1:	// ADD, ADC
+				result = _mm256_add_epi16(a, value);
+				if (alu == 1) {
+					result = _mm256_add_epi16(result, carry);
+				}
+				flags = _mm256_or_si256(_mm256_or_si256(
+					VecSzp(_mm256_and_si256(result, byte)),
+					_mm256_srli_epi16(result, 8)),
+					VecAc(add_ac, a, value, result));
+				break;
+			case 2: case 3: case 7:	// SUB, SBB, CMP
+				/* adds the complement, as the interpreter does */
+				result = _mm256_add_epi16(_mm256_add_epi16(a,
+					_mm256_xor_si256(value, byte)),
+					alu == 3 ? _mm256_xor_si256(carry, one) : one);
+				flags = _mm256_or_si256(_mm256_or_si256(
+					VecSzp(_mm256_and_si256(result, byte)),
+					_mm256_xor_si256(_mm256_srli_epi16(result, 8), one)),
+					VecAc(sub_ac, a, value, result));
+				if (alu == 7) {
+					result = a;
+				}
+				break;
+			case 4:	// ANA
+				result = _mm256_and_si256(a, value);
+				flags = _mm256_or_si256(VecSzp(result),
+					_mm256_and_si256(_mm256_slli_epi16(
+					_mm256_or_si256(a, value), 1), VSET(FLAG_AC)));
+				break;
+			default:	// XRA, ORA
+				result = alu == 5 ? _mm256_xor_si256(a, value) :
+					_mm256_or_si256(a, value);
+				flags = VecSzp(result);
+				break;
+			}
+			VBLEND(lockstep->a + i, _mm256_and_si256(result, byte), mask);
+			VBLEND(lockstep->flags + i, flags, mask);
+		} else if (opcode >= 0x40) {	// MOV, JMP, JCC, PCHL, XCHG, SPHL
+			if (opcode < 0x80) {
+				VecSet(lockstep, dst, i, VecGet(lockstep, src, i), mask);
+			} else if (opcode == 0xC3 || opcode == 0xCB) {
+				new_pc = VSET(word);
+			} else if (opcode == 0xE9) {
+				new_pc = VLOAD(lockstep->hl + i);
+			} else if (opcode == 0xEB) {
+				__m256i de = VLOAD(lockstep->de + i);
+				__m256i hl = VLOAD(lockstep->hl + i);
+
+				VBLEND(lockstep->de + i, hl, mask);
+				VBLEND(lockstep->hl + i, de, mask);
+			} else if (opcode == 0xF9) {
+				VBLEND(lockstep->sp + i, VLOAD(lockstep->hl + i), mask);
+			} else {
+				__m256i clear = _mm256_cmpeq_epi16(_mm256_and_si256(flags,
+					VSET(condition_flag[dst >> 1])), _mm256_setzero_si256());
+
+				/* JNZ, JNC, JPO and JP jump when their flag is clear */
+				new_pc = (dst & 1) ?
+					_mm256_blendv_epi8(VSET(word), new_pc, clear) :
+					_mm256_blendv_epi8(new_pc, VSET(word), clear);
+			}
+		} else if (step) {
+			value = VecGet(lockstep, dst, i);
+			if (src == 4) {
+				result = _mm256_and_si256(_mm256_add_epi16(value, one), byte);
+				carry = VecAc(add_ac, value, _mm256_setzero_si256(), result);
+			} else {
+				result = _mm256_and_si256(_mm256_sub_epi16(value, one), byte);
+				carry = VecAc(sub_ac, value, _mm256_setzero_si256(), result);
+			}
+			/* carry holds the auxiliary carry; the carry stays as it was */
+			VBLEND(lockstep->flags + i, _mm256_or_si256(_mm256_or_si256(
+				_mm256_and_si256(flags, one), VecSzp(result)), carry), mask);
+			VecSet(lockstep, dst, i, result, mask);
+		} else if (src == 6) {	// MVI
+			VecSet(lockstep, dst, i, VSET(code[1]), mask);
+		} else if (src == 1 && !(opcode & 0x08)) {	// LXI
+			VBLEND(pairs[pair] + i, VSET(word), mask);
+		} else if (src == 1) {	// DAD
+			__m256i hl = VLOAD(lockstep->hl + i);
+
+			value = VLOAD(pairs[pair] + i);
+			result = _mm256_add_epi16(hl, value);
+			carry = _mm256_srli_epi16(_mm256_or_si256(
+				_mm256_and_si256(hl, value), _mm256_andnot_si256(result,
+				_mm256_or_si256(hl, value))), 15);
+			VBLEND(lockstep->hl + i, result, mask);
+			VBLEND(lockstep->flags + i, _mm256_or_si256(
+				_mm256_andnot_si256(one, flags), carry), mask);
+		} else if (src == 3) {	// INX, DCX
+			value = VLOAD(pairs[pair] + i);
+			VBLEND(pairs[pair] + i, (opcode & 0x08) ?
+				_mm256_sub_epi16(value, one) :
+				_mm256_add_epi16(value, one), mask);
+		} else if (src == 7) {	// RLC, RRC, RAL, RAR, CMA, STC, CMC
+			a = VLOAD(lockstep->a + i);
+			carry = _mm256_and_si256(flags, one);
+			switch (dst) {
+			case 0:	// RLC
+				carry = _mm256_srli_epi16(a, 7);
+				result = _mm256_and_si256(_mm256_or_si256(
+					_mm256_slli_epi16(a, 1), carry), byte);
+				break;
+			case 1:	// RRC
+				carry = _mm256_and_si256(a, one);
+				result = _mm256_or_si256(_mm256_srli_epi16(a, 1),
+					_mm256_slli_epi16(carry, 7));
+				break;
+			case 2:	// RAL
+				result = _mm256_and_si256(_mm256_or_si256(
+					_mm256_slli_epi16(a, 1), carry), byte);
+				carry = _mm256_srli_epi16(a, 7);
+				break;
+			case 3:	// RAR
+				result = _mm256_or_si256(_mm256_srli_epi16(a, 1),
+					_mm256_slli_epi16(carry, 7));
+				carry = _mm256_and_si256(a, one);
+				break;
+			case 5:	// CMA
+				result = _mm256_xor_si256(a, byte);
+				break;
+			case 6:	// STC
+				result = a;
+				carry = one;
+				break;
+			default:	// CMC
+				result = a;
+				carry = _mm256_xor_si256(carry, one);
+				break;
+			}
+			VBLEND(lockstep->a + i, result, mask);
+			VBLEND(lockstep->flags + i, _mm256_or_si256(
+				_mm256_andnot_si256(one, flags), carry), mask);
+		}
+		/* and NOP changes nothing but the program counter */
+
+		VBLEND(lockstep->pc + i, new_pc, mask);
+	}
+
+	if (on_m && step) {
+		FOR_GROUP(i) {
+			MemoryWrite(lockstep->memory[i], lockstep->hl[i],
+				lockstep->operand[i]);
+		}
+	}
+}
+
+/* Puts the active lanes whose program counter is pc in the group, 16 at a
+ * time, and returns how many there are */
+AVX2 static int LockstepGroupVector(struct Lockstep *lockstep, uint16_t pc)
+{
+	__m256i target = VSET(pc);
+	int count = 0;
+	int i;
+
+	for (i = 0; i < lockstep->padded; i += LOCKSTEP_WIDTH) {
+		__m256i mask = _mm256_and_si256(VLOAD(lockstep->active + i),
+			_mm256_cmpeq_epi16(VLOAD(lockstep->pc + i), target));
+
+		VSTORE(lockstep->group + i, mask);
+		count += __builtin_popcount(_mm256_movemask_epi8(mask)) / 2;
+	}
+	return count;
+}
+
+/* Adds cycles to the cycle counters of the lanes of the group and marks
+ * those reaching deadline as done, four counters at a time */
+AVX2 static void LockstepAdvanceVector(struct Lockstep *lockstep, int cycles,
+	uint64_t deadline)
+{
+	const __m256i bits = _mm256_setr_epi16(0x0001, 0x0002, 0x0004, 0x0008,
+		0x0010, 0x0020, 0x0040, 0x0080, 0x0100, 0x0200, 0x0400, 0x0800,
+		0x1000, 0x2000, 0x4000, (short)0x8000);
+	__m256i add = _mm256_set1_epi64x(cycles);
+	__m256i limit = _mm256_set1_epi64x(deadline);
+	int i;
+	int j;
+
+	for (i = 0; i < lockstep->padded; i += LOCKSTEP_WIDTH) {
+		__m256i mask = VLOAD(lockstep->group + i);
+		int running = 0;
+
+		if (_mm256_testz_si256(mask, mask)) {
+			continue;
+		}
+		for (j = 0; j < LOCKSTEP_WIDTH; j += 4) {
+			__m256i wide = _mm256_cvtepi16_epi64(_mm_loadl_epi64(
+				(const __m128i *)(lockstep->group + i + j)));
+			__m256i counter = _mm256_add_epi64(
+				VLOAD(lockstep->cycles + i + j), _mm256_and_si256(wide, add));
+
+			VSTORE(lockstep->cycles + i + j, counter);
+			running |= _mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpgt_epi64(limit, counter))) << j;
+		}
+		/* spreads the bit of each lane still running over its slot */
+		VBLEND(lockstep->active + i, _mm256_cmpeq_epi16(_mm256_and_si256(
+			VSET(running), bits), bits), mask);
+	}
+}
+#endif
+
+/* Puts the active lanes whose next instruction is that of leader in the
+ * group and returns how many there are. The instruction is the same when
+ * the program counter is, as long as its bytes are on pages all lanes
+ * share or are the same in every lane. */
+static int LockstepGroup(struct Lockstep *lockstep, int leader)
+{
+	uint16_t pc = lockstep->pc[leader];
+	uint16_t end = pc + 2;
+	uint8_t fetched[MEMORY_FETCH_SIZE];
+	uint8_t theirs[MEMORY_FETCH_SIZE];
+	const uint8_t *code = MemoryFetch(lockstep->memory[leader], pc, fetched);
+	int length = length_table[code[0]];
+	int count = 0;
+	int i;
+
+	if (lockstep->shared[pc >> 8] && lockstep->shared[end >> 8]) {
+#if LOCKSTEP_AVX2
+		if (lockstep->vector) {
+			return LockstepGroupVector(lockstep, pc);
+		}
+#endif
+		for (i = 0; i < lockstep->count; i++) {
+			lockstep->group[i] = lockstep->pc[i] == pc ?
+				lockstep->active[i] : 0;
+			count += lockstep->group[i] != 0;
+		}
+		return count;
+	}
+
+	for (i = 0; i < lockstep->count; i++) {
+		int same = lockstep->active[i] && lockstep->pc[i] == pc &&
+			memcmp(MemoryFetch(lockstep->memory[i], pc, theirs), code,
+			length) == 0;
+
+		lockstep->group[i] = same ? 0xFFFF : 0;
+		count += same;
+	}
+	return count;
+}
+
+/* Marks lane as running until deadline or not; a halted lane idles until
+ * the deadline as Run8080() has it do */
+static void LockstepUpdate(struct Lockstep *lockstep, int lane,
+	uint64_t deadline)
+{
+	if (lockstep->halted[lane] && lockstep->cycles[lane] < deadline) {
+		lockstep->cycles[lane] = deadline;
+	}
+	lockstep->active[lane] = lockstep->cycles[lane] < deadline ||
+		lockstep->take[lane] ? 0xFFFF : 0;
+}
+
+/* Runs the next instruction of the group led by leader */
+static void LockstepStep(struct Lockstep *lockstep, int leader,
+	uint64_t deadline)
+{
+	uint16_t pc = lockstep->pc[leader];
+	uint8_t fetched[MEMORY_FETCH_SIZE];
+	const uint8_t *code = MemoryFetch(lockstep->memory[leader], pc, fetched);
+	int run = lockstep->run[code[0]];
+	int count = LockstepGroup(lockstep, leader);
+	int cycles = 0;
+	int i;
+
+	lockstep->steps++;
+	switch (run) {
+#if LOCKSTEP_AVX2
+	case LOCKSTEP_VECTOR:
+		LockstepVector(lockstep, code, pc);
+		cycles = cycles_table[code[0]].cycles;
+		lockstep->vector_ops += count;
+		break;
+#endif
+	case LOCKSTEP_MEMORY:
+		cycles = LockstepMemoryOp(lockstep, code, pc);
+		lockstep->memory_ops += count;
+		break;
+	default:
+		/* the interpreter counts the cycles of what it runs */
+		FOR_GROUP(i) {
+			LockstepInterpret(lockstep, i);
+		}
+		lockstep->interpreted_ops += count;
+		break;
+	}
+
+	/* only the interpreter halts a lane or enables interrupts */
+	if (run != LOCKSTEP_INTERPRET && lockstep->takes == 0) {
+#if LOCKSTEP_AVX2
+		if (lockstep->vector) {
+			LockstepAdvanceVector(lockstep, cycles, deadline);
+			return;
+		}
+#endif
+		FOR_GROUP(i) {
+			lockstep->cycles[i] += cycles;
+			lockstep->active[i] = lockstep->cycles[i] < deadline ? 0xFFFF : 0;
+		}
+		return;
+	}
+
+	/* EI with an interrupt waiting lets one more instruction run before
+	 * the interrupt is taken, as in MachineRun() */
+	FOR_GROUP(i) {
+		lockstep->cycles[i] += cycles;
+		if (lockstep->take[i]) {
+			lockstep->take[i] = 0;
+			lockstep->takes--;
+			LockstepInterrupt(lockstep, i, lockstep->int_vector[i]);
+		} else if (lockstep->int_pending[i] && lockstep->int_enable[i]) {
+			lockstep->take[i] = 1;
+			lockstep->takes++;
+		}
+		LockstepUpdate(lockstep, i, deadline);
+	}
+}
+
+/* Runs every lane until its cycle counter reaches deadline; a lane that
+ * stops running does not start again, so the leader only moves on */
+static void LockstepRunUntil(struct Lockstep *lockstep, uint64_t deadline)
+{
+	int leader = 0;
+	int i;
+
+	for (i = 0; i < lockstep->count; i++) {
+		LockstepUpdate(lockstep, i, deadline);
+	}
+	for (;;) {
+		while (leader < lockstep->count && !lockstep->active[leader]) {
+			leader++;
+		}
+		if (leader == lockstep->count) {
+			break;
+		}
+		LockstepStep(lockstep, leader, deadline);
+	}
+}
+
+/* Runs frame frame of every lane, taking the screen interrupts where
+ * MachineRun() takes them in a machine started at cycle 0: RST 1 in the
+ * middle of the frame and RST 2 at its end */
+void LockstepRunFrame(struct Lockstep *lockstep, int frame)
+{
+	uint64_t start = (uint64_t)frame * CYCLES_PER_FRAME;
+	int i;
+
+	LockstepRunUntil(lockstep, start + CYCLES_PER_FRAME / 2);
+	for (i = 0; i < lockstep->count; i++) {
+		LockstepInterrupt(lockstep, i, MID_SCREEN_RST);
+	}
+	LockstepRunUntil(lockstep, start + CYCLES_PER_FRAME);
+	for (i = 0; i < lockstep->count; i++) {
+		LockstepInterrupt(lockstep, i, END_SCREEN_RST);
+	}
+}
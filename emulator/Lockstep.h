@@ -0,0 +1,64 @@
+/* Lockstep.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Experimental engine stepping many Space Invaders machines in lockstep, their
+ * registers kept in structure-of-arrays layout.
+ */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include "State8080.h"
+
+#define LOCKSTEP_WIDTH 16	// lanes in one AVX2 vector of 16-bit registers
+
+/* The machines of a lockstep run, one lane each. Every register is held in
+ * a 16-bit slot so that one vector covers the same register of 16 lanes;
+ * the arrays are padded to a whole number of vectors with lanes that never
+ * run. The lanes whose program counter is the same run each instruction
+ * together: an instruction on registers only in vector lanes, a load or
+ * store lane by lane, and anything else through the interpreter. */
+typedef struct Lockstep {
+	int count;		// lanes
+	int padded;		// lanes rounded up to a whole vector
+	int vector;		// the host runs the vector path
+	uint8_t run[256];	// how each opcode is run, LOCKSTEP_VECTOR and so on
+	uint16_t *a;
+	uint16_t *flags;	// FLAG_S to FLAG_C as in the low byte of PSW
+	uint16_t *bc;
+	uint16_t *de;
+	uint16_t *hl;
+	uint16_t *sp;
+	uint16_t *pc;
+	uint16_t *group;	// 0xFFFF for the lanes running the current step
+	uint16_t *active;	// 0xFFFF for the lanes still running to the deadline
+	uint16_t *operand;	// the byte at HL for a vector instruction on M
+	uint64_t *cycles;
+	uint8_t *int_enable;
+	uint8_t *int_pending;
+	uint8_t *int_vector;
+	uint8_t *halted;
+	uint8_t *take;		// an interrupt is taken after the next instruction
+	int takes;		// lanes with take set
+	struct Ports *ports;
+	struct Memory **memory;
+	uint8_t shared[MEMORY_PAGES];	// every lane reads the page from one place
+	struct State8080 scratch;	// a lane run by the interpreter
+
+	/* statistics for the benchmark */
+	uint64_t steps;		// instructions run for a group of lanes
+	uint64_t vector_ops;	// lane instructions run in vector lanes
+	uint64_t memory_ops;	// lane instructions run lane by lane
+	uint64_t interpreted_ops;	// lane instructions left to the interpreter
+} Lockstep;
+
+int LockstepInit(struct Lockstep *lockstep, struct State8080 *const *machines,
+	int count);
+void LockstepFree(struct Lockstep *lockstep);
+void LockstepStore(const struct Lockstep *lockstep, int lane,
+	struct State8080 *state);
+void LockstepRunFrame(struct Lockstep *lockstep, int frame);
+int LockstepVectorized(void);
+
+#endif
@@ -0,0 +1,305 @@
+/* Memory.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Maps the 64 KiB address space of the 8080 in 256-byte pages.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Memory.h"
+
+/* the split ROM files in the order of their offsets */
+static const char *const rom_parts[ROM_PARTS] = {
+	"invaders.h", "invaders.g", "invaders.f", "invaders.e"
+};
+
+/* Reads size bytes from the start of the file at path into buffer; returns
+ * 0 on success and -1 when the file cannot be read or is shorter */
+static int RomReadPart(const char *path, uint8_t *buffer, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	size_t total = 0;
+
+	if (fd < 0) {
+		fprintf(stderr, "RomOpen: cannot open %s\n", path);
+		return -1;
+	}
+	while (total < size) {
+		ssize_t got = read(fd, buffer + total, size - total);
+
+		if (got < 0) {
+			fprintf(stderr, "RomOpen: cannot read %s\n", path);
+			close(fd);
+			return -1;
+		}
+		if (got == 0) {
+			break;
+		}
+		total += got;
+	}
+	close(fd);
+	if (total < size) {
+		fprintf(stderr, "RomOpen: %s is %zu bytes, expected %zu\n", path,
+			total, size);
+		return -1;
+	}
+	return 0;
+}
+
+/* Maps the ROM at path, which is either a single image or a directory
+ * holding invaders.h, .g, .f and .e; returns 0 on success and -1 otherwise.
+ * A single image must be at least ROM_SIZE bytes and is mapped straight
+ * from the file. The split files must be 2 KiB each, smaller than a host
+ * page, so they cannot be mapped at their offsets and are read into the
+ * mapping instead. */
+int RomOpen(struct Rom *rom, const char *path)
+{
+	struct stat st;
+	int fd;
+	int i;
+
+	rom->size = ROM_SIZE;
+	rom->image = mmap(NULL, rom->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rom->image == MAP_FAILED) {
+		fprintf(stderr, "RomOpen: cannot map memory\n");
+		rom->image = NULL;
+		return -1;
+	}
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "RomOpen: cannot find %s\n", path);
+		RomClose(rom);
+		return -1;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		for (i = 0; i < ROM_PARTS; i++) {
+			char part[4096];
+
+			snprintf(part, sizeof(part), "%s/%s", path, rom_parts[i]);
+			if (RomReadPart(part, rom->image + i * ROM_PART_SIZE,
+				ROM_PART_SIZE) != 0) {
+				RomClose(rom);
+				return -1;
+			}
+		}
+	} else if (st.st_size < ROM_SIZE) {
+		fprintf(stderr, "RomOpen: %s is %lld bytes, expected %d\n", path,
+			(long long)st.st_size, ROM_SIZE);
+		RomClose(rom);
+		return -1;
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || mmap(rom->image, ROM_SIZE, PROT_READ,
+			MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			fprintf(stderr, "RomOpen: cannot map %s\n", path);
+			if (fd >= 0) {
+				close(fd);
+			}
+			RomClose(rom);
+			return -1;
+		}
+		close(fd);
+	}
+
+	mprotect(rom->image, rom->size, PROT_READ);
+	return 0;
+}
+
+/* Unmaps the ROM; a ROM that RomOpen() failed on is left alone */
+void RomClose(struct Rom *rom)
+{
+	if (rom->image != NULL) {
+		munmap(rom->image, rom->size);
+	}
+	rom->image = NULL;
+}
+
+/* Points page at host and gives it type */
+static void MemoryMapPage(struct Memory *memory, int page, uint8_t *host,
+	int type)
+{
+	memory->read[page] = host;
+	memory->write[page] = type == PAGE_ROM ? memory->discard : host;
+	memory->type[page] = type;
+	memory->watched[page] = 0;
+	memory->dirty[page] = 0;
+}
+
+/* Allocates the arena and lays out map; returns 0 on success and -1 when the
+ * arena cannot be allocated or map is unknown. The flat map is 64 KiB of
+ * arena. On Space Invaders the arena holds only RAM and VRAM, and the ROM
+ * has a backing of its own until MemoryMapRom() replaces it with an image
+ * that many memories can share. */
+int MemoryInit(struct Memory *memory, int map)
+{
+	int page;
+
+	memory->arena = NULL;
+	memory->rom = NULL;
+	memory->watch = NULL;
+	memory->watch_data = NULL;
+	switch (map) {
+	case MEMORY_MAP_FLAT:
+		memory->arena = calloc(1, MEMORY_SIZE);
+		break;
+	case MEMORY_MAP_INVADERS:
+		memory->arena = calloc(1, MIRROR_START - RAM_START);
+		memory->rom = calloc(1, ROM_SIZE);
+		break;
+	default:
+		fprintf(stderr, "MemoryInit: unknown memory map %d\n", map);
+		return -1;
+	}
+	if (memory->arena == NULL ||
+		(map == MEMORY_MAP_INVADERS && memory->rom == NULL)) {
+		fprintf(stderr, "MemoryInit: cannot allocate memory\n");
+		MemoryFree(memory);
+		return -1;
+	}
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		int address = page * MEMORY_PAGE_SIZE;
+		int decoded = address & MIRROR_MASK;
+		uint8_t *ram = memory->arena + decoded - RAM_START;
+
+		if (map == MEMORY_MAP_FLAT) {
+			MemoryMapPage(memory, page, memory->arena + address, PAGE_RAM);
+		} else if (decoded < RAM_START) {
+			/* a mirror of ROM is just as read-only */
+			MemoryMapPage(memory, page, memory->rom + decoded, PAGE_ROM);
+		} else if (address >= MIRROR_START) {
+			MemoryMapPage(memory, page, ram, PAGE_MIRROR);
+		} else if (address >= VRAM_START) {
+			MemoryMapPage(memory, page, ram, PAGE_VRAM);
+		} else {
+			MemoryMapPage(memory, page, ram, PAGE_RAM);
+		}
+	}
+	return 0;
+}
+
+/* Points the ROM pages of the memory, and their mirrors, at image, which
+ * must outlive the memory, and releases their own backing */
+void MemoryMapRom(struct Memory *memory, const uint8_t *image)
+{
+	int page;
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		int address = (page * MEMORY_PAGE_SIZE) & MIRROR_MASK;
+
+		if (memory->type[page] == PAGE_ROM && address < ROM_SIZE) {
+			memory->read[page] = (uint8_t *)image + address;
+		}
+	}
+	free(memory->rom);
+	memory->rom = NULL;
+}
+
+/* Releases the arena and the backing of the ROM */
+void MemoryFree(struct Memory *memory)
+{
+	free(memory->arena);
+	free(memory->rom);
+	memory->arena = NULL;
+	memory->rom = NULL;
+}
+
+/* Copies size bytes of data to address, ROM included unless it is a shared
+ * image; returns 0 on success and -1 when the data would run past the end of
+ * the address space */
+int MemoryLoad(struct Memory *memory, uint16_t address, const void *data,
+	size_t size)
+{
+	const uint8_t *bytes = data;
+	size_t i;
+
+	if (address + size > MEMORY_SIZE) {
+		fprintf(stderr, "MemoryLoad: %zu bytes do not fit at 0x%04x\n",
+			size, address);
+		return -1;
+	}
+	for (i = 0; i < size; i++) {
+		uint16_t at = address + i;
+		memory->read[at >> 8][at & 0xFF] = bytes[i];
+	}
+	return 0;
+}
+
+/* Watches page for reason, or stops watching it for reason; its writes take
+ * the slow path while any reason is left and the fast path once none is */
+void MemoryWatchPage(struct Memory *memory, int page, int reason,
+	int watched)
+{
+	if (watched) {
+		memory->watched[page] |= reason;
+	} else {
+		memory->watched[page] &= ~reason;
+	}
+	if (memory->watched[page]) {
+		memory->write[page] = NULL;
+	} else if (memory->type[page] == PAGE_ROM) {
+		memory->write[page] = memory->discard;
+	} else {
+		memory->write[page] = memory->read[page];
+	}
+}
+
+/* Marks page dirty after it was rewritten behind the back of memory, as a
+ * restore does, and tells the watch if code was decoded from it */
+void MemoryRewritten(struct Memory *memory, int page)
+{
+	if (!memory->dirty[page]) {
+		memory->dirty[page] = 1;
+		MemoryWatchPage(memory, page, MEMORY_WATCH_DIRTY, 0);
+	}
+	if ((memory->watched[page] & MEMORY_WATCH_CODE) && memory->watch != NULL) {
+		memory->watch(memory, page * MEMORY_PAGE_SIZE, memory->watch_data);
+	}
+}
+
+/* Clears the dirty mark of every page and watches the writable ones, so that
+ * the first write to a page since then marks it and every page mapping the
+ * same host memory; later writes to it take the fast path again */
+void MemoryClearDirty(struct Memory *memory)
+{
+	int page;
+
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		memory->dirty[page] = 0;
+		if (memory->type[page] != PAGE_ROM) {
+			MemoryWatchPage(memory, page, MEMORY_WATCH_DIRTY, 1);
+		}
+	}
+}
+
+/* Writes value to a watched page */
+void MemoryWriteSlow(struct Memory *memory, uint16_t address, uint8_t value)
+{
+	int page = address >> 8;
+	uint8_t *host = memory->read[page];
+	int reasons = memory->watched[page];
+
+	if (memory->type[page] == PAGE_ROM) {
+		return;
+	}
+	host[address & 0xFF] = value;
+	if (reasons & MEMORY_WATCH_DIRTY) {
+		int alias;
+
+		for (alias = 0; alias < MEMORY_PAGES; alias++) {
+			if (memory->read[alias] == host) {
+				memory->dirty[alias] = 1;
+				MemoryWatchPage(memory, alias, MEMORY_WATCH_DIRTY, 0);
+			}
+		}
+	}
+	if ((reasons & MEMORY_WATCH_CODE) && memory->watch != NULL) {
+		memory->watch(memory, address, memory->watch_data);
+	}
+}
@@ -0,0 +1,129 @@
+/* Memory.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Maps the 64 KiB address space of the 8080 in 256-byte pages.
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEMORY_SIZE 0x10000
+#define MEMORY_PAGE_SIZE 0x100
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+#define MEMORY_FETCH_SIZE 3	// bytes of the longest instruction
+
+/* kinds of pages in a memory map */
+#define PAGE_ROM 0	// read-only, mirrors of ROM included; writes are discarded
+#define PAGE_RAM 1
+#define PAGE_VRAM 2	// RAM scanned out by the video hardware
+#define PAGE_MIRROR 3	// another view of the page at a lower address
+
+/* reasons for watching a page; the page takes the slow path while it has any */
+#define MEMORY_WATCH_CODE 0x01	// code was decoded from it; calls the watch
+#define MEMORY_WATCH_DIRTY 0x02	// its first write since MemoryClearDirty()
+
+/* memory maps */
+#define MEMORY_MAP_FLAT 0	// 64 KiB of RAM, as CP/M programs expect
+#define MEMORY_MAP_INVADERS 1	// Space Invaders ROM, RAM, VRAM and mirrors
+
+/* the Space Invaders memory map; only address lines A0-A13 are decoded, so
+ * everything from 0x4000 up mirrors the first 16 KiB */
+#define ROM_START 0x0000
+#define ROM_SIZE 0x2000
+#define RAM_START 0x2000
+#define VRAM_START 0x2400
+#define VRAM_SIZE 0x1C00
+#define MIRROR_START 0x4000
+#define MIRROR_MASK 0x3FFF
+
+/* the Space Invaders ROM is often split in four 2 KiB files */
+#define ROM_PARTS 4
+#define ROM_PART_SIZE 0x800
+
+struct Memory;
+
+/* Called after a write lands on a page watched for MEMORY_WATCH_CODE */
+typedef void (*WriteWatch)(struct Memory *memory, uint16_t address,
+	void *data);
+
+typedef struct Memory {
+	/* host address of each page for reads, and for writes; the write entry
+	 * of a ROM page is the discard page and that of a watched page is NULL
+	 * so that its writes take the slow path */
+	uint8_t *read[MEMORY_PAGES];
+	uint8_t *write[MEMORY_PAGES];
+	uint8_t type[MEMORY_PAGES];
+	uint8_t watched[MEMORY_PAGES];	// MEMORY_WATCH_CODE and so on
+	uint8_t dirty[MEMORY_PAGES];	// written since MemoryClearDirty()
+	uint8_t *arena;		// the RAM, all 64 KiB of it on the flat map
+	uint8_t *rom;		// the ROM until an image is mapped, or NULL
+	WriteWatch watch;
+	void *watch_data;	// passed to watch
+	uint8_t discard[MEMORY_PAGE_SIZE];
+} Memory;
+
+/* A read-only ROM image mapped into the host address space; a ROM read from
+ * a single file is shared with the page cache and every other process
+ * mapping the same file */
+typedef struct Rom {
+	uint8_t *image;
+	size_t size;		// size of the mapping
+} Rom;
+
+int RomOpen(struct Rom *rom, const char *path);
+void RomClose(struct Rom *rom);
+
+int MemoryInit(struct Memory *memory, int map);
+void MemoryMapRom(struct Memory *memory, const uint8_t *image);
+void MemoryFree(struct Memory *memory);
+int MemoryLoad(struct Memory *memory, uint16_t address, const void *data,
+	size_t size);
+void MemoryWatchPage(struct Memory *memory, int page, int reason,
+	int watched);
+void MemoryRewritten(struct Memory *memory, int page);
+void MemoryClearDirty(struct Memory *memory);
+void MemoryWriteSlow(struct Memory *memory, uint16_t address, uint8_t value);
+
+/* Reads the byte at address */
+static inline uint8_t MemoryRead(const struct Memory *memory, uint16_t address)
+{
+	return memory->read[address >> 8][address & 0xFF];
+}
+
+/* Writes value to the byte at address; writes to ROM land on the discard
+ * page, and only watched pages take the slow path */
+static inline void MemoryWrite(struct Memory *memory, uint16_t address,
+	uint8_t value)
+{
+	uint8_t *page = memory->write[address >> 8];
+
+	if (page != NULL) {
+		page[address & 0xFF] = value;
+	} else {
+		MemoryWriteSlow(memory, address, value);
+	}
+}
+
+/* Returns a pointer to the MEMORY_FETCH_SIZE bytes of the instruction at
+ * address. They are read in place when they are all on its page; otherwise
+ * the next page may be anywhere in host memory, or wrap around to page 0,
+ * so they are copied into buffer, which must hold MEMORY_FETCH_SIZE bytes,
+ * as MemoryRead() gives them. */
+static inline const uint8_t *MemoryFetch(const struct Memory *memory,
+	uint16_t address, uint8_t *buffer)
+{
+	int i;
+
+	if ((address & 0xFF) + MEMORY_FETCH_SIZE <= MEMORY_PAGE_SIZE) {
+		return &memory->read[address >> 8][address & 0xFF];
+	}
+	for (i = 0; i < MEMORY_FETCH_SIZE; i++) {
+		buffer[i] = MemoryRead(memory, address + i);
+	}
+	return buffer;
+}
+
+#endif
@@ -0,0 +1,414 @@
+/* Movie.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Records the inputs of a Space Invaders machine frame by frame into a
+ * movie file and replays them, checking that the machine runs the same.
+ */
+
+#include <string.h>
+#include "Movie.h"
+
+#define MOVIE_HASH_SEED 0xCBF29CE484222325ULL
+#define MOVIE_HASH_PRIME 0x100000001B3ULL
+
+/* Hashes size bytes of data into hash; start from MOVIE_HASH_SEED. Each
+ * 64-bit word, read little-endian whatever the host, is mixed in as by FNV,
+ * a xor and a multiply, and the product folded with a xor-shift so its high
+ * bits reach the low ones; any bytes left over go in one at a time. Hashing
+ * all of RAM every frame costs little next to running the frame. */
+uint64_t MovieHash(const void *data, size_t size, uint64_t hash)
+{
+	const uint8_t *bytes = data;
+	size_t i;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		uint64_t word = 0;
+		int j;
+
+		for (j = 0; j < 8; j++) {
+			word |= (uint64_t)bytes[i + j] << (8 * j);
+		}
+		hash = (hash ^ word) * MOVIE_HASH_PRIME;
+		hash ^= hash >> 32;
+	}
+	for (; i < size; i++) {
+		hash = (hash ^ bytes[i]) * MOVIE_HASH_PRIME;
+	}
+	return hash;
+}
+
+/* Stores value in bytes bytes at out, lowest first; returns the byte after */
+static uint8_t *MoviePackLe(uint8_t *out, uint64_t value, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		*out++ = value >> (8 * i);
+	}
+	return out;
+}
+
+/* Returns the value of bytes bytes at in, lowest first */
+static uint64_t MovieUnpackLe(const uint8_t *in, int bytes)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		value |= (uint64_t)in[i] << (8 * i);
+	}
+	return value;
+}
+
+/* Lays cpu out in the MOVIE_CPU_SIZE bytes at out, as Movie.h describes */
+static void MoviePackCpu(const struct SavedCpu *cpu, uint8_t *out)
+{
+	out = MoviePackLe(out, cpu->cycles, 8);
+	out = MoviePackLe(out, cpu->bc, 2);
+	out = MoviePackLe(out, cpu->de, 2);
+	out = MoviePackLe(out, cpu->hl, 2);
+	out = MoviePackLe(out, cpu->sp, 2);
+	out = MoviePackLe(out, cpu->pc, 2);
+	*out++ = cpu->a;
+	*out++ = cpu->flags;
+	*out++ = cpu->int_enable;
+	*out++ = cpu->int_pending;
+	*out++ = cpu->int_vector;
+	*out++ = cpu->halted;
+	memcpy(out, cpu->ports.in, sizeof(cpu->ports.in));
+	out += sizeof(cpu->ports.in);
+	memcpy(out, cpu->ports.out, sizeof(cpu->ports.out));
+	out += sizeof(cpu->ports.out);
+	out = MoviePackLe(out, cpu->ports.shift, 2);
+	*out = cpu->ports.shift_offset;
+}
+
+/* Reads cpu back from the MOVIE_CPU_SIZE bytes at in */
+static void MovieUnpackCpu(struct SavedCpu *cpu, const uint8_t *in)
+{
+	cpu->cycles = MovieUnpackLe(in, 8);
+	cpu->bc = MovieUnpackLe(in + 8, 2);
+	cpu->de = MovieUnpackLe(in + 10, 2);
+	cpu->hl = MovieUnpackLe(in + 12, 2);
+	cpu->sp = MovieUnpackLe(in + 14, 2);
+	cpu->pc = MovieUnpackLe(in + 16, 2);
+	cpu->a = in[18];
+	cpu->flags = in[19];
+	cpu->int_enable = in[20];
+	cpu->int_pending = in[21];
+	cpu->int_vector = in[22];
+	cpu->halted = in[23];
+	memcpy(cpu->ports.in, in + 24, sizeof(cpu->ports.in));
+	memcpy(cpu->ports.out, in + 28, sizeof(cpu->ports.out));
+	cpu->ports.shift = MovieUnpackLe(in + 36, 2);
+	cpu->ports.shift_offset = in[38];
+}
+
+/* Returns the hash of the CPU, I/O hardware and RAM of the machine, taken
+ * over the CPU as the header lays it out, so that it is the same on any
+ * host */
+uint32_t MovieStateHash(struct State8080 *state)
+{
+	struct SavedCpu cpu;
+	uint8_t packed[MOVIE_CPU_SIZE];
+	uint64_t hash;
+
+	State8080SaveCpu(state, &cpu);
+	MoviePackCpu(&cpu, packed);
+	hash = MovieHash(packed, sizeof(packed), MOVIE_HASH_SEED);
+	hash = MovieHash(state->memory->read[RAM_START >> 8], SAVESTATE_RAM_SIZE,
+		hash);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* Returns the hash of the ROM the machine runs */
+static uint64_t MovieRomHash(struct State8080 *state)
+{
+	uint64_t hash = MOVIE_HASH_SEED;
+	int page;
+
+	for (page = 0; page < ROM_SIZE / MEMORY_PAGE_SIZE; page++) {
+		hash = MovieHash(state->memory->read[page], MEMORY_PAGE_SIZE, hash);
+	}
+	return hash;
+}
+
+/* Writes out the buffer; returns 0 on success and -1 otherwise */
+static int MovieFlush(struct Movie *movie)
+{
+	if (movie->at > 0 &&
+		fwrite(movie->buffer, 1, movie->at, movie->file) != movie->at) {
+		fprintf(stderr, "MovieFlush: cannot write the movie\n");
+		return -1;
+	}
+	movie->at = 0;
+	return 0;
+}
+
+/* Appends size bytes to the movie, a buffer at a time; returns 0 on success
+ * and -1 otherwise */
+static int MoviePut(struct Movie *movie, const uint8_t *bytes, size_t size)
+{
+	while (size > 0) {
+		size_t part = MOVIE_BUFFER - movie->at;
+
+		if (part == 0) {
+			if (MovieFlush(movie) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (part > size) {
+			part = size;
+		}
+		memcpy(movie->buffer + movie->at, bytes, part);
+		movie->at += part;
+		bytes += part;
+		size -= part;
+	}
+	return 0;
+}
+
+/* Returns the next byte of the movie, or -1 at its end */
+static int MovieGet(struct Movie *movie)
+{
+	if (movie->at == movie->size) {
+		movie->size = fread(movie->buffer, 1, MOVIE_BUFFER, movie->file);
+		movie->at = 0;
+		if (movie->size == 0) {
+			return -1;
+		}
+	}
+	return movie->buffer[movie->at++];
+}
+
+/* Reads size bytes of the movie into data; returns 0 on success and -1 at
+ * its end */
+static int MovieGetBytes(struct Movie *movie, void *data, size_t size)
+{
+	uint8_t *bytes = data;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		int byte = MovieGet(movie);
+
+		if (byte < 0) {
+			return -1;
+		}
+		bytes[i] = byte;
+	}
+	return 0;
+}
+
+/* Writes header out in the layout of MOVIE_HEADER_SIZE bytes described in
+ * Movie.h; returns 0 on success and -1 otherwise */
+static int MovieWriteHeader(struct Movie *movie,
+	const struct MovieHeader *header)
+{
+	uint8_t fields[24 + MOVIE_CPU_SIZE];
+	uint8_t *out = fields;
+
+	memcpy(out, header->magic, sizeof(header->magic));
+	out = MoviePackLe(out + sizeof(header->magic), header->version, 4);
+	out = MoviePackLe(out, header->frames, 4);
+	out = MoviePackLe(out, header->rom_hash, 8);
+	MoviePackCpu(&header->start.cpu, out);
+	return MoviePut(movie, fields, sizeof(fields)) ||
+		MoviePut(movie, header->start.ram, SAVESTATE_RAM_SIZE) ? -1 : 0;
+}
+
+/* Reads header in from the start of the movie; returns 0 on success and -1
+ * when the movie ends first */
+static int MovieReadHeader(struct Movie *movie, struct MovieHeader *header)
+{
+	uint8_t fields[24 + MOVIE_CPU_SIZE];
+
+	memset(header, 0, sizeof(*header));
+	if (MovieGetBytes(movie, fields, sizeof(fields)) != 0 ||
+		MovieGetBytes(movie, header->start.ram, SAVESTATE_RAM_SIZE) != 0) {
+		return -1;
+	}
+	memcpy(header->magic, fields, sizeof(header->magic));
+	header->version = MovieUnpackLe(fields + 8, 4);
+	header->frames = MovieUnpackLe(fields + MOVIE_FRAMES_OFFSET, 4);
+	header->rom_hash = MovieUnpackLe(fields + 16, 8);
+	MovieUnpackCpu(&header->start.cpu, fields + 24);
+	return 0;
+}
+
+/* Starts recording the machine of state, as it is now, into a movie at path;
+ * returns 0 on success and -1 otherwise */
+int MovieRecord(struct Movie *movie, const char *path,
+	struct State8080 *state)
+{
+	struct MovieHeader header;
+
+	movie->file = fopen(path, "wb");
+	if (movie->file == NULL) {
+		fprintf(stderr, "MovieRecord: cannot create %s\n", path);
+		return -1;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MOVIE_MAGIC, sizeof(header.magic));
+	header.version = MOVIE_VERSION;
+	header.rom_hash = MovieRomHash(state);
+	State8080Save(state, &header.start);
+	movie->state = state;
+	movie->recording = 1;
+	movie->frames = 0;
+	movie->length = 0;
+	movie->in[0] = state->ports.in[1];
+	movie->in[1] = state->ports.in[2];
+	movie->at = 0;
+	movie->size = 0;
+	if (MovieWriteHeader(movie, &header) != 0) {
+		fclose(movie->file);
+		return -1;
+	}
+	return 0;
+}
+
+/* Records the frame the machine has just run: the inputs it changed and the
+ * hash of the state it ended in; returns 0 on success and -1 otherwise */
+int MovieRecordFrame(struct Movie *movie)
+{
+	uint32_t hash = MovieStateHash(movie->state);
+	uint8_t frame[5] = { MOVIE_FRAME, hash, hash >> 8, hash >> 16,
+		hash >> 24 };
+	int port;
+
+	for (port = MOVIE_PORT1; port <= MOVIE_PORT2; port++) {
+		uint8_t value = movie->state->ports.in[port];
+
+		if (value != movie->in[port - 1]) {
+			uint8_t change[2] = { port, value };
+
+			if (MoviePut(movie, change, sizeof(change)) != 0) {
+				return -1;
+			}
+			movie->in[port - 1] = value;
+		}
+	}
+	movie->frames++;
+	return MoviePut(movie, frame, sizeof(frame));
+}
+
+/* Opens the movie at path for replay and puts the machine of state, which
+ * must run the ROM the movie was recorded on, in its start state; returns 0
+ * on success and -1 otherwise. The scheduler is left alone, see
+ * MachineResume(). */
+int MoviePlay(struct Movie *movie, const char *path, struct State8080 *state)
+{
+	struct MovieHeader header;
+
+	movie->file = fopen(path, "rb");
+	if (movie->file == NULL) {
+		fprintf(stderr, "MoviePlay: cannot open %s\n", path);
+		return -1;
+	}
+	movie->at = 0;
+	movie->size = 0;
+	if (MovieReadHeader(movie, &header) != 0 ||
+		memcmp(header.magic, MOVIE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != MOVIE_VERSION) {
+		fprintf(stderr, "MoviePlay: %s is not a movie\n", path);
+		fclose(movie->file);
+		return -1;
+	}
+	if (header.rom_hash != MovieRomHash(state)) {
+		fprintf(stderr, "MoviePlay: %s was recorded on another ROM\n", path);
+		fclose(movie->file);
+		return -1;
+	}
+	State8080Restore(state, &header.start);
+	movie->state = state;
+	movie->recording = 0;
+	movie->frames = 0;
+	movie->length = header.frames;
+	movie->in[0] = state->ports.in[1];
+	movie->in[1] = state->ports.in[2];
+	return 0;
+}
+
+/* Sets the inputs of the next frame of the movie and gives the hash the
+ * state must have once it has run; returns 1 when there is a frame, 0 at the
+ * end of the movie and -1 when it is damaged or does not hold as many frames
+ * as its header says, so that a cut movie never replays as a shorter one */
+int MoviePlayFrame(struct Movie *movie, uint32_t *hash)
+{
+	for (;;) {
+		int tag = MovieGet(movie);
+		int i;
+
+		switch (tag) {
+		case -1:
+			if (movie->frames < movie->length) {
+				fprintf(stderr, "MoviePlayFrame: the movie ends early "
+					"after frame %u of %u\n", movie->frames,
+					movie->length);
+				return -1;
+			}
+			return 0;
+		case MOVIE_PORT1:
+		case MOVIE_PORT2: {
+			int value = MovieGet(movie);
+
+			if (value < 0) {
+				break;
+			}
+			movie->state->ports.in[tag] = value;
+			movie->in[tag - 1] = value;
+			continue;
+		}
+		case MOVIE_FRAME:
+			if (movie->frames == movie->length) {
+				fprintf(stderr, "MoviePlayFrame: the movie has more "
+					"than the %u frames its header gives\n",
+					movie->length);
+				return -1;
+			}
+			*hash = 0;
+			for (i = 0; i < 4; i++) {
+				int byte = MovieGet(movie);
+
+				if (byte < 0) {
+					break;
+				}
+				*hash |= (uint32_t)byte << (8 * i);
+			}
+			if (i < 4) {
+				break;
+			}
+			movie->frames++;
+			return 1;
+		}
+		fprintf(stderr, "MoviePlayFrame: the movie is damaged after frame "
+			"%u\n", movie->frames);
+		return -1;
+	}
+}
+
+/* Closes the movie, finishing its file when recording; returns 0 on success
+ * and -1 otherwise */
+int MovieClose(struct Movie *movie)
+{
+	int result = 0;
+
+	if (movie->recording) {
+		uint8_t frames[4] = { movie->frames, movie->frames >> 8,
+			movie->frames >> 16, movie->frames >> 24 };
+
+		result = MovieFlush(movie);
+		if (result == 0 && (fseek(movie->file, MOVIE_FRAMES_OFFSET,
+			SEEK_SET) != 0 ||
+			fwrite(frames, sizeof(frames), 1, movie->file) != 1)) {
+			fprintf(stderr, "MovieClose: cannot write the movie\n");
+			result = -1;
+		}
+	}
+	if (fclose(movie->file) != 0) {
+		result = -1;
+	}
+	movie->file = NULL;
+	return result;
+}
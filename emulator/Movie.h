@@ -0,0 +1,64 @@
+/* Movie.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Records the inputs of a Space Invaders machine frame by frame into a
+ * movie file and replays them, checking that the machine runs the same.
+ */
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "State8080.h"
+
+#define MOVIE_MAGIC "INVMOVIE"
+#define MOVIE_VERSION 1
+#define MOVIE_BUFFER 4096	// bytes read or written at a time
+
+/* the records following the header, each a tag and its bytes */
+#define MOVIE_FRAME 0x00	// ends a frame; 4 bytes of its state hash follow
+#define MOVIE_PORT1 0x01	// input port 1 changes to the byte that follows
+#define MOVIE_PORT2 0x02	// input port 2 changes to the byte that follows
+
+/* The start of a movie file: the ROM it was recorded on and the state it
+ * starts from. On disk every field is little-endian and packed, in the order
+ * below and then those of the start state: cycles, BC, DE, HL, SP, PC, A,
+ * flags, int_enable, int_pending, int_vector, halted, the ports' in[4],
+ * out[8], shift and shift_offset, and RAM; movies play on any host. */
+#define MOVIE_FRAMES_OFFSET 12	// of the frame count, patched once recorded
+#define MOVIE_CPU_SIZE 39	// bytes of the start state before RAM
+#define MOVIE_HEADER_SIZE (24 + MOVIE_CPU_SIZE + SAVESTATE_RAM_SIZE)
+
+typedef struct MovieHeader {
+	char magic[8];		// MOVIE_MAGIC, without its terminator
+	uint32_t version;	// MOVIE_VERSION
+	uint32_t frames;	// frames recorded
+	uint64_t rom_hash;	// MovieHash() of the ROM
+	struct Savestate start;
+} MovieHeader;
+
+/* A movie being recorded or replayed through a buffer of fixed size, so that
+ * a movie of any length streams to or from disk in constant memory */
+typedef struct Movie {
+	FILE *file;
+	struct State8080 *state;
+	int recording;
+	uint32_t frames;	// frames recorded or replayed so far
+	uint32_t length;	// frames in the movie when replaying
+	uint8_t in[2];		// input ports 1 and 2 as of the last frame
+	size_t at;		// next byte of the buffer
+	size_t size;		// bytes in the buffer when replaying
+	uint8_t buffer[MOVIE_BUFFER];
+} Movie;
+
+uint64_t MovieHash(const void *data, size_t size, uint64_t hash);
+uint32_t MovieStateHash(struct State8080 *state);
+int MovieRecord(struct Movie *movie, const char *path,
+	struct State8080 *state);
+int MovieRecordFrame(struct Movie *movie);
+int MoviePlay(struct Movie *movie, const char *path, struct State8080 *state);
+int MoviePlayFrame(struct Movie *movie, uint32_t *hash);
+int MovieClose(struct Movie *movie);
+
+#endif
@@ -0,0 +1,220 @@
+/* Opcodes.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Describes every 8080 opcode once, for the emulator and the disassembler.
+ */
+
+#ifndef OPCODES_H
+#define OPCODES_H
+
+/* How the operand bytes of an instruction are printed: none, an immediate
+ * byte or word (#$nn, #$nnnn), or an address ($nnnn) */
+#define OPERAND_NONE 0
+#define OPERAND_BYTE 1
+#define OPERAND_WORD 2
+#define OPERAND_ADDRESS 3
+
+/* The MOV rows: MOV low,r for the opcodes hi0 to hi7 and MOV high,r for hi8
+ * to hiF, r running over B, C, D, E, H, L, M and A in opcode order */
+#define MOV_ROW(OP, hi, low, high) \
+	OP(hi##0, 1, 5, 5, "MOV", #low ",B", NONE, 0, 0, MOV(low, B)) \
+	OP(hi##1, 1, 5, 5, "MOV", #low ",C", NONE, 0, 0, MOV(low, C)) \
+	OP(hi##2, 1, 5, 5, "MOV", #low ",D", NONE, 0, 0, MOV(low, D)) \
+	OP(hi##3, 1, 5, 5, "MOV", #low ",E", NONE, 0, 0, MOV(low, E)) \
+	OP(hi##4, 1, 5, 5, "MOV", #low ",H", NONE, 0, 0, MOV(low, H)) \
+	OP(hi##5, 1, 5, 5, "MOV", #low ",L", NONE, 0, 0, MOV(low, L)) \
+	OP(hi##6, 1, 7, 7, "MOV", #low ",M", NONE, 0, 0, MOV(low, M)) \
+	OP(hi##7, 1, 5, 5, "MOV", #low ",A", NONE, 0, 0, MOV(low, A)) \
+	OP(hi##8, 1, 5, 5, "MOV", #high ",B", NONE, 0, 0, MOV(high, B)) \
+	OP(hi##9, 1, 5, 5, "MOV", #high ",C", NONE, 0, 0, MOV(high, C)) \
+	OP(hi##A, 1, 5, 5, "MOV", #high ",D", NONE, 0, 0, MOV(high, D)) \
+	OP(hi##B, 1, 5, 5, "MOV", #high ",E", NONE, 0, 0, MOV(high, E)) \
+	OP(hi##C, 1, 5, 5, "MOV", #high ",H", NONE, 0, 0, MOV(high, H)) \
+	OP(hi##D, 1, 5, 5, "MOV", #high ",L", NONE, 0, 0, MOV(high, L)) \
+	OP(hi##E, 1, 7, 7, "MOV", #high ",M", NONE, 0, 0, MOV(high, M)) \
+	OP(hi##F, 1, 5, 5, "MOV", #high ",A", NONE, 0, 0, MOV(high, A))
+
+/* The ALU rows: the operations low and high, reading the flags low_reads and
+ * high_reads, over the same operands */
+#define ALU_ROW(OP, hi, low, low_reads, high, high_reads) \
+	OP(hi##0, 1, 4, 4, #low, "B", NONE, low_reads, FLAGS_MASK, low(B)) \
+	OP(hi##1, 1, 4, 4, #low, "C", NONE, low_reads, FLAGS_MASK, low(C)) \
+	OP(hi##2, 1, 4, 4, #low, "D", NONE, low_reads, FLAGS_MASK, low(D)) \
+	OP(hi##3, 1, 4, 4, #low, "E", NONE, low_reads, FLAGS_MASK, low(E)) \
+	OP(hi##4, 1, 4, 4, #low, "H", NONE, low_reads, FLAGS_MASK, low(H)) \
+	OP(hi##5, 1, 4, 4, #low, "L", NONE, low_reads, FLAGS_MASK, low(L)) \
+	OP(hi##6, 1, 7, 7, #low, "M", NONE, low_reads, FLAGS_MASK, low(M)) \
+	OP(hi##7, 1, 4, 4, #low, "A", NONE, low_reads, FLAGS_MASK, low(A)) \
+	OP(hi##8, 1, 4, 4, #high, "B", NONE, high_reads, FLAGS_MASK, high(B)) \
+	OP(hi##9, 1, 4, 4, #high, "C", NONE, high_reads, FLAGS_MASK, high(C)) \
+	OP(hi##A, 1, 4, 4, #high, "D", NONE, high_reads, FLAGS_MASK, high(D)) \
+	OP(hi##B, 1, 4, 4, #high, "E", NONE, high_reads, FLAGS_MASK, high(E)) \
+	OP(hi##C, 1, 4, 4, #high, "H", NONE, high_reads, FLAGS_MASK, high(H)) \
+	OP(hi##D, 1, 4, 4, #high, "L", NONE, high_reads, FLAGS_MASK, high(L)) \
+	OP(hi##E, 1, 7, 7, #high, "M", NONE, high_reads, FLAGS_MASK, high(M)) \
+	OP(hi##F, 1, 4, 4, #high, "A", NONE, high_reads, FLAGS_MASK, high(A))
+
+/* The 8080 instruction set as
+ *   OP(opcode, length, cycles, taken, mnemonic, operands, kind, reads,
+ *      writes, body)
+ * where cycles is the number of states taken and taken the number taken by
+ * a conditional call or return whose condition holds. The mnemonic and its
+ * register operands are printed with the operand bytes after them as kind
+ * says. reads and writes are the flags the instruction reads and writes, as
+ * the FLAG_ bits of State8080.h. body is the code of the emulator, which is
+ * only expanded by code that defines the macros it uses. The undocumented
+ * opcodes behave as, and are printed as, their documented aliases. */
+#define OPCODES(OP) \
+	OP(0x00, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x01, 3, 10, 10, "LXI", "B", WORD, 0, 0, LXI(BC)) \
+	OP(0x02, 1, 7, 7, "STAX", "B", NONE, 0, 0, STAX(BC)) \
+	OP(0x03, 1, 5, 5, "INX", "B", NONE, 0, 0, INX(BC)) \
+	OP(0x04, 1, 5, 5, "INR", "B", NONE, 0, FLAGS_SZAP, INR(B)) \
+	OP(0x05, 1, 5, 5, "DCR", "B", NONE, 0, FLAGS_SZAP, DCR(B)) \
+	OP(0x06, 2, 7, 7, "MVI", "B", BYTE, 0, 0, MVI(B)) \
+	OP(0x07, 1, 4, 4, "RLC", "", NONE, 0, FLAG_C, RLC) \
+	OP(0x08, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x09, 1, 10, 10, "DAD", "B", NONE, 0, FLAG_C, DAD(BC)) \
+	OP(0x0A, 1, 7, 7, "LDAX", "B", NONE, 0, 0, LDAX(BC)) \
+	OP(0x0B, 1, 5, 5, "DCX", "B", NONE, 0, 0, DCX(BC)) \
+	OP(0x0C, 1, 5, 5, "INR", "C", NONE, 0, FLAGS_SZAP, INR(C)) \
+	OP(0x0D, 1, 5, 5, "DCR", "C", NONE, 0, FLAGS_SZAP, DCR(C)) \
+	OP(0x0E, 2, 7, 7, "MVI", "C", BYTE, 0, 0, MVI(C)) \
+	OP(0x0F, 1, 4, 4, "RRC", "", NONE, 0, FLAG_C, RRC) \
+	OP(0x10, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x11, 3, 10, 10, "LXI", "D", WORD, 0, 0, LXI(DE)) \
+	OP(0x12, 1, 7, 7, "STAX", "D", NONE, 0, 0, STAX(DE)) \
+	OP(0x13, 1, 5, 5, "INX", "D", NONE, 0, 0, INX(DE)) \
+	OP(0x14, 1, 5, 5, "INR", "D", NONE, 0, FLAGS_SZAP, INR(D)) \
+	OP(0x15, 1, 5, 5, "DCR", "D", NONE, 0, FLAGS_SZAP, DCR(D)) \
+	OP(0x16, 2, 7, 7, "MVI", "D", BYTE, 0, 0, MVI(D)) \
+	OP(0x17, 1, 4, 4, "RAL", "", NONE, FLAG_C, FLAG_C, RAL) \
+	OP(0x18, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x19, 1, 10, 10, "DAD", "D", NONE, 0, FLAG_C, DAD(DE)) \
+	OP(0x1A, 1, 7, 7, "LDAX", "D", NONE, 0, 0, LDAX(DE)) \
+	OP(0x1B, 1, 5, 5, "DCX", "D", NONE, 0, 0, DCX(DE)) \
+	OP(0x1C, 1, 5, 5, "INR", "E", NONE, 0, FLAGS_SZAP, INR(E)) \
+	OP(0x1D, 1, 5, 5, "DCR", "E", NONE, 0, FLAGS_SZAP, DCR(E)) \
+	OP(0x1E, 2, 7, 7, "MVI", "E", BYTE, 0, 0, MVI(E)) \
+	OP(0x1F, 1, 4, 4, "RAR", "", NONE, FLAG_C, FLAG_C, RAR) \
+	OP(0x20, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x21, 3, 10, 10, "LXI", "H", WORD, 0, 0, LXI(HL)) \
+	OP(0x22, 3, 16, 16, "SHLD", "", ADDRESS, 0, 0, SHLD) \
+	OP(0x23, 1, 5, 5, "INX", "H", NONE, 0, 0, INX(HL)) \
+	OP(0x24, 1, 5, 5, "INR", "H", NONE, 0, FLAGS_SZAP, INR(H)) \
+	OP(0x25, 1, 5, 5, "DCR", "H", NONE, 0, FLAGS_SZAP, DCR(H)) \
+	OP(0x26, 2, 7, 7, "MVI", "H", BYTE, 0, 0, MVI(H)) \
+	OP(0x27, 1, 4, 4, "DAA", "", NONE, FLAG_AC | FLAG_C, FLAGS_MASK, DAA) \
+	OP(0x28, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x29, 1, 10, 10, "DAD", "H", NONE, 0, FLAG_C, DAD(HL)) \
+	OP(0x2A, 3, 16, 16, "LHLD", "", ADDRESS, 0, 0, LHLD) \
+	OP(0x2B, 1, 5, 5, "DCX", "H", NONE, 0, 0, DCX(HL)) \
+	OP(0x2C, 1, 5, 5, "INR", "L", NONE, 0, FLAGS_SZAP, INR(L)) \
+	OP(0x2D, 1, 5, 5, "DCR", "L", NONE, 0, FLAGS_SZAP, DCR(L)) \
+	OP(0x2E, 2, 7, 7, "MVI", "L", BYTE, 0, 0, MVI(L)) \
+	OP(0x2F, 1, 4, 4, "CMA", "", NONE, 0, 0, CMA) \
+	OP(0x30, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x31, 3, 10, 10, "LXI", "SP", WORD, 0, 0, LXI(SP)) \
+	OP(0x32, 3, 13, 13, "STA", "", ADDRESS, 0, 0, STA) \
+	OP(0x33, 1, 5, 5, "INX", "SP", NONE, 0, 0, INX(SP)) \
+	OP(0x34, 1, 10, 10, "INR", "M", NONE, 0, FLAGS_SZAP, INR(M)) \
+	OP(0x35, 1, 10, 10, "DCR", "M", NONE, 0, FLAGS_SZAP, DCR(M)) \
+	OP(0x36, 2, 10, 10, "MVI", "M", BYTE, 0, 0, MVI(M)) \
+	OP(0x37, 1, 4, 4, "STC", "", NONE, 0, FLAG_C, STC) \
+	OP(0x38, 1, 4, 4, "NOP", "", NONE, 0, 0, NOP) \
+	OP(0x39, 1, 10, 10, "DAD", "SP", NONE, 0, FLAG_C, DAD(SP)) \
+	OP(0x3A, 3, 13, 13, "LDA", "", ADDRESS, 0, 0, LDA) \
+	OP(0x3B, 1, 5, 5, "DCX", "SP", NONE, 0, 0, DCX(SP)) \
+	OP(0x3C, 1, 5, 5, "INR", "A", NONE, 0, FLAGS_SZAP, INR(A)) \
+	OP(0x3D, 1, 5, 5, "DCR", "A", NONE, 0, FLAGS_SZAP, DCR(A)) \
+	OP(0x3E, 2, 7, 7, "MVI", "A", BYTE, 0, 0, MVI(A)) \
+	OP(0x3F, 1, 4, 4, "CMC", "", NONE, FLAG_C, FLAG_C, CMC) \
+	MOV_ROW(OP, 0x4, B, C) \
+	MOV_ROW(OP, 0x5, D, E) \
+	MOV_ROW(OP, 0x6, H, L) \
+	OP(0x70, 1, 7, 7, "MOV", "M,B", NONE, 0, 0, MOV(M, B)) \
+	OP(0x71, 1, 7, 7, "MOV", "M,C", NONE, 0, 0, MOV(M, C)) \
+	OP(0x72, 1, 7, 7, "MOV", "M,D", NONE, 0, 0, MOV(M, D)) \
+	OP(0x73, 1, 7, 7, "MOV", "M,E", NONE, 0, 0, MOV(M, E)) \
+	OP(0x74, 1, 7, 7, "MOV", "M,H", NONE, 0, 0, MOV(M, H)) \
+	OP(0x75, 1, 7, 7, "MOV", "M,L", NONE, 0, 0, MOV(M, L)) \
+	OP(0x76, 1, 7, 7, "HLT", "", NONE, 0, 0, HLT) \
+	OP(0x77, 1, 7, 7, "MOV", "M,A", NONE, 0, 0, MOV(M, A)) \
+	OP(0x78, 1, 5, 5, "MOV", "A,B", NONE, 0, 0, MOV(A, B)) \
+	OP(0x79, 1, 5, 5, "MOV", "A,C", NONE, 0, 0, MOV(A, C)) \
+	OP(0x7A, 1, 5, 5, "MOV", "A,D", NONE, 0, 0, MOV(A, D)) \
+	OP(0x7B, 1, 5, 5, "MOV", "A,E", NONE, 0, 0, MOV(A, E)) \
+	OP(0x7C, 1, 5, 5, "MOV", "A,H", NONE, 0, 0, MOV(A, H)) \
+	OP(0x7D, 1, 5, 5, "MOV", "A,L", NONE, 0, 0, MOV(A, L)) \
+	OP(0x7E, 1, 7, 7, "MOV", "A,M", NONE, 0, 0, MOV(A, M)) \
+	OP(0x7F, 1, 5, 5, "MOV", "A,A", NONE, 0, 0, MOV(A, A)) \
+	ALU_ROW(OP, 0x8, ADD, 0, ADC, FLAG_C) \
+	ALU_ROW(OP, 0x9, SUB, 0, SBB, FLAG_C) \
+	ALU_ROW(OP, 0xA, ANA, 0, XRA, 0) \
+	ALU_ROW(OP, 0xB, ORA, 0, CMP, 0) \
+	OP(0xC0, 1, 5, 11, "RNZ", "", NONE, FLAG_Z, 0, RCC(NZ)) \
+	OP(0xC1, 1, 10, 10, "POP", "B", NONE, 0, 0, POP(BC)) \
+	OP(0xC2, 3, 10, 10, "JNZ", "", ADDRESS, FLAG_Z, 0, JCC(NZ)) \
+	OP(0xC3, 3, 10, 10, "JMP", "", ADDRESS, 0, 0, JMP) \
+	OP(0xC4, 3, 11, 17, "CNZ", "", ADDRESS, FLAG_Z, 0, CCC(NZ)) \
+	OP(0xC5, 1, 11, 11, "PUSH", "B", NONE, 0, 0, PUSH(BC)) \
+	OP(0xC6, 2, 7, 7, "ADI", "", BYTE, 0, FLAGS_MASK, ADD(IMM)) \
+	OP(0xC7, 1, 11, 11, "RST", "0", NONE, 0, 0, RST(0)) \
+	OP(0xC8, 1, 5, 11, "RZ", "", NONE, FLAG_Z, 0, RCC(Z)) \
+	OP(0xC9, 1, 10, 10, "RET", "", NONE, 0, 0, RET) \
+	OP(0xCA, 3, 10, 10, "JZ", "", ADDRESS, FLAG_Z, 0, JCC(Z)) \
+	OP(0xCB, 3, 10, 10, "JMP", "", ADDRESS, 0, 0, JMP) \
+	OP(0xCC, 3, 11, 17, "CZ", "", ADDRESS, FLAG_Z, 0, CCC(Z)) \
+	OP(0xCD, 3, 17, 17, "CALL", "", ADDRESS, 0, 0, CALL) \
+	OP(0xCE, 2, 7, 7, "ACI", "", BYTE, FLAG_C, FLAGS_MASK, ADC(IMM)) \
+	OP(0xCF, 1, 11, 11, "RST", "1", NONE, 0, 0, RST(1)) \
+	OP(0xD0, 1, 5, 11, "RNC", "", NONE, FLAG_C, 0, RCC(NC)) \
+	OP(0xD1, 1, 10, 10, "POP", "D", NONE, 0, 0, POP(DE)) \
+	OP(0xD2, 3, 10, 10, "JNC", "", ADDRESS, FLAG_C, 0, JCC(NC)) \
+	OP(0xD3, 2, 10, 10, "OUT", "", BYTE, 0, 0, OUT) \
+	OP(0xD4, 3, 11, 17, "CNC", "", ADDRESS, FLAG_C, 0, CCC(NC)) \
+	OP(0xD5, 1, 11, 11, "PUSH", "D", NONE, 0, 0, PUSH(DE)) \
+	OP(0xD6, 2, 7, 7, "SUI", "", BYTE, 0, FLAGS_MASK, SUB(IMM)) \
+	OP(0xD7, 1, 11, 11, "RST", "2", NONE, 0, 0, RST(2)) \
+	OP(0xD8, 1, 5, 11, "RC", "", NONE, FLAG_C, 0, RCC(C)) \
+	OP(0xD9, 1, 10, 10, "RET", "", NONE, 0, 0, RET) \
+	OP(0xDA, 3, 10, 10, "JC", "", ADDRESS, FLAG_C, 0, JCC(C)) \
+	OP(0xDB, 2, 10, 10, "IN", "", BYTE, 0, 0, IN) \
+	OP(0xDC, 3, 11, 17, "CC", "", ADDRESS, FLAG_C, 0, CCC(C)) \
+	OP(0xDD, 3, 17, 17, "CALL", "", ADDRESS, 0, 0, CALL) \
+	OP(0xDE, 2, 7, 7, "SBI", "", BYTE, FLAG_C, FLAGS_MASK, SBB(IMM)) \
+	OP(0xDF, 1, 11, 11, "RST", "3", NONE, 0, 0, RST(3)) \
+	OP(0xE0, 1, 5, 11, "RPO", "", NONE, FLAG_P, 0, RCC(PO)) \
+	OP(0xE1, 1, 10, 10, "POP", "H", NONE, 0, 0, POP(HL)) \
+	OP(0xE2, 3, 10, 10, "JPO", "", ADDRESS, FLAG_P, 0, JCC(PO)) \
+	OP(0xE3, 1, 18, 18, "XTHL", "", NONE, 0, 0, XTHL) \
+	OP(0xE4, 3, 11, 17, "CPO", "", ADDRESS, FLAG_P, 0, CCC(PO)) \
+	OP(0xE5, 1, 11, 11, "PUSH", "H", NONE, 0, 0, PUSH(HL)) \
+	OP(0xE6, 2, 7, 7, "ANI", "", BYTE, 0, FLAGS_MASK, ANA(IMM)) \
+	OP(0xE7, 1, 11, 11, "RST", "4", NONE, 0, 0, RST(4)) \
+	OP(0xE8, 1, 5, 11, "RPE", "", NONE, FLAG_P, 0, RCC(PE)) \
+	OP(0xE9, 1, 5, 5, "PCHL", "", NONE, 0, 0, PCHL) \
+	OP(0xEA, 3, 10, 10, "JPE", "", ADDRESS, FLAG_P, 0, JCC(PE)) \
+	OP(0xEB, 1, 4, 4, "XCHG", "", NONE, 0, 0, XCHG) \
+	OP(0xEC, 3, 11, 17, "CPE", "", ADDRESS, FLAG_P, 0, CCC(PE)) \
+	OP(0xED, 3, 17, 17, "CALL", "", ADDRESS, 0, 0, CALL) \
+	OP(0xEE, 2, 7, 7, "XRI", "", BYTE, 0, FLAGS_MASK, XRA(IMM)) \
+	OP(0xEF, 1, 11, 11, "RST", "5", NONE, 0, 0, RST(5)) \
+	OP(0xF0, 1, 5, 11, "RP", "", NONE, FLAG_S, 0, RCC(P)) \
+	OP(0xF1, 1, 10, 10, "POP", "PSW", NONE, 0, FLAGS_MASK, POP(PSW)) \
+	OP(0xF2, 3, 10, 10, "JP", "", ADDRESS, FLAG_S, 0, JCC(P)) \
+	OP(0xF3, 1, 4, 4, "DI", "", NONE, 0, 0, DI) \
+	OP(0xF4, 3, 11, 17, "CP", "", ADDRESS, FLAG_S, 0, CCC(P)) \
+	OP(0xF5, 1, 11, 11, "PUSH", "PSW", NONE, FLAGS_MASK, 0, PUSH(PSW)) \
+	OP(0xF6, 2, 7, 7, "ORI", "", BYTE, 0, FLAGS_MASK, ORA(IMM)) \
+	OP(0xF7, 1, 11, 11, "RST", "6", NONE, 0, 0, RST(6)) \
+	OP(0xF8, 1, 5, 11, "RM", "", NONE, FLAG_S, 0, RCC(M)) \
+	OP(0xF9, 1, 5, 5, "SPHL", "", NONE, 0, 0, SPHL) \
+	OP(0xFA, 3, 10, 10, "JM", "", ADDRESS, FLAG_S, 0, JCC(M)) \
+	OP(0xFB, 1, 4, 4, "EI", "", NONE, 0, 0, EI) \
+	OP(0xFC, 3, 11, 17, "CM", "", ADDRESS, FLAG_S, 0, CCC(M)) \
+	OP(0xFD, 3, 17, 17, "CALL", "", ADDRESS, 0, 0, CALL) \
+	OP(0xFE, 2, 7, 7, "CPI", "", BYTE, 0, FLAGS_MASK, CMP(IMM)) \
+	OP(0xFF, 1, 11, 11, "RST", "7", NONE, 0, 0, RST(7))
+
+#endif
@@ -0,0 +1,101 @@
+/* Rewind.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Records the last frames of a Space Invaders machine so that it can be run
+ * backwards one frame at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "Rewind.h"
+
+/* Allocates a ring of frames frames and a pool of pages pages for the
+ * machine of state; returns 0 on success and -1 when they cannot be
+ * allocated. Besides the pages RAM shares with the newest frame, the pool
+ * needs SNAPSHOT_PAGES pages for the first frame and then only the pages
+ * each frame writes, so it must have 2 * SNAPSHOT_PAGES at the very least. */
+int RewindInit(struct Rewind *rewind, struct State8080 *state, int frames,
+	int pages)
+{
+	rewind->ring = calloc(frames, sizeof(struct Snapshot));
+	if (rewind->ring == NULL) {
+		fprintf(stderr, "RewindInit: malloc failed\n");
+		return -1;
+	}
+	if (SnapshotStoreInit(&rewind->store, state, pages) != 0) {
+		free(rewind->ring);
+		rewind->ring = NULL;
+		return -1;
+	}
+	rewind->capacity = frames;
+	rewind->first = 0;
+	rewind->count = 0;
+	return 0;
+}
+
+/* Releases the ring and its pool */
+void RewindFree(struct Rewind *rewind)
+{
+	SnapshotStoreFree(&rewind->store);
+	free(rewind->ring);
+	rewind->ring = NULL;
+	rewind->count = 0;
+}
+
+/* Drops the oldest frame */
+static void RewindDropOldest(struct Rewind *rewind)
+{
+	SnapshotRelease(&rewind->store, &rewind->ring[rewind->first]);
+	rewind->first = (rewind->first + 1) % rewind->capacity;
+	rewind->count--;
+}
+
+/* Records the state of the machine as the newest frame. Each frame copies
+ * only the pages written since the one before it, so a frame costs at most
+ * SNAPSHOT_PAGES page copies and as many frames dropped as it takes to free
+ * that many pages. */
+void RewindRecord(struct Rewind *rewind)
+{
+	struct Snapshot *newest;
+
+	if (rewind->count == rewind->capacity) {
+		RewindDropOldest(rewind);
+	}
+	newest = &rewind->ring[(rewind->first + rewind->count) %
+		rewind->capacity];
+	while (SnapshotTake(&rewind->store, newest) != 0) {
+		if (rewind->count == 0) {
+			fprintf(stderr, "RewindRecord: the pool cannot hold a "
+				"frame\n");
+			return;
+		}
+		RewindDropOldest(rewind);
+	}
+	rewind->count++;
+}
+
+/* Puts the machine back in the state of the newest frame and forgets it;
+ * returns 0 on success and -1 when no frame is left. It copies at most
+ * SNAPSHOT_PAGES pages whatever the length of the history; the scheduler is
+ * left alone, see MachineResume(). */
+int RewindStepBack(struct Rewind *rewind)
+{
+	struct Snapshot *newest;
+
+	if (rewind->count == 0) {
+		return -1;
+	}
+	rewind->count--;
+	newest = &rewind->ring[(rewind->first + rewind->count) %
+		rewind->capacity];
+	SnapshotRestore(&rewind->store, newest);
+	SnapshotRelease(&rewind->store, newest);
+	return 0;
+}
+
+/* Returns the bytes the frames held take, in the pool and the ring */
+size_t RewindBytes(const struct Rewind *rewind)
+{
+	return (size_t)rewind->store.used * sizeof(struct SnapshotPage) +
+		(size_t)rewind->count * sizeof(struct Snapshot);
+}
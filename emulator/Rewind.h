@@ -0,0 +1,32 @@
+/* Rewind.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Records the last frames of a Space Invaders machine so that it can be run
+ * backwards one frame at a time.
+ */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include "Snapshot.h"
+
+/* A ring of snapshots, one per frame, oldest first, whose pages come from a
+ * pool allocated up front; recording a frame into a full ring, or one whose
+ * pool is short of pages, drops the oldest frames to make room */
+typedef struct Rewind {
+	struct SnapshotStore store;
+	struct Snapshot *ring;
+	int capacity;		// frames the ring holds
+	int first;		// index of the oldest frame
+	int count;		// frames held
+} Rewind;
+
+int RewindInit(struct Rewind *rewind, struct State8080 *state, int frames,
+	int pages);
+void RewindFree(struct Rewind *rewind);
+void RewindRecord(struct Rewind *rewind);
+int RewindStepBack(struct Rewind *rewind);
+size_t RewindBytes(const struct Rewind *rewind);
+
+#endif
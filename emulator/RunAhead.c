@@ -0,0 +1,55 @@
+/* RunAhead.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Shows the frame a Space Invaders machine will draw a few frames from now,
+ * hiding the frames of lag between an input and the game answering it.
+ */
+
+#include <string.h>
+#include "RunAhead.h"
+#include "Scheduler.h"
+
+/* Sets up run to run the machine of state ahead frames ahead; returns 0 on
+ * success and -1 when its snapshot pool cannot be allocated. The pool holds
+ * the pages RAM shares with the snapshot and those the snapshot copies. */
+int RunAheadInit(struct RunAhead *run, struct State8080 *state, int ahead)
+{
+	run->ahead = ahead;
+	memset(run->screen, 0, sizeof(run->screen));
+	return SnapshotStoreInit(&run->store, state, 2 * SNAPSHOT_PAGES);
+}
+
+/* Releases the snapshot pool of run */
+void RunAheadFree(struct RunAhead *run)
+{
+	SnapshotStoreFree(&run->store);
+}
+
+/* Runs frame for real on the inputs already set, then run->ahead frames more
+ * on the same inputs, keeping the screen they end on, and puts the machine
+ * back as the real frame left it. The frames run ahead copy only the pages
+ * they write, and restoring copies back only those. When the pool has no
+ * room for the snapshot, the real frame is shown and nothing runs ahead. */
+void RunAheadFrame(struct RunAhead *run, struct Scheduler *scheduler,
+	int frame)
+{
+	struct State8080 *state = run->store.state;
+	int i;
+
+	MachineRun(state, scheduler, (uint64_t)(frame + 1) * CYCLES_PER_FRAME);
+	if (run->ahead == 0 ||
+		SnapshotTake(&run->store, &run->snapshot) != 0) {
+		memcpy(run->screen, state->memory->read[VRAM_START >> 8],
+			VRAM_SIZE);
+		return;
+	}
+
+	for (i = 1; i <= run->ahead; i++) {
+		MachineRun(state, scheduler,
+			(uint64_t)(frame + 1 + i) * CYCLES_PER_FRAME);
+	}
+	memcpy(run->screen, state->memory->read[VRAM_START >> 8], VRAM_SIZE);
+	SnapshotRestore(&run->store, &run->snapshot);
+	SnapshotRelease(&run->store, &run->snapshot);
+	MachineResume(state, scheduler);
+}
@@ -0,0 +1,31 @@
+/* RunAhead.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Shows the frame a Space Invaders machine will draw a few frames from now,
+ * hiding the frames of lag between an input and the game answering it.
+ */
+
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+
+#include "Snapshot.h"
+
+struct Scheduler;
+
+/* Runs a machine ahead of itself: each frame runs for real, then ahead more
+ * frames on the same input with nothing shown, and the screen at their end
+ * is the one displayed; the machine is then put back where the real frame
+ * left it */
+typedef struct RunAhead {
+	struct SnapshotStore store;
+	struct Snapshot snapshot;	// the machine after the real frame
+	int ahead;		// frames run ahead
+	uint8_t screen[VRAM_SIZE];	// VRAM as of the frame displayed
+} RunAhead;
+
+int RunAheadInit(struct RunAhead *run, struct State8080 *state, int ahead);
+void RunAheadFree(struct RunAhead *run);
+void RunAheadFrame(struct RunAhead *run, struct Scheduler *scheduler,
+	int frame);
+
+#endif
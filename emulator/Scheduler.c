@@ -0,0 +1,73 @@
+/* Scheduler.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Schedules events such as interrupts against the cycle counter of the CPU.
+ */
+
+#include <stdio.h>
+#include "Scheduler.h"
+
+/* Empties the scheduler */
+void SchedulerInit(struct Scheduler *scheduler)
+{
+	scheduler->count = 0;
+}
+
+/* Adds an event calling handler with data once the cycle counter reaches
+ * deadline; returns 0 on success and -1 when the scheduler is full */
+int SchedulerAdd(struct Scheduler *scheduler, uint64_t deadline,
+	EventHandler handler, void *data)
+{
+	struct Event *events = scheduler->events;
+	int i = scheduler->count;
+
+	if (i == SCHEDULER_CAPACITY) {
+		fprintf(stderr, "SchedulerAdd: scheduler is full\n");
+		return -1;
+	}
+	scheduler->count++;
+
+	/* sift the new event up from the bottom of the heap */
+	while (i > 0 && events[(i - 1) / 2].deadline > deadline) {
+		events[i] = events[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	events[i].deadline = deadline;
+	events[i].handler = handler;
+	events[i].data = data;
+	return 0;
+}
+
+/* Removes the next event from the heap */
+static struct Event SchedulerPop(struct Scheduler *scheduler)
+{
+	struct Event *events = scheduler->events;
+	struct Event next = events[0];
+	struct Event last = events[--scheduler->count];
+	int i = 0;
+	int child;
+
+	/* sift the last event down from the top of the heap */
+	while ((child = 2 * i + 1) < scheduler->count) {
+		if (child + 1 < scheduler->count &&
+			events[child + 1].deadline < events[child].deadline) {
+			child++;
+		}
+		if (last.deadline <= events[child].deadline) {
+			break;
+		}
+		events[i] = events[child];
+		i = child;
+	}
+	events[i] = last;
+	return next;
+}
+
+/* Runs, in deadline order, every event that is due by cycle count now */
+void SchedulerRunDue(struct Scheduler *scheduler, uint64_t now)
+{
+	while (scheduler->count && scheduler->events[0].deadline <= now) {
+		struct Event event = SchedulerPop(scheduler);
+		event.handler(scheduler, event.deadline, event.data);
+	}
+}
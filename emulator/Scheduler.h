@@ -0,0 +1,46 @@
+/* Scheduler.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Schedules events such as interrupts against the cycle counter of the CPU.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHEDULER_CAPACITY 16
+#define SCHEDULER_NEVER UINT64_MAX
+
+struct Scheduler;
+
+/* Called once the cycle counter has reached deadline; the handler may add
+ * the next occurrence of its event to the scheduler */
+typedef void (*EventHandler)(struct Scheduler *scheduler, uint64_t deadline,
+	void *data);
+
+typedef struct Event {
+	uint64_t deadline;	// cycle count at which the event is due
+	EventHandler handler;
+	void *data;		// passed to the handler
+} Event;
+
+/* A min-heap of events ordered by deadline */
+typedef struct Scheduler {
+	struct Event events[SCHEDULER_CAPACITY];
+	int count;
+} Scheduler;
+
+void SchedulerInit(struct Scheduler *scheduler);
+int SchedulerAdd(struct Scheduler *scheduler, uint64_t deadline,
+	EventHandler handler, void *data);
+void SchedulerRunDue(struct Scheduler *scheduler, uint64_t now);
+
+/* Returns the deadline of the next event, or SCHEDULER_NEVER when there is
+ * none */
+static inline uint64_t SchedulerNext(const struct Scheduler *scheduler)
+{
+	return scheduler->count ? scheduler->events[0].deadline : SCHEDULER_NEVER;
+}
+
+#endif
@@ -0,0 +1,153 @@
+/* Snapshot.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Incremental snapshots of a Space Invaders machine that share the pages of
+ * RAM they have in common.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Snapshot.h"
+
+/* Takes another reference to page, which may be NULL */
+static struct SnapshotPage *SnapshotHold(struct SnapshotPage *page)
+{
+	if (page != NULL) {
+		page->refs++;
+	}
+	return page;
+}
+
+/* Drops a reference to page, which may be NULL, and returns it to the pool
+ * once no snapshot holds it */
+static void SnapshotDrop(struct SnapshotStore *store, struct SnapshotPage *page)
+{
+	if (page != NULL && --page->refs == 0) {
+		page->next = store->free;
+		store->free = page;
+		store->used--;
+	}
+}
+
+/* Allocates a pool of capacity pages for the snapshots of state and starts
+ * tracking the pages it writes; returns 0 on success and -1 when the pool
+ * cannot be allocated. The first snapshot copies all of RAM. */
+int SnapshotStoreInit(struct SnapshotStore *store, struct State8080 *state,
+	int capacity)
+{
+	int i;
+
+	store->state = state;
+	store->pool = malloc((size_t)capacity * sizeof(struct SnapshotPage));
+	if (store->pool == NULL) {
+		fprintf(stderr, "SnapshotStoreInit: malloc failed\n");
+		return -1;
+	}
+	store->free = NULL;
+	for (i = capacity - 1; i >= 0; i--) {
+		store->pool[i].next = store->free;
+		store->pool[i].refs = 0;
+		store->free = &store->pool[i];
+	}
+	store->capacity = capacity;
+	store->used = 0;
+	for (i = 0; i < SNAPSHOT_PAGES; i++) {
+		store->base[i] = NULL;
+	}
+	MemoryClearDirty(state->memory);
+	return 0;
+}
+
+/* Releases the pool; every snapshot taken from it is gone with it */
+void SnapshotStoreFree(struct SnapshotStore *store)
+{
+	free(store->pool);
+	store->pool = NULL;
+	store->free = NULL;
+}
+
+/* Takes a snapshot of the machine, copying the pages written since its
+ * parent; returns 0 on success and -1, leaving snapshot alone, when the pool
+ * has too few pages left */
+int SnapshotTake(struct SnapshotStore *store, struct Snapshot *snapshot)
+{
+	struct Memory *memory = store->state->memory;
+	const uint8_t *dirty = memory->dirty + (RAM_START >> 8);
+	const uint8_t *ram = memory->read[RAM_START >> 8];
+	int needed = 0;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_PAGES; i++) {
+		needed += dirty[i] || store->base[i] == NULL;
+	}
+	if (needed > store->capacity - store->used) {
+		return -1;
+	}
+
+	State8080SaveCpu(store->state, &snapshot->cpu);
+	for (i = 0; i < SNAPSHOT_PAGES; i++) {
+		struct SnapshotPage *page = store->base[i];
+
+		if (dirty[i] || page == NULL) {
+			page = store->free;
+			store->free = page->next;
+			store->used++;
+			page->refs = 1;
+			memcpy(page->bytes, ram + i * MEMORY_PAGE_SIZE,
+				MEMORY_PAGE_SIZE);
+			SnapshotDrop(store, store->base[i]);
+			store->base[i] = page;
+		}
+		snapshot->pages[i] = SnapshotHold(page);
+	}
+	MemoryClearDirty(memory);
+	return 0;
+}
+
+/* Puts the machine back in the state of snapshot, which becomes the parent
+ * of the next one. Only the pages that differ from RAM are copied, and the
+ * blocks decoded from them are invalidated; the scheduler is left alone, see
+ * MachineResume(). */
+void SnapshotRestore(struct SnapshotStore *store,
+	const struct Snapshot *snapshot)
+{
+	struct Memory *memory = store->state->memory;
+	const uint8_t *dirty = memory->dirty + (RAM_START >> 8);
+	uint8_t *ram = memory->read[RAM_START >> 8];
+	uint8_t copied[SNAPSHOT_PAGES];
+	int page;
+	int i;
+
+	State8080RestoreCpu(store->state, &snapshot->cpu);
+	for (i = 0; i < SNAPSHOT_PAGES; i++) {
+		copied[i] = dirty[i] || snapshot->pages[i] != store->base[i];
+		if (copied[i]) {
+			memcpy(ram + i * MEMORY_PAGE_SIZE, snapshot->pages[i]->bytes,
+				MEMORY_PAGE_SIZE);
+		}
+		SnapshotHold(snapshot->pages[i]);
+		SnapshotDrop(store, store->base[i]);
+		store->base[i] = snapshot->pages[i];
+	}
+	for (page = 0; page < MEMORY_PAGES; page++) {
+		if (memory->read[page] >= ram &&
+			memory->read[page] < ram + SAVESTATE_RAM_SIZE &&
+			copied[(memory->read[page] - ram) / MEMORY_PAGE_SIZE]) {
+			MemoryRewritten(memory, page);
+		}
+	}
+	MemoryClearDirty(memory);
+}
+
+/* Drops the pages of snapshot, returning those no other snapshot shares to
+ * the pool */
+void SnapshotRelease(struct SnapshotStore *store, struct Snapshot *snapshot)
+{
+	int i;
+
+	for (i = 0; i < SNAPSHOT_PAGES; i++) {
+		SnapshotDrop(store, snapshot->pages[i]);
+		snapshot->pages[i] = NULL;
+	}
+}
@@ -0,0 +1,52 @@
+/* Snapshot.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Incremental snapshots of a Space Invaders machine that share the pages of
+ * RAM they have in common.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "State8080.h"
+
+#define SNAPSHOT_PAGES (SAVESTATE_RAM_SIZE / MEMORY_PAGE_SIZE)
+
+/* A copy of one page of RAM, shared by every snapshot it is unchanged in */
+typedef struct SnapshotPage {
+	struct SnapshotPage *next;	// on the free list
+	uint32_t refs;
+	uint8_t bytes[MEMORY_PAGE_SIZE];
+} SnapshotPage;
+
+/* The state of the machine at some point: the CPU in full, and RAM as one
+ * page each, most of them those of the snapshot before it */
+typedef struct Snapshot {
+	struct SavedCpu cpu;
+	struct SnapshotPage *pages[SNAPSHOT_PAGES];
+} Snapshot;
+
+/* Takes and restores the snapshots of one machine. A snapshot copies only
+ * the pages written since the snapshot last taken or restored, its parent,
+ * and shares the others with it; so snapshots form a tree whose size grows
+ * with what the machine wrote rather than with the number of them. The
+ * pages come from a pool of fixed capacity allocated up front. */
+typedef struct SnapshotStore {
+	struct State8080 *state;
+	struct SnapshotPage *pool;
+	struct SnapshotPage *free;
+	int capacity;		// pages in the pool
+	int used;		// pages held by snapshots
+	struct SnapshotPage *base[SNAPSHOT_PAGES];	// RAM as of the parent
+} SnapshotStore;
+
+int SnapshotStoreInit(struct SnapshotStore *store, struct State8080 *state,
+	int capacity);
+void SnapshotStoreFree(struct SnapshotStore *store);
+int SnapshotTake(struct SnapshotStore *store, struct Snapshot *snapshot);
+void SnapshotRestore(struct SnapshotStore *store,
+	const struct Snapshot *snapshot);
+void SnapshotRelease(struct SnapshotStore *store, struct Snapshot *snapshot);
+
+#endif
@@ -0,0 +1,211 @@
+/* State8080.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * State of the 8080 CPU, shared by the interpreter and the JIT.
+ */
+
+#ifndef STATE8080_H
+#define STATE8080_H
+
+#include <stdint.h>
+#include "BlockCache.h"
+#include "Memory.h"
+
+struct Jit;
+struct Scheduler;
+struct State8080;
+
+/* Dispatch backends for Emulate(); the backend is chosen at build time and
+ * defaults to computed goto on compilers that support it. Build with
+ * -DEMULATOR_DISPATCH=DISPATCH_TABLE to force the handler table. */
+#define DISPATCH_TABLE 1
+#define DISPATCH_GOTO 2
+
+#ifndef EMULATOR_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define EMULATOR_DISPATCH DISPATCH_GOTO
+#else
+#define EMULATOR_DISPATCH DISPATCH_TABLE
+#endif
+#endif
+
+/* Lazy flags mode; build with -DEMULATOR_LAZY_FLAGS=1 to record the last ALU
+ * operation and only compute the flags when an instruction reads them */
+#ifndef EMULATOR_LAZY_FLAGS
+#define EMULATOR_LAZY_FLAGS 0
+#endif
+
+/* Superinstructions; build with -DEMULATOR_FUSION=0 to dispatch every
+ * instruction of a block on its own */
+#ifndef EMULATOR_FUSION
+#define EMULATOR_FUSION 1
+#endif
+
+/* JIT backend; build with -DEMULATOR_JIT=1 on x86-64 to translate basic
+ * blocks into host code, which runs when a State8080 has a struct Jit */
+#ifndef EMULATOR_JIT
+#define EMULATOR_JIT 0
+#endif
+
+#if EMULATOR_JIT && EMULATOR_LAZY_FLAGS
+#error "the JIT keeps the flags in a host register and needs eager flags"
+#endif
+
+/* The Space Invaders 8080 runs at 2 MHz and the screen refreshes at 60 Hz */
+#define CPU_HZ 2000000
+#define FRAMES_PER_SECOND 60
+#define CYCLES_PER_FRAME (CPU_HZ / FRAMES_PER_SECOND)
+
+/* The video hardware interrupts with RST 1 when the beam reaches the middle
+ * of the screen and with RST 2 when it reaches the end (vblank) */
+#define MID_SCREEN_RST 1
+#define END_SCREEN_RST 2
+
+/* kinds of flag-setting ALU operations */
+#define ALU_NONE 0
+#define ALU_ADD 1	// ADD, ADC, ADI, ACI and DAA
+#define ALU_SUB 2	// SUB, SBB, SUI, SBI, CMP and CPI
+#define ALU_AND 3	// ANA and ANI
+#define ALU_LOGIC 4	// XRA, XRI, ORA and ORI
+#define ALU_INR 5
+#define ALU_DCR 6
+
+/* The flags are kept in one byte laid out as the low byte of PSW, the way
+ * PUSH PSW stores them; bits 3 and 5 always read as zero and bit 1 as one */
+#define FLAG_S 0x80	// sign flag
+#define FLAG_Z 0x40	// zero flag
+#define FLAG_AC 0x10	// auxiliary carry flag
+#define FLAG_P 0x04	// parity flag
+#define FLAG_ALWAYS 0x02
+#define FLAG_C 0x01	// carry flag
+#define FLAGS_MASK (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_C)
+#define FLAGS_SZAP (FLAGS_MASK & ~FLAG_C)	// all but carry, as INR and DCR
+
+/* Cycles taken by an instruction; the two differ only for the conditional
+ * calls and returns, which take longer when their condition holds */
+typedef struct Cycles {
+	uint8_t cycles;		// condition fails, or unconditional
+	uint8_t taken;		// condition holds
+} Cycles;
+
+/* The last flag-setting ALU operation; in lazy flags mode the flag byte is
+ * only brought up to date from it when an instruction reads the flags */
+typedef struct LazyFlags {
+	uint8_t op;		// ALU_NONE when the flag byte is up to date
+	uint8_t a;		// first operand
+	uint8_t value;		// second operand
+	uint16_t result;	// result with the carry out in bit 8
+} LazyFlags;
+
+/* Space Invaders I/O hardware as seen through the IN and OUT instructions */
+typedef struct Ports {
+	uint8_t in[4];		// input ports 0-3; written by the machine
+	uint8_t out[8];		// last byte written to each output port
+	uint16_t shift;		// external shift register (ports 2, 3 and 4)
+	uint8_t shift_offset;	// shift amount written to port 2
+} Ports;
+
+/* The CPU and I/O part of a savestate: the registers, flags, interrupt
+ * state, cycle counter and I/O hardware */
+typedef struct SavedCpu {
+	uint64_t cycles;
+	uint16_t bc;
+	uint16_t de;
+	uint16_t hl;
+	uint16_t sp;
+	uint16_t pc;
+	uint8_t a;
+	uint8_t flags;
+	uint8_t int_enable;
+	uint8_t int_pending;
+	uint8_t int_vector;
+	uint8_t halted;
+	struct Ports ports;
+} SavedCpu;
+
+/* A savestate of a Space Invaders machine: the CPU, then RAM and VRAM, in
+ * one block of fixed size without pointers, so that it can be copied,
+ * compared and written out as it is */
+#define SAVESTATE_RAM_SIZE (MIRROR_START - RAM_START)
+
+typedef struct Savestate {
+	struct SavedCpu cpu;
+	uint8_t ram[SAVESTATE_RAM_SIZE];	// 0x2000 to 0x3FFF
+} Savestate;
+
+/* The I/O hardware of the machine the CPU is in, as seen through IN and
+ * OUT */
+typedef uint8_t (*PortIn)(struct State8080 *state, uint8_t port);
+typedef void (*PortOut)(struct State8080 *state, uint8_t port, uint8_t value);
+
+/* A register pair whose halves overlay its 16-bit value, high and low byte
+ * in the order the host stores a uint16_t, so that the pair and each
+ * register can be read and written directly */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REGISTER_PAIR(pair, high, low) \
+	union { uint16_t pair; struct { uint8_t high; uint8_t low; }; }
+#else
+#define REGISTER_PAIR(pair, high, low) \
+	union { uint16_t pair; struct { uint8_t low; uint8_t high; }; }
+#endif
+
+typedef struct State8080 {
+	/* a to l are the 8 bit working registers; the instruction set refers to
+	register pairs in the following way:
+	AF - PSW
+	BC - B
+	DE - D
+	HL - H */
+	uint8_t a;
+	REGISTER_PAIR(bc, b, c);
+	REGISTER_PAIR(de, d, e);
+	REGISTER_PAIR(hl, h, l);
+	uint16_t sp;
+	uint16_t pc;
+	uint8_t flags;		// FLAG_S to FLAG_C as in the low byte of PSW
+	struct LazyFlags lazy;
+	uint8_t int_enable;	// set by EI and cleared by DI
+	uint8_t int_pending;	// an interrupt is waiting for EI
+	uint8_t int_vector;	// RST number of the waiting interrupt
+	uint8_t halted;		// set by HLT until the next interrupt
+	uint8_t stop;		// ends the current run after this instruction
+	uint64_t cycles;	// cycles taken since the CPU was reset
+	struct Ports ports;
+	PortIn in;		// MachineIn() on Space Invaders
+	PortOut out;		// MachineOut() on Space Invaders
+	struct Memory *memory;
+	struct BlockCache *blocks;	// NULL to fetch every instruction from memory
+	struct Jit *jit;	// NULL to interpret
+	struct Rom *rom;	// the ROM it opened itself, or NULL if it shares one
+} State8080;
+
+/* one handler function per opcode, called through a 256-entry table; each
+ * handler returns the cycles taken */
+typedef int (*Handler)(struct State8080 *state, const uint8_t *instruction);
+
+extern const struct Cycles cycles_table[];
+extern const uint8_t length_table[];
+#if EMULATOR_DISPATCH == DISPATCH_TABLE || EMULATOR_JIT
+extern const Handler handlers[];	// superinstructions after the opcodes
+#endif
+
+int Run8080(struct State8080 *state, int cycle_budget);
+int Run8080Until(struct State8080 *state, uint64_t deadline);
+int Emulate(struct State8080 *state);
+void State8080Interrupt(struct State8080 *state, uint8_t n);
+void State8080SyncFlags(struct State8080 *state);
+void State8080SaveCpu(struct State8080 *state, struct SavedCpu *cpu);
+void State8080RestoreCpu(struct State8080 *state, const struct SavedCpu *cpu);
+void State8080Save(struct State8080 *state, struct Savestate *save);
+void State8080Restore(struct State8080 *state, const struct Savestate *save);
+struct Block *State8080Block(struct State8080 *state, uint16_t pc);
+void State8080DecodeRom(struct State8080 *state);
+int EndsBlock(uint8_t opcode);
+uint8_t MachineIn(struct State8080 *state, uint8_t port);
+void MachineOut(struct State8080 *state, uint8_t port, uint8_t value);
+void MachineInit(struct State8080 *state, struct Scheduler *scheduler);
+void MachineResume(struct State8080 *state, struct Scheduler *scheduler);
+void MachineRun(struct State8080 *state, struct Scheduler *scheduler,
+	uint64_t until);
+
+#endif
@@ -0,0 +1,335 @@
+/* Video.c
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Turns the 1bpp VRAM of Space Invaders into a framebuffer the right way up,
+ * with the colored gel overlay of the cabinet.
+ */
+
+#include <string.h>
+#include "Video.h"
+
+/* SSE2 is part of x86-64; AVX2 is checked for before it is used, so the
+ * rest of the emulator is still built for any x86-64 */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define VIDEO_SIMD 1
+#include <immintrin.h>
+#else
+#define VIDEO_SIMD 0
+#endif
+
+/* VRAM holds 224 lines of 32 bytes, each byte 8 pixels lowest bit first;
+ * line x is column x of the framebuffer, drawn from the bottom up */
+#define VRAM_LINE 32
+#define ROW_WORDS (VIDEO_WIDTH / 16)	// 16-bit words in a row of bits
+
+const uint32_t video_palette[VIDEO_COLORS] = {
+	[VIDEO_BLACK] = 0xFF000000,
+	[VIDEO_WHITE] = 0xFFFFFFFF,
+	[VIDEO_RED] = 0xFF0000FF,
+	[VIDEO_GREEN] = 0xFF00FF00
+};
+
+/* the bands of the gel, from the top of the screen down */
+#define BAND_CLEAR 0		// white
+#define BAND_SAUCER 1		// red
+#define BAND_SHIELDS 2		// green, over the shields and the player
+#define BAND_RESERVE 3		// green over the reserve cannons, not the credits
+
+/* Returns the band of the gel over row y of the framebuffer */
+static int VideoBand(int y)
+{
+	if (y >= 32 && y < 64) {
+		return BAND_SAUCER;
+	}
+	if (y >= 184 && y < 240) {
+		return BAND_SHIELDS;
+	}
+	return y >= 240 ? BAND_RESERVE : BAND_CLEAR;
+}
+
+/* Returns the color of the gel over pixel x of a row in band */
+static int VideoGel(int x, int band)
+{
+	switch (band) {
+	case BAND_SAUCER:
+		return VIDEO_RED;
+	case BAND_SHIELDS:
+		return VIDEO_GREEN;
+	case BAND_RESERVE:
+		return x >= 16 && x < 134 ? VIDEO_GREEN : VIDEO_WHITE;
+	}
+	return VIDEO_WHITE;
+}
+
+/* Returns the pixel at x, y of the framebuffer */
+static int VideoPixel(const uint8_t *vram, int x, int y)
+{
+	int bit = VIDEO_HEIGHT - 1 - y;
+
+	return (vram[x * VRAM_LINE + bit / 8] >> (bit % 8)) & 1;
+}
+
+/* Converts pixel by pixel; the reference for the other paths */
+static void VideoScalar(const uint8_t *vram, void *frame, int format)
+{
+	uint32_t *rgba = frame;
+	uint8_t *indexed = frame;
+	int x;
+	int y;
+
+	for (y = 0; y < VIDEO_HEIGHT; y++) {
+		for (x = 0; x < VIDEO_WIDTH; x++) {
+			int color = VideoPixel(vram, x, y) ?
+				VideoGel(x, VideoBand(y)) : VIDEO_BLACK;
+
+			if (format == VIDEO_RGBA) {
+				rgba[y * VIDEO_WIDTH + x] = video_palette[color];
+			} else {
+				indexed[y * VIDEO_WIDTH + x] = color;
+			}
+		}
+	}
+}
+
+#if VIDEO_SIMD
+#define AVX2 __attribute__((target("avx2")))
+#define SPREAD 0x0101010101010101ULL	// times a byte puts it in every byte
+
+/* The gel of a row of the framebuffer in either format, rebuilt only when
+ * the band changes */
+typedef struct GelRow {
+	int band;		// the band it was built for, or -1
+	uint32_t rgba[VIDEO_WIDTH];
+	uint8_t indexed[VIDEO_WIDTH];
+} GelRow;
+
+/* Makes gel the colors of row y */
+static void VideoGelRow(struct GelRow *gel, int y)
+{
+	int band = VideoBand(y);
+	int x;
+
+	if (band == gel->band) {
+		return;
+	}
+	for (x = 0; x < VIDEO_WIDTH; x++) {
+		gel->indexed[x] = VideoGel(x, band);
+		gel->rgba[x] = video_palette[gel->indexed[x]];
+	}
+	gel->band = band;
+}
+
+/* Transposes the 16x16 bytes of a[] in place, so that a[j] holds byte j of
+ * every row; each round interleaves a[i] with a[i + 8], which turns the
+ * 8-bit index of a byte, row then column, one bit to the left */
+#define TRANSPOSE16(a, unpacklo, unpackhi, type) do { \
+	type t_[16]; \
+	int round_; \
+	int i_; \
+	for (round_ = 0; round_ < 4; round_++) { \
+		for (i_ = 0; i_ < 8; i_++) { \
+			t_[2 * i_] = unpacklo((a)[i_], (a)[i_ + 8]); \
+			t_[2 * i_ + 1] = unpackhi((a)[i_], (a)[i_ + 8]); \
+		} \
+		memcpy((a), t_, sizeof(t_)); \
+	} \
+} while (0)
+
+/* Turns VRAM into rows of bits, a row of the framebuffer each with bit k of
+ * word g the pixel at x = 16 * g + k. Sixteen lines of VRAM are transposed a
+ * half line at a time, which brings each byte column into one vector whose
+ * sign bits are then a row of 16 pixels, the next row once doubled. */
+static void VideoTransposeSse2(const uint8_t *vram,
+	uint16_t rows[VIDEO_HEIGHT][ROW_WORDS])
+{
+	int g;
+
+	for (g = 0; g < ROW_WORDS; g++) {
+		int half;
+
+		for (half = 0; half < VRAM_LINE; half += 16) {
+			__m128i a[16];
+			int j;
+			int k;
+
+			for (k = 0; k < 16; k++) {
+				a[k] = _mm_loadu_si128((const __m128i *)
+					(vram + (g * 16 + k) * VRAM_LINE + half));
+			}
+			TRANSPOSE16(a, _mm_unpacklo_epi8, _mm_unpackhi_epi8, __m128i);
+			for (j = 0; j < 16; j++) {
+				int bit = (half + j) * 8 + 7;
+
+				for (k = 0; k < 8; k++, bit--) {
+					rows[VIDEO_HEIGHT - 1 - bit][g] =
+						_mm_movemask_epi8(a[j]);
+					a[j] = _mm_add_epi8(a[j], a[j]);
+				}
+			}
+		}
+	}
+}
+
+/* Does what VideoTransposeSse2() does with whole lines, as the unpacks of
+ * AVX2 work on the halves of a vector apart */
+AVX2 static void VideoTransposeAvx2(const uint8_t *vram,
+	uint16_t rows[VIDEO_HEIGHT][ROW_WORDS])
+{
+	int g;
+
+	for (g = 0; g < ROW_WORDS; g++) {
+		__m256i a[16];
+		int j;
+		int k;
+
+		for (k = 0; k < 16; k++) {
+			a[k] = _mm256_loadu_si256((const __m256i *)
+				(vram + (g * 16 + k) * VRAM_LINE));
+		}
+		TRANSPOSE16(a, _mm256_unpacklo_epi8, _mm256_unpackhi_epi8,
+			__m256i);
+		for (j = 0; j < 16; j++) {
+			int bit = j * 8 + 7;
+
+			for (k = 0; k < 8; k++, bit--) {
+				uint32_t mask = _mm256_movemask_epi8(a[j]);
+
+				rows[VIDEO_HEIGHT - 1 - bit][g] = mask;
+				rows[VIDEO_HEIGHT - 1 - bit - 128][g] = mask >> 16;
+				a[j] = _mm256_add_epi8(a[j], a[j]);
+			}
+		}
+	}
+}
+
+/* Expands the rows of bits into frame, each set bit taking the color of its
+ * gel, 4 RGBA or 16 indexed pixels at a time */
+static void VideoExpandSse2(uint16_t rows[VIDEO_HEIGHT][ROW_WORDS],
+	void *frame, int format)
+{
+	const __m128i select4 = _mm_set_epi32(8, 4, 2, 1);
+	const __m128i select16 = _mm_set1_epi64x(0x8040201008040201LL);
+	const __m128i black = _mm_set1_epi32(video_palette[VIDEO_BLACK]);
+	struct GelRow gel = { .band = -1 };
+	int x;
+	int y;
+
+	for (y = 0; y < VIDEO_HEIGHT; y++) {
+		const uint8_t *bits = (const uint8_t *)rows[y];
+
+		VideoGelRow(&gel, y);
+		if (format == VIDEO_RGBA) {
+			uint32_t *out = (uint32_t *)frame + y * VIDEO_WIDTH;
+
+			for (x = 0; x < VIDEO_WIDTH; x += 4) {
+				__m128i set = _mm_set1_epi32((bits[x / 8] >> (x % 8)) & 0xF);
+				__m128i mask = _mm_cmpeq_epi32(_mm_and_si128(set, select4),
+					select4);
+				__m128i gels = _mm_loadu_si128((const __m128i *)
+					(gel.rgba + x));
+
+				_mm_storeu_si128((__m128i *)(out + x), _mm_or_si128(
+					_mm_and_si128(mask, gels), black));
+			}
+		} else {
+			uint8_t *out = (uint8_t *)frame + y * VIDEO_WIDTH;
+
+			for (x = 0; x < VIDEO_WIDTH; x += 16) {
+				__m128i set = _mm_set_epi64x(bits[x / 8 + 1] * SPREAD,
+					bits[x / 8] * SPREAD);
+				__m128i mask = _mm_cmpeq_epi8(_mm_and_si128(set, select16),
+					select16);
+				__m128i gels = _mm_loadu_si128((const __m128i *)
+					(gel.indexed + x));
+
+				_mm_storeu_si128((__m128i *)(out + x),
+					_mm_and_si128(mask, gels));
+			}
+		}
+	}
+}
+
+/* Does what VideoExpandSse2() does 8 RGBA or 32 indexed pixels at a time */
+AVX2 static void VideoExpandAvx2(uint16_t rows[VIDEO_HEIGHT][ROW_WORDS],
+	void *frame, int format)
+{
+	const __m256i select8 = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+	const __m256i select32 = _mm256_set1_epi64x(0x8040201008040201LL);
+	const __m256i black = _mm256_set1_epi32(video_palette[VIDEO_BLACK]);
+	struct GelRow gel = { .band = -1 };
+	int x;
+	int y;
+
+	for (y = 0; y < VIDEO_HEIGHT; y++) {
+		const uint8_t *bits = (const uint8_t *)rows[y];
+
+		VideoGelRow(&gel, y);
+		if (format == VIDEO_RGBA) {
+			uint32_t *out = (uint32_t *)frame + y * VIDEO_WIDTH;
+
+			for (x = 0; x < VIDEO_WIDTH; x += 8) {
+				__m256i set = _mm256_set1_epi32(bits[x / 8]);
+				__m256i mask = _mm256_cmpeq_epi32(
+					_mm256_and_si256(set, select8), select8);
+				__m256i gels = _mm256_loadu_si256((const __m256i *)
+					(gel.rgba + x));
+
+				_mm256_storeu_si256((__m256i *)(out + x), _mm256_or_si256(
+					_mm256_and_si256(mask, gels), black));
+			}
+		} else {
+			uint8_t *out = (uint8_t *)frame + y * VIDEO_WIDTH;
+
+			for (x = 0; x < VIDEO_WIDTH; x += 32) {
+				__m256i set = _mm256_set_epi64x(bits[x / 8 + 3] * SPREAD,
+					bits[x / 8 + 2] * SPREAD, bits[x / 8 + 1] * SPREAD,
+					bits[x / 8] * SPREAD);
+				__m256i mask = _mm256_cmpeq_epi8(
+					_mm256_and_si256(set, select32), select32);
+				__m256i gels = _mm256_loadu_si256((const __m256i *)
+					(gel.indexed + x));
+
+				_mm256_storeu_si256((__m256i *)(out + x),
+					_mm256_and_si256(mask, gels));
+			}
+		}
+	}
+}
+#endif
+
+/* Returns the fastest path the host can run */
+int VideoBestPath(void)
+{
+#if VIDEO_SIMD
+	return __builtin_cpu_supports("avx2") ? VIDEO_AVX2 : VIDEO_SSE2;
+#else
+	return VIDEO_SCALAR;
+#endif
+}
+
+/* Converts the VRAM_SIZE bytes of VRAM at vram into the VIDEO_WIDTH by
+ * VIDEO_HEIGHT pixels of frame, in format, by path; a path the host cannot
+ * run falls back to the best one it can */
+void VideoConvert(const uint8_t *vram, void *frame, int format, int path)
+{
+#if VIDEO_SIMD
+	uint16_t rows[VIDEO_HEIGHT][ROW_WORDS];
+
+	if (path > VideoBestPath()) {
+		path = VideoBestPath();
+	}
+	switch (path) {
+	case VIDEO_SSE2:
+		VideoTransposeSse2(vram, rows);
+		VideoExpandSse2(rows, frame, format);
+		return;
+	case VIDEO_AVX2:
+		VideoTransposeAvx2(vram, rows);
+		VideoExpandAvx2(rows, frame, format);
+		return;
+	}
+#else
+	(void)path;
+#endif
+	VideoScalar(vram, frame, format);
+}
@@ -0,0 +1,39 @@
+/* Video.h
+ * Author: Dickson Wong
+ * Last Updated: December 09
+ * Turns the 1bpp VRAM of Space Invaders into a framebuffer the right way up,
+ * with the colored gel overlay of the cabinet.
+ */
+
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <stdint.h>
+
+/* the monitor is mounted on its side, so the 256x224 raster in VRAM is shown
+ * turned 90 degrees counterclockwise */
+#define VIDEO_WIDTH 224
+#define VIDEO_HEIGHT 256
+
+/* framebuffer formats */
+#define VIDEO_RGBA 0		// uint32_t pixels, bytes R, G, B, A in memory
+#define VIDEO_INDEXED 1		// uint8_t pixels, VIDEO_BLACK and so on
+
+/* the colors of an indexed framebuffer */
+#define VIDEO_BLACK 0
+#define VIDEO_WHITE 1
+#define VIDEO_RED 2
+#define VIDEO_GREEN 3
+#define VIDEO_COLORS 4
+
+/* ways of converting, the reference first */
+#define VIDEO_SCALAR 0
+#define VIDEO_SSE2 1
+#define VIDEO_AVX2 2
+
+extern const uint32_t video_palette[VIDEO_COLORS];	// RGBA of each color
+
+int VideoBestPath(void);
+void VideoConvert(const uint8_t *vram, void *frame, int format, int path);
+
+#endif